@@ -0,0 +1,387 @@
+#pragma once
+#include "stdafx.h"
+
+#include "IASTNode.hpp"
+#include "ASTUtility.hpp"
+#include "MemoryPool.hpp"
+
+#include "Utility.hpp"
+
+/*
+Evaluates expressions on literals before compiling, and replaces them with the resulting literal.
+Results must be exactly what the compiled code would compute, so anything not well defined (division by 0, etc.)
+is left for runtime.
+*/
+namespace MyScript
+{
+	class ASTConstantFolder
+		: mystd::NonCopyable
+	{
+	protected:
+		MemoryPool*					m_pMemoryPool = nullptr;
+
+		//	Script functions defined so far. Calls to these are never folded as builtins.
+		std::set<llvm::StringRef>	m_scriptFunctions;
+
+		//	Called with calls to script functions, arguments already folded. Return the folded node or pNode.
+		virtual IASTNode* FoldScriptCall(ASTCallNode* pNode)
+		{
+			return pNode;
+		}
+		//	Called once a function body has been folded, in definition order
+		virtual void RegisterFunction(ASTFunctionNode* pNode)
+		{
+			m_scriptFunctions.insert(pNode->m_name);
+		}
+
+		ASTIntegerNode* MakeInteger(int value)
+		{
+			ASTIntegerNode* pNode = m_pMemoryPool->Alloc<ASTIntegerNode>()();
+			pNode->m_value = value;
+			return pNode;
+		}
+		ASTFloatNode* MakeFloat(float value)
+		{
+			ASTFloatNode* pNode = m_pMemoryPool->Alloc<ASTFloatNode>()();
+			pNode->m_value = value;
+			return pNode;
+		}
+		ASTBooleanNode* MakeBoolean(bool value)
+		{
+			ASTBooleanNode* pNode = m_pMemoryPool->Alloc<ASTBooleanNode>()();
+			pNode->m_value = value;
+			return pNode;
+		}
+		ASTNullNode* MakeNull()
+		{
+			return m_pMemoryPool->Alloc<ASTNullNode>()();
+		}
+		//	value does not include the null terminator
+		ASTStringNode* MakeString(llvm::ArrayRef<uint16_t> value)
+		{
+			ASTStringNode* pNode = m_pMemoryPool->Alloc<ASTStringNode>()(m_pMemoryPool);
+			pNode->m_value.reserve(value.size() + 1);
+			pNode->m_value.insert(pNode->m_value.end(), value.begin(), value.end());
+			pNode->m_value.push_back(0);
+			return pNode;
+		}
+
+		//	True if pNode is a string literal or null. pValue receives characters without null terminator.
+		bool GetStringLiteral(IASTNode* pNode, bool* pIsNull, llvm::ArrayRef<uint16_t>* pValue)
+		{
+			if (is_type<ASTNullNode>(pNode))
+			{
+				*pIsNull = true;
+				*pValue = llvm::ArrayRef<uint16_t>();
+				return true;
+			}
+			else if (is_type<ASTStringNode>(pNode))
+			{
+				*pIsNull = false;
+				*pValue = llvm::ArrayRef<uint16_t>(dynamic_cast<ASTStringNode*>(pNode)->m_value).drop_back();
+				return true;
+			}
+			return false;
+		}
+
+		//	Value of a numeric/boolean literal once converted to bool (as done by 'and'/'or')
+		bool GetTruthValue(IASTNode* pNode, bool* pValue)
+		{
+			if (is_type<ASTBooleanNode>(pNode))
+				*pValue = dynamic_cast<ASTBooleanNode*>(pNode)->m_value;
+			else if (is_type<ASTIntegerNode>(pNode))
+				*pValue = dynamic_cast<ASTIntegerNode*>(pNode)->m_value != 0;
+			else if (is_type<ASTFloatNode>(pNode))
+				*pValue = dynamic_cast<ASTFloatNode*>(pNode)->m_value != 0.0f;
+			else
+				return false;
+
+			return true;
+		}
+
+		IASTNode* FoldInteger(MSOperator op, int lhs, int rhs)
+		{
+			//	Wrap around like the generated code does
+			unsigned int ulhs = static_cast<unsigned int>(lhs);
+			unsigned int urhs = static_cast<unsigned int>(rhs);
+
+			switch (op)
+			{
+			case MSOperator::MS_OPERATOR_ADD:
+				return MakeInteger(static_cast<int>(ulhs + urhs));
+			case MSOperator::MS_OPERATOR_SUBTRACT:
+				return MakeInteger(static_cast<int>(ulhs - urhs));
+			case MSOperator::MS_OPERATOR_MULTIPLY:
+				return MakeInteger(static_cast<int>(ulhs * urhs));
+			case MSOperator::MS_OPERATOR_DIVIDE:
+				if (rhs == 0 || (lhs == INT_MIN && rhs == -1))
+					return nullptr;
+				return MakeInteger(lhs / rhs);
+			case MSOperator::MS_OPERATOR_MODULO:
+				if (rhs == 0 || (lhs == INT_MIN && rhs == -1))
+					return nullptr;
+				return MakeInteger(lhs % rhs);
+			case MSOperator::MS_OPERATOR_EQUALITY:
+				return MakeBoolean(lhs == rhs);
+			case MSOperator::MS_OPERATOR_INEQUALITY:
+				return MakeBoolean(lhs != rhs);
+			case MSOperator::MS_OPERATOR_GREATER:
+				return MakeBoolean(lhs > rhs);
+			case MSOperator::MS_OPERATOR_LESSER:
+				return MakeBoolean(lhs < rhs);
+			case MSOperator::MS_OPERATOR_GREATEREQUAL:
+				return MakeBoolean(lhs >= rhs);
+			case MSOperator::MS_OPERATOR_LESSEREQUAL:
+				return MakeBoolean(lhs <= rhs);
+			default:
+				return nullptr;
+			}
+		}
+		IASTNode* FoldFloat(MSOperator op, float lhs, float rhs)
+		{
+			//	Comparisons are ordered ones, so always false with NaN
+			switch (op)
+			{
+			case MSOperator::MS_OPERATOR_ADD:
+				return MakeFloat(lhs + rhs);
+			case MSOperator::MS_OPERATOR_SUBTRACT:
+				return MakeFloat(lhs - rhs);
+			case MSOperator::MS_OPERATOR_MULTIPLY:
+				return MakeFloat(lhs * rhs);
+			case MSOperator::MS_OPERATOR_DIVIDE:
+				if (rhs == 0.0f)
+					return nullptr;
+				return MakeFloat(lhs / rhs);
+			case MSOperator::MS_OPERATOR_MODULO:
+				if (rhs == 0.0f)
+					return nullptr;
+				return MakeFloat(std::fmod(lhs, rhs));
+			case MSOperator::MS_OPERATOR_EQUALITY:
+				return MakeBoolean(lhs == rhs);
+			case MSOperator::MS_OPERATOR_INEQUALITY:
+				return MakeBoolean(lhs < rhs || lhs > rhs);
+			case MSOperator::MS_OPERATOR_GREATER:
+				return MakeBoolean(lhs > rhs);
+			case MSOperator::MS_OPERATOR_LESSER:
+				return MakeBoolean(lhs < rhs);
+			case MSOperator::MS_OPERATOR_GREATEREQUAL:
+				return MakeBoolean(lhs >= rhs);
+			case MSOperator::MS_OPERATOR_LESSEREQUAL:
+				return MakeBoolean(lhs <= rhs);
+			default:
+				return nullptr;
+			}
+		}
+
+		IASTNode* FoldExpression(ASTBinaryOperationNode* pNode)
+		{
+			pNode->m_expression1 = FoldExpression(pNode->m_expression1);
+			pNode->m_expression2 = FoldExpression(pNode->m_expression2);
+
+			IASTNode* result = FoldBinaryOperation(pNode->m_operator, pNode->m_expression1, pNode->m_expression2);
+			return result ? result : pNode;
+		}
+
+		IASTNode* FoldExpression(ASTCallNode* pNode)
+		{
+			FoldArguments(pNode);
+
+			if (m_scriptFunctions.count(pNode->m_name) != 0)
+				return FoldScriptCall(pNode);
+
+			IASTNode* result = FoldBuiltinCall(pNode->m_name, ASTNodeList(pNode->m_arguments));
+			return result ? result : pNode;
+		}
+
+		IASTNode* FoldExpression(IASTNode* pNode)
+		{
+			if (is_type<ASTBinaryOperationNode>(pNode))
+				return FoldExpression(dynamic_cast<ASTBinaryOperationNode*>(pNode));
+			else if (is_type<ASTCallNode>(pNode))
+				return FoldExpression(dynamic_cast<ASTCallNode*>(pNode));
+			else
+				return pNode;
+		}
+
+		void FoldArguments(ASTCallNode* pNode)
+		{
+			for (auto& pArgument : pNode->m_arguments)
+				pArgument = FoldExpression(pArgument);
+		}
+
+		void FoldStatements(pool_vector<IASTNode*>& statements)
+		{
+			for (auto pStatement : statements)
+				FoldStatement(pStatement);
+		}
+		void FoldStatement(IASTNode* pNode)
+		{
+			if (is_type<ASTAssignmentNode>(pNode))
+			{
+				ASTAssignmentNode* pAssignmentNode = dynamic_cast<ASTAssignmentNode*>(pNode);
+				pAssignmentNode->m_expression = FoldExpression(pAssignmentNode->m_expression);
+			}
+			else if (is_type<ASTReturnNode>(pNode))
+			{
+				ASTReturnNode* pReturnNode = dynamic_cast<ASTReturnNode*>(pNode);
+				pReturnNode->m_expression = FoldExpression(pReturnNode->m_expression);
+			}
+			else if (is_type<ASTIfNode>(pNode))
+			{
+				ASTIfNode* pIfNode = dynamic_cast<ASTIfNode*>(pNode);
+				pIfNode->m_expression = FoldExpression(pIfNode->m_expression);
+				FoldStatements(pIfNode->m_statements);
+				FoldStatements(pIfNode->m_elseStatements);
+			}
+			else if (is_type<ASTWhileNode>(pNode))
+			{
+				ASTWhileNode* pWhileNode = dynamic_cast<ASTWhileNode*>(pNode);
+				pWhileNode->m_expression = FoldExpression(pWhileNode->m_expression);
+				FoldStatements(pWhileNode->m_statements);
+			}
+			else if (is_type<ASTFunctionNode>(pNode))
+			{
+				ASTFunctionNode* pFunctionNode = dynamic_cast<ASTFunctionNode*>(pNode);
+				FoldStatements(pFunctionNode->m_statements);
+				RegisterFunction(pFunctionNode);
+			}
+			else if (is_type<ASTCallNode>(pNode))
+			{
+				//	Call statement must stay a call, only arguments can be folded
+				FoldArguments(dynamic_cast<ASTCallNode*>(pNode));
+			}
+		}
+	public:
+		ASTConstantFolder(MemoryPool* pMemoryPool)
+			: m_pMemoryPool(pMemoryPool)
+		{
+
+		}
+		virtual ~ASTConstantFolder()
+		{
+		}
+
+		//	Result of 'lhs op rhs' when both are literals, nullptr if it cannot be computed at compile time
+		IASTNode* FoldBinaryOperation(MSOperator op, IASTNode* lhs, IASTNode* rhs)
+		{
+			IASTNode* result = nullptr;
+
+			if (op == MSOperator::MS_OPERATOR_AND || op == MSOperator::MS_OPERATOR_OR)
+			{
+				bool lhsValue;
+				bool rhsValue;
+				if (GetTruthValue(lhs, &lhsValue) && GetTruthValue(rhs, &rhsValue))
+				{
+					if (op == MSOperator::MS_OPERATOR_AND)
+						result = MakeBoolean(lhsValue && rhsValue);
+					else
+						result = MakeBoolean(lhsValue || rhsValue);
+				}
+			}
+			else if (is_type<ASTIntegerNode>(lhs) && is_type<ASTIntegerNode>(rhs))
+			{
+				result = FoldInteger(op, dynamic_cast<ASTIntegerNode*>(lhs)->m_value, dynamic_cast<ASTIntegerNode*>(rhs)->m_value);
+			}
+			else if ((is_type<ASTIntegerNode>(lhs) || is_type<ASTFloatNode>(lhs)) && (is_type<ASTIntegerNode>(rhs) || is_type<ASTFloatNode>(rhs)))
+			{
+				//	int is converted to float when mixed
+				float lhsValue = is_type<ASTFloatNode>(lhs) ? dynamic_cast<ASTFloatNode*>(lhs)->m_value : static_cast<float>(dynamic_cast<ASTIntegerNode*>(lhs)->m_value);
+				float rhsValue = is_type<ASTFloatNode>(rhs) ? dynamic_cast<ASTFloatNode*>(rhs)->m_value : static_cast<float>(dynamic_cast<ASTIntegerNode*>(rhs)->m_value);
+				result = FoldFloat(op, lhsValue, rhsValue);
+			}
+			else if (is_type<ASTBooleanNode>(lhs) && is_type<ASTBooleanNode>(rhs))
+			{
+				bool lhsValue = dynamic_cast<ASTBooleanNode*>(lhs)->m_value;
+				bool rhsValue = dynamic_cast<ASTBooleanNode*>(rhs)->m_value;
+				if (op == MSOperator::MS_OPERATOR_EQUALITY)
+					result = MakeBoolean(lhsValue == rhsValue);
+				else if (op == MSOperator::MS_OPERATOR_INEQUALITY)
+					result = MakeBoolean(lhsValue != rhsValue);
+			}
+
+			return result;
+		}
+
+		//	Builtin string functions when all arguments are literals. Must behave like MSRuntime.
+		//	nullptr if it cannot be computed at compile time.
+		IASTNode* FoldBuiltinCall(llvm::StringRef name, ASTNodeList args)
+		{
+			bool isNull1, isNull2;
+			llvm::ArrayRef<uint16_t> s1, s2;
+
+			if (name == "strlen" && args.size() == 1)
+			{
+				if (GetStringLiteral(args[0], &isNull1, &s1))
+					return MakeInteger(s1.size());
+			}
+			else if (name == "strcmp" && args.size() == 2)
+			{
+				if (GetStringLiteral(args[0], &isNull1, &s1) && GetStringLiteral(args[1], &isNull2, &s2))
+				{
+					if (s1.size() != s2.size())
+						return MakeInteger(1);
+					if (s1 == s2)
+						return MakeInteger(0);
+					return MakeInteger(std::lexicographical_compare(s1.begin(), s1.end(), s2.begin(), s2.end()) ? -1 : 1);
+				}
+			}
+			else if (name == "strcat" && args.size() == 2)
+			{
+				if (GetStringLiteral(args[0], &isNull1, &s1) && GetStringLiteral(args[1], &isNull2, &s2))
+				{
+					//	Concatenating with null gives the other string
+					if (isNull1)
+						return args[1];
+					if (isNull2)
+						return args[0];
+
+					std::vector<uint16_t> value(s1.begin(), s1.end());
+					value.insert(value.end(), s2.begin(), s2.end());
+					return MakeString(value);
+				}
+			}
+			else if (name == "substr" && args.size() == 3)
+			{
+				if (GetStringLiteral(args[0], &isNull1, &s1) && is_type<ASTIntegerNode>(args[1]) && is_type<ASTIntegerNode>(args[2]))
+				{
+					long long start = dynamic_cast<ASTIntegerNode*>(args[1])->m_value;
+					long long len = dynamic_cast<ASTIntegerNode*>(args[2])->m_value;
+
+					if (isNull1 || s1.size() == 0)
+						return args[0];
+
+					//	Not defined by the runtime
+					if (start < 0)
+						return nullptr;
+
+					if (start + len > static_cast<long long>(s1.size()))
+						len = s1.size() - start;
+
+					if (len <= 0)
+						return MakeNull();
+
+					return MakeString(s1.slice(start, len));
+				}
+			}
+
+			return nullptr;
+		}
+
+		static bool IsBuiltin(llvm::StringRef name)
+		{
+			return name == "strlen" || name == "strcmp" || name == "strcat" || name == "substr";
+		}
+
+		void FoldAll(pool_vector<IASTNode*>& tree)
+		{
+			//	Builtins can be overridden by a script function, so never fold those
+			for (auto pNode : tree)
+			{
+				if (is_type<ASTFunctionNode>(pNode) && IsBuiltin(dynamic_cast<ASTFunctionNode*>(pNode)->m_name))
+					m_scriptFunctions.insert(dynamic_cast<ASTFunctionNode*>(pNode)->m_name);
+			}
+
+			FoldStatements(tree);
+		}
+	};
+}
@@ -0,0 +1,349 @@
+#pragma once
+#include "stdafx.h"
+
+#include "ASTConstantFolder.hpp"
+
+/*
+Constant folder that also runs calls to pure script functions at compile time, when all arguments are literals.
+Functions are interpreted on the AST, values being literal nodes. A function is pure if it only uses its
+arguments and local variables, and only calls builtins or other pure functions.
+Anything unexpected (type mismatch, budget exceeded, etc.) just leaves the call to runtime.
+*/
+namespace MyScript
+{
+	class ASTEvaluator
+		: public ASTConstantFolder
+	{
+		//	Maximum number of statements/expressions evaluated for a single call
+		static const int MaxSteps = 100000;
+		//	Maximum call depth
+		static const int MaxDepth = 64;
+		//	Maximum bytes of strings built for a single call, they stay in the memory pool until the script is compiled
+		static const size_t MaxStringBytes = 64 * 1024;
+
+		struct FunctionInfo
+		{
+			ASTFunctionNode*	pNode;
+			bool				isPure;
+		};
+		std::map<llvm::StringRef, FunctionInfo> m_functions;
+
+		struct Variable
+		{
+			MSType		type;
+			IASTNode*	value;
+		};
+		typedef std::map<llvm::StringRef, Variable> Frame;
+
+		enum class Status
+		{
+			Next,
+			Return,
+			Break,
+			Continue,
+			Failed,
+		};
+
+		int m_steps = 0;
+		int m_depth = 0;
+		size_t m_stringBytes = 0;
+
+		bool IsPureFunction(ASTFunctionNode* pNode)
+		{
+			std::set<llvm::StringRef> locals;
+			for (auto& argument : pNode->m_arguments)
+				locals.insert(argument.second);
+
+			auto f = [&](IASTNode* pChild)
+			{
+				if (is_type<ASTAssignmentNode>(pChild))
+				{
+					ASTAssignmentNode* pAssignmentNode = dynamic_cast<ASTAssignmentNode*>(pChild);
+					if (pAssignmentNode->m_type != MSType::MS_TYPE_VOID)
+						locals.insert(pAssignmentNode->m_name);
+					else if (locals.count(pAssignmentNode->m_name) == 0)
+						return false;	//	global written
+				}
+				else if (is_type<ASTNameNode>(pChild))
+				{
+					//	global read, may change at runtime
+					if (locals.count(dynamic_cast<ASTNameNode*>(pChild)->m_name) == 0)
+						return false;
+				}
+				else if (is_type<ASTCallNode>(pChild))
+				{
+					const llvm::StringRef& name = dynamic_cast<ASTCallNode*>(pChild)->m_name;
+					auto it = m_functions.find(name);
+					if (it != m_functions.end())
+						return it->second.isPure;
+
+					//	Host function, or builtin overridden later by the script
+					if (!IsBuiltin(name) || m_scriptFunctions.count(name) != 0)
+						return false;
+				}
+				return true;
+			};
+
+			//	Statements are visited in order, so declarations are seen before uses
+			return VisitAST(ASTNodeList(pNode->m_statements), f);
+		}
+
+		static bool IsValueOfType(IASTNode* pValue, MSType type)
+		{
+			switch (type)
+			{
+			case MSType::MS_TYPE_INTEGER:
+				return is_type<ASTIntegerNode>(pValue);
+			case MSType::MS_TYPE_FLOAT:
+				return is_type<ASTFloatNode>(pValue);
+			case MSType::MS_TYPE_BOOLEAN:
+				return is_type<ASTBooleanNode>(pValue);
+			case MSType::MS_TYPE_STRING:
+				return is_type<ASTStringNode>(pValue) || is_type<ASTNullNode>(pValue);
+			default:
+				return false;
+			}
+		}
+		static bool IsLiteral(IASTNode* pNode)
+		{
+			return is_type<ASTIntegerNode>(pNode) || is_type<ASTFloatNode>(pNode) || is_type<ASTBooleanNode>(pNode) ||
+				is_type<ASTStringNode>(pNode) || is_type<ASTNullNode>(pNode);
+		}
+
+		Variable* FindVariable(std::vector<Frame>& scopes, llvm::StringRef name)
+		{
+			for (auto it = scopes.rbegin(); it != scopes.rend(); ++it)
+			{
+				auto itVariable = it->find(name);
+				if (itVariable != it->end())
+					return &itVariable->second;
+			}
+			return nullptr;
+		}
+
+		//	Returns pValue, nullptr when it is a new string beyond the budget
+		IASTNode* CountString(IASTNode* pValue, llvm::ArrayRef<IASTNode*> operands)
+		{
+			if (!pValue || !is_type<ASTStringNode>(pValue) || std::find(operands.begin(), operands.end(), pValue) != operands.end())
+				return pValue;
+
+			m_stringBytes += dynamic_cast<ASTStringNode*>(pValue)->m_value.size() * sizeof(uint16_t);
+			return m_stringBytes <= MaxStringBytes ? pValue : nullptr;
+		}
+
+		//	Returns the literal value, nullptr on failure
+		IASTNode* Evaluate(IASTNode* pNode, std::vector<Frame>& scopes)
+		{
+			if (++m_steps > MaxSteps)
+				return nullptr;
+
+			if (IsLiteral(pNode))
+			{
+				return pNode;
+			}
+			else if (is_type<ASTNameNode>(pNode))
+			{
+				Variable* pVariable = FindVariable(scopes, dynamic_cast<ASTNameNode*>(pNode)->m_name);
+				return pVariable ? pVariable->value : nullptr;
+			}
+			else if (is_type<ASTBinaryOperationNode>(pNode))
+			{
+				ASTBinaryOperationNode* pBinaryNode = dynamic_cast<ASTBinaryOperationNode*>(pNode);
+				IASTNode* lhs = Evaluate(pBinaryNode->m_expression1, scopes);
+				if (!lhs)
+					return nullptr;
+
+				//	Same short-circuit as the generated code, right operand may not even be valid
+				bool lhsValue;
+				if (pBinaryNode->m_operator == MSOperator::MS_OPERATOR_AND && GetTruthValue(lhs, &lhsValue) && !lhsValue)
+					return MakeBoolean(false);
+				if (pBinaryNode->m_operator == MSOperator::MS_OPERATOR_OR && GetTruthValue(lhs, &lhsValue) && lhsValue)
+					return MakeBoolean(true);
+
+				IASTNode* rhs = Evaluate(pBinaryNode->m_expression2, scopes);
+				if (!rhs)
+					return nullptr;
+
+				return CountString(FoldBinaryOperation(pBinaryNode->m_operator, lhs, rhs), { lhs, rhs });
+			}
+			else if (is_type<ASTCallNode>(pNode))
+			{
+				ASTCallNode* pCallNode = dynamic_cast<ASTCallNode*>(pNode);
+
+				std::vector<IASTNode*> args;
+				for (auto pArgument : pCallNode->m_arguments)
+				{
+					IASTNode* value = Evaluate(pArgument, scopes);
+					if (!value)
+						return nullptr;
+					args.push_back(value);
+				}
+
+				auto it = m_functions.find(pCallNode->m_name);
+				if (it != m_functions.end())
+					return it->second.isPure ? Call(it->second.pNode, args) : nullptr;
+
+				return CountString(FoldBuiltinCall(pCallNode->m_name, args), args);
+			}
+
+			return nullptr;
+		}
+
+		Status Execute(ASTNodeList statements, std::vector<Frame>& scopes, IASTNode** pResult)
+		{
+			scopes.emplace_back();
+
+			Status status = Status::Next;
+			for (auto pStatement : statements)
+			{
+				status = Execute(pStatement, scopes, pResult);
+				if (status != Status::Next)
+					break;
+			}
+
+			scopes.pop_back();
+			return status;
+		}
+		Status Execute(IASTNode* pNode, std::vector<Frame>& scopes, IASTNode** pResult)
+		{
+			if (++m_steps > MaxSteps)
+				return Status::Failed;
+
+			if (is_type<ASTAssignmentNode>(pNode))
+			{
+				ASTAssignmentNode* pAssignmentNode = dynamic_cast<ASTAssignmentNode*>(pNode);
+				IASTNode* value = Evaluate(pAssignmentNode->m_expression, scopes);
+				if (!value)
+					return Status::Failed;
+
+				if (pAssignmentNode->m_type != MSType::MS_TYPE_VOID)
+				{
+					if (!IsValueOfType(value, pAssignmentNode->m_type))
+						return Status::Failed;
+
+					scopes.back()[pAssignmentNode->m_name] = { pAssignmentNode->m_type, value };
+				}
+				else
+				{
+					Variable* pVariable = FindVariable(scopes, pAssignmentNode->m_name);
+					if (!pVariable || !IsValueOfType(value, pVariable->type))
+						return Status::Failed;
+
+					pVariable->value = value;
+				}
+				return Status::Next;
+			}
+			else if (is_type<ASTIfNode>(pNode))
+			{
+				ASTIfNode* pIfNode = dynamic_cast<ASTIfNode*>(pNode);
+				IASTNode* condition = Evaluate(pIfNode->m_expression, scopes);
+				if (!condition || !is_type<ASTBooleanNode>(condition))
+					return Status::Failed;
+
+				if (dynamic_cast<ASTBooleanNode*>(condition)->m_value)
+					return Execute(ASTNodeList(pIfNode->m_statements), scopes, pResult);
+				else
+					return Execute(ASTNodeList(pIfNode->m_elseStatements), scopes, pResult);
+			}
+			else if (is_type<ASTWhileNode>(pNode))
+			{
+				ASTWhileNode* pWhileNode = dynamic_cast<ASTWhileNode*>(pNode);
+				while (true)
+				{
+					IASTNode* condition = Evaluate(pWhileNode->m_expression, scopes);
+					if (!condition || !is_type<ASTBooleanNode>(condition))
+						return Status::Failed;
+
+					if (!dynamic_cast<ASTBooleanNode*>(condition)->m_value)
+						return Status::Next;
+
+					Status status = Execute(ASTNodeList(pWhileNode->m_statements), scopes, pResult);
+					if (status == Status::Break)
+						return Status::Next;
+					if (status == Status::Return || status == Status::Failed)
+						return status;
+				}
+			}
+			else if (is_type<ASTReturnNode>(pNode))
+			{
+				*pResult = Evaluate(dynamic_cast<ASTReturnNode*>(pNode)->m_expression, scopes);
+				return *pResult ? Status::Return : Status::Failed;
+			}
+			else if (is_type<ASTBreakNode>(pNode))
+			{
+				return Status::Break;
+			}
+			else if (is_type<ASTContinueNode>(pNode))
+			{
+				return Status::Continue;
+			}
+			else if (is_type<ASTCallNode>(pNode))
+			{
+				//	Pure, so result can just be ignored
+				return Evaluate(pNode, scopes) ? Status::Next : Status::Failed;
+			}
+
+			return Status::Failed;
+		}
+
+		IASTNode* Call(ASTFunctionNode* pFunction, const std::vector<IASTNode*>& args)
+		{
+			if (args.size() != pFunction->m_arguments.size() || m_depth >= MaxDepth)
+				return nullptr;
+
+			std::vector<Frame> scopes(1);
+			for (int i = 0; i < args.size(); ++i)
+			{
+				if (!IsValueOfType(args[i], pFunction->m_arguments[i].first))
+					return nullptr;
+
+				scopes.back()[pFunction->m_arguments[i].second] = { pFunction->m_arguments[i].first, args[i] };
+			}
+
+			++m_depth;
+			IASTNode* result = nullptr;
+			Status status = Execute(ASTNodeList(pFunction->m_statements), scopes, &result);
+			--m_depth;
+
+			if (status != Status::Return || !IsValueOfType(result, pFunction->m_retType))
+				return nullptr;
+
+			return result;
+		}
+	protected:
+		IASTNode* FoldScriptCall(ASTCallNode* pNode) override
+		{
+			auto it = m_functions.find(pNode->m_name);
+			if (it == m_functions.end() || !it->second.isPure)
+				return pNode;
+
+			for (auto pArgument : pNode->m_arguments)
+			{
+				if (!IsLiteral(pArgument))
+					return pNode;
+			}
+
+			m_steps = 0;
+			m_depth = 0;
+			m_stringBytes = 0;
+
+			IASTNode* result = Call(it->second.pNode, std::vector<IASTNode*>(pNode->m_arguments.begin(), pNode->m_arguments.end()));
+			return result ? result : pNode;
+		}
+		void RegisterFunction(ASTFunctionNode* pNode) override
+		{
+			ASTConstantFolder::RegisterFunction(pNode);
+
+			FunctionInfo info;
+			info.pNode = pNode;
+			info.isPure = IsPureFunction(pNode);
+			m_functions[pNode->m_name] = info;
+		}
+	public:
+		ASTEvaluator(MemoryPool* pMemoryPool)
+			: ASTConstantFolder(pMemoryPool)
+		{
+
+		}
+	};
+}
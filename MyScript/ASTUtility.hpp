@@ -0,0 +1,121 @@
+#pragma once
+#include "stdafx.h"
+
+#include "IASTNode.hpp"
+
+#include "Utility.hpp"
+
+/*
+Helpers to walk and inspect the AST before compiling it.
+*/
+namespace MyScript
+{
+	typedef llvm::ArrayRef<IASTNode*> ASTNodeList;
+
+	template <typename F>
+	bool VisitAST(ASTNodeList nodes, F& f);
+
+	//	Call f on pNode, then on all its children. Stops as soon as f returns false, and return false in that case.
+	template <typename F>
+	bool VisitAST(IASTNode* pNode, F& f)
+	{
+		if (pNode == nullptr)
+			return true;
+
+		if (!f(pNode))
+			return false;
+
+		if (is_type<ASTAssignmentNode>(pNode))
+		{
+			return VisitAST(dynamic_cast<ASTAssignmentNode*>(pNode)->m_expression, f);
+		}
+		else if (is_type<ASTReturnNode>(pNode))
+		{
+			return VisitAST(dynamic_cast<ASTReturnNode*>(pNode)->m_expression, f);
+		}
+		else if (is_type<ASTBinaryOperationNode>(pNode))
+		{
+			ASTBinaryOperationNode* pBinaryNode = dynamic_cast<ASTBinaryOperationNode*>(pNode);
+			return VisitAST(pBinaryNode->m_expression1, f) && VisitAST(pBinaryNode->m_expression2, f);
+		}
+		else if (is_type<ASTCallNode>(pNode))
+		{
+			return VisitAST(ASTNodeList(dynamic_cast<ASTCallNode*>(pNode)->m_arguments), f);
+		}
+		else if (is_type<ASTIfNode>(pNode))
+		{
+			ASTIfNode* pIfNode = dynamic_cast<ASTIfNode*>(pNode);
+			return VisitAST(pIfNode->m_expression, f) &&
+				VisitAST(ASTNodeList(pIfNode->m_statements), f) &&
+				VisitAST(ASTNodeList(pIfNode->m_elseStatements), f);
+		}
+		else if (is_type<ASTWhileNode>(pNode))
+		{
+			ASTWhileNode* pWhileNode = dynamic_cast<ASTWhileNode*>(pNode);
+			return VisitAST(pWhileNode->m_expression, f) &&
+				VisitAST(ASTNodeList(pWhileNode->m_statements), f);
+		}
+		else if (is_type<ASTFunctionNode>(pNode))
+		{
+			return VisitAST(ASTNodeList(dynamic_cast<ASTFunctionNode*>(pNode)->m_statements), f);
+		}
+
+		return true;
+	}
+	template <typename F>
+	bool VisitAST(ASTNodeList nodes, F& f)
+	{
+		for (auto pNode : nodes)
+		{
+			if (!VisitAST(pNode, f))
+				return false;
+		}
+		return true;
+	}
+
+	//	True if variable 'name' is read or written by any of the nodes
+	inline bool IsNameReferenced(ASTNodeList nodes, llvm::StringRef name)
+	{
+		auto f = [&](IASTNode* pNode)
+		{
+			if (is_type<ASTNameNode>(pNode))
+				return dynamic_cast<ASTNameNode*>(pNode)->m_name != name;
+			if (is_type<ASTAssignmentNode>(pNode))
+				return dynamic_cast<ASTAssignmentNode*>(pNode)->m_name != name;
+			return true;
+		};
+		return !VisitAST(nodes, f);
+	}
+
+	//	True if any function of the script is declared with 'export'. Computed once per script.
+	inline bool UsesExport(ASTNodeList tree)
+	{
+		for (auto pChild : tree)
+		{
+			if (is_type<ASTFunctionNode>(pChild) && dynamic_cast<ASTFunctionNode*>(pChild)->m_isExported)
+				return true;
+		}
+		return false;
+	}
+
+	/*
+	Functions visible to the host. Scripts that do not use 'export' at all export every function,
+	otherwise only the ones declared with 'export'. usesExport is UsesExport of the script.
+	*/
+	inline bool IsFunctionExported(ASTFunctionNode* pNode, bool usesExport)
+	{
+		return pNode->m_isExported || !usesExport;
+	}
+
+	//	True if variable 'name' is assigned by any of the nodes
+	inline bool IsNameAssigned(ASTNodeList nodes, llvm::StringRef name)
+	{
+		auto f = [&](IASTNode* pNode)
+		{
+			if (is_type<ASTAssignmentNode>(pNode))
+				return dynamic_cast<ASTAssignmentNode*>(pNode)->m_name != name;
+			return true;
+		};
+		return !VisitAST(nodes, f);
+	}
+}
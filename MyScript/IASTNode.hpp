@@ -28,6 +28,8 @@ namespace MyScript
 		MSType								m_retType;
 		pool_vector<Argument>				m_arguments;
 		pool_vector<IASTNode*>				m_statements;
+		//	Declared with 'export'
+		bool								m_isExported = false;
 
 		template <typename T>
 		ASTFunctionNode(T& t)
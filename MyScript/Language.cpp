@@ -21,6 +21,7 @@ namespace MyScript
 		{ "import" },
 		{ "else" },
 		{ "function" },
+		{ "export" },
 		{ "return" },
 		{ "while" },
 		{ "break" },
@@ -0,0 +1,1005 @@
+#pragma once
+#include "stdafx.h"
+
+#include "IASTNode.hpp"
+#include "ASTUtility.hpp"
+
+//	MSCompileException, ScopeType
+#include "MSIRCompiler.hpp"
+
+#include "MSRuntime.h"
+
+/*
+Register based bytecode, compiled straight from the AST. Used for small scripts that run once,
+where compiling with LLVM takes much longer than running the script.
+Each function works on a window of registers. Calls pass arguments in consecutive registers of the
+caller, which become the first registers of the callee. Types are resolved at compile time, so each
+instruction works on a single type.
+*/
+namespace MyScript
+{
+	//	Register content. bool are stored as int 0/1.
+	union MSValue
+	{
+		int					i;
+		float				f;
+		MSHandleInternal*	s;
+	};
+
+	enum class MSOpcode : uint8_t
+	{
+		Move,				//	a = b
+		LoadConstant,		//	a = constants[b]
+		LoadGlobal,			//	a = globals[b]
+		StoreGlobal,		//	globals[a] = b
+		Increment,			//	hdlinc(a)
+		Decrement,			//	hdldec(a)
+
+		AddInt,				//	a = b op c
+		SubtractInt,
+		MultiplyInt,
+		DivideInt,
+		ModuloInt,
+		AddFloat,
+		SubtractFloat,
+		MultiplyFloat,
+		DivideFloat,
+		ModuloFloat,
+
+		EqualInt,			//	a = b op c, bool compare as int
+		NotEqualInt,
+		GreaterInt,
+		LesserInt,
+		GreaterEqualInt,
+		LesserEqualInt,
+		EqualFloat,
+		NotEqualFloat,
+		GreaterFloat,
+		LesserFloat,
+		GreaterEqualFloat,
+		LesserEqualFloat,
+
+		IntToFloat,			//	a = (float)b
+		FloatToInt,			//	a = (int)b
+		IntToBool,			//	a = b != 0
+		FloatToBool,		//	a = b != 0.0f
+		TruncateBool,		//	a = b & 1, result of arithmetic on bool
+
+		Jump,				//	pc = b
+		JumpIfFalse,		//	if (!a) pc = b
+		JumpIfTrue,			//	if (a) pc = b
+
+		StringLength,		//	a = strlen(b)
+		StringConcat,		//	a = strcat(b, b + 1)
+		StringCompare,		//	a = strcmp(b, b + 1)
+		Substring,			//	a = substr(b, b + 1, b + 2)
+
+		Call,				//	a = functions[b](c, c + 1, ...)
+		CallHost,			//	a = imports[b](c, c + 1, ...)
+		Return,				//	return a
+		ReturnVoid,
+	};
+
+	struct MSInstruction
+	{
+		MSOpcode	op;
+		uint16_t	a;
+		uint16_t	b;
+		uint16_t	c;
+	};
+
+	struct MSBytecodeFunction
+	{
+		std::string					name;
+		std::vector<MSInstruction>	code;
+		int							argumentCount = 0;
+		//	Size of the register window, arguments included
+		int							registerCount = 0;
+	};
+
+	/*
+	A compiled script. Function 0 is the entry point, running global statements.
+	Holds a reference on each string constant and string global.
+	*/
+	class MSBytecodeProgram
+		: mystd::NonCopyable
+	{
+	public:
+		std::vector<MSBytecodeFunction>	functions;
+		std::vector<MSSymbol>			imports;
+		std::vector<MSValue>			constants;
+		std::vector<MSValue>			globals;
+		std::vector<MSType>				globalTypes;
+		std::vector<MSHandleInternal*>	strings;
+
+		~MSBytecodeProgram()
+		{
+			for (int i = 0; i < globals.size(); ++i)
+			{
+				if (globalTypes[i] == MSType::MS_TYPE_STRING)
+					ms_rt_hdldec(globals[i].s);
+			}
+			for (auto s : strings)
+				ms_rt_hdldec(s);
+		}
+	};
+
+	/*
+	This translates an AST to bytecode. Follows the same rules as MSIRCompiler: symbols are visible once defined,
+	string arguments are borrowed by the callee, local strings are released when leaving their scope.
+	*/
+	class MSBytecodeCompiler
+		: mystd::NonCopyable
+	{
+		//	Registers and jump targets are 16 bits
+		static const int MaxOperand = UINT16_MAX;
+		//	Bigger scripts are compiled with LLVM, running them is likely to take longer than compiling them
+		static const int MaxInterpretedNodes = 4096;
+
+		enum class SymbolKind
+		{
+			Local,
+			Global,
+			Function,
+			Builtin,
+			Import,
+		};
+		enum class Builtin
+		{
+			StringLength,
+			StringConcat,
+			StringCompare,
+			Substring,
+		};
+		struct Symbol
+		{
+			SymbolKind	kind;
+			MSType		type;
+			//	Register, global, function, builtin or import index
+			int			index;
+			//	Local string holding its own reference, released when leaving the scope
+			bool		isOwned;
+		};
+		struct Scope
+		{
+			ScopeType							type;
+			std::map<llvm::StringRef, Symbol>	symbols;
+			//	First register not used by the locals of this scope
+			int									top;
+			//	Loop start, and jumps to patch with loop end
+			int									continueTarget = 0;
+			std::vector<int>					breakJumps;
+		};
+		//	Result of an expression
+		struct Operand
+		{
+			int		reg;
+			MSType	type;
+			//	Holds its own string reference, must be released once used
+			bool	isRValue;
+		};
+		//	Signature of script functions and builtins
+		struct Signature
+		{
+			MSType				returnType;
+			std::vector<MSType>	argumentTypes;
+		};
+
+		std::string m_name;
+		std::unique_ptr<MSBytecodeProgram> m_pProgram;
+
+		std::vector<Signature> m_builtinSignatures;
+		//	Same index as program functions
+		std::vector<Signature> m_functionSignatures;
+		std::vector<Scope> m_scopes;
+
+		//	Function being compiled
+		int m_function = 0;
+		int m_nextRegister = 0;
+
+		std::map<std::vector<uint16_t>, int> m_stringConstants;
+
+		//	Host symbols available to the script. Only added to the program when first referenced.
+		llvm::StringMap<MSSymbol*>	m_imports;
+		std::vector<MSSymbol*>		m_usedImports;
+
+		MSBytecodeFunction& GetFunction()
+		{
+			return m_pProgram->functions[m_function];
+		}
+
+		int GetCodeSize()
+		{
+			return GetFunction().code.size();
+		}
+		int Emit(MSOpcode op, int a = 0, int b = 0, int c = 0)
+		{
+			if (a > MaxOperand || b > MaxOperand || c > MaxOperand || GetCodeSize() >= MaxOperand)
+				throw MSCompileException("function too large for the interpreter");
+
+			MSInstruction instruction = { op, static_cast<uint16_t>(a), static_cast<uint16_t>(b), static_cast<uint16_t>(c) };
+			GetFunction().code.push_back(instruction);
+			return GetCodeSize() - 1;
+		}
+		//	Set the target of a jump to the next instruction
+		void PatchJump(int jump)
+		{
+			GetFunction().code[jump].b = static_cast<uint16_t>(GetCodeSize());
+		}
+
+		int AllocRegister()
+		{
+			int reg = m_nextRegister++;
+			if (reg > MaxOperand)
+				throw MSCompileException("function too large for the interpreter");
+
+			GetFunction().registerCount = std::max(GetFunction().registerCount, m_nextRegister);
+			return reg;
+		}
+
+		int AddConstant(MSValue value)
+		{
+			m_pProgram->constants.push_back(value);
+			return m_pProgram->constants.size() - 1;
+		}
+		//	Constant strings are shared, program keeps a reference on them
+		int GetConstantString(const pool_vector<uint16_t>& s)
+		{
+			std::vector<uint16_t> key(s.begin(), s.end());
+			auto it = m_stringConstants.find(key);
+			if (it != m_stringConstants.end())
+				return it->second;
+
+			MSValue value;
+			value.s = ms_rt_stralloc(reinterpret_cast<const wchar_t*>(s.data()), s.size() - 1);
+			m_pProgram->strings.push_back(value.s);
+
+			int index = AddConstant(value);
+			m_stringConstants[key] = index;
+			return index;
+		}
+
+		bool IsSymbolDefined(llvm::StringRef name)
+		{
+			for (auto it = m_scopes.rbegin(); it != m_scopes.rend(); ++it)
+			{
+				if (it->symbols.count(name) != 0)
+					return true;
+			}
+			return m_imports.count(name) != 0;
+		}
+		Symbol GetSymbol(llvm::StringRef name)
+		{
+			for (auto it = m_scopes.rbegin(); it != m_scopes.rend(); ++it)
+			{
+				auto itSymbol = it->symbols.find(name);
+				if (itSymbol != it->symbols.end())
+					return itSymbol->second;
+			}
+
+			auto itImport = m_imports.find(name);
+			if (itImport != m_imports.end())
+				return AddImport(itImport->second);
+
+			throw MSCompileException(("unresolved symbol " + name).str().c_str());
+		}
+		Symbol AddImport(MSSymbol* pSymbol)
+		{
+			if (pSymbol->type != MSSymbolType::MS_SYMBOL_FUNCTION)
+				throw MSCompileException((std::string("import not supported ") + pSymbol->name).c_str());
+
+			Symbol symbol = { SymbolKind::Import, pSymbol->functionData.resultType, static_cast<int>(m_pProgram->imports.size()), false };
+			m_pProgram->imports.push_back(*pSymbol);
+			m_usedImports.push_back(pSymbol);
+			m_scopes[0].symbols[pSymbol->name] = symbol;
+			return symbol;
+		}
+
+		void DeclareBuiltins()
+		{
+			struct
+			{
+				const char*	name;
+				Builtin		builtin;
+				Signature	signature;
+			} builtins[] =
+			{
+				{ "strlen", Builtin::StringLength, { MSType::MS_TYPE_INTEGER, { MSType::MS_TYPE_STRING } } },
+				{ "strcat", Builtin::StringConcat, { MSType::MS_TYPE_STRING, { MSType::MS_TYPE_STRING, MSType::MS_TYPE_STRING } } },
+				{ "strcmp", Builtin::StringCompare, { MSType::MS_TYPE_INTEGER, { MSType::MS_TYPE_STRING, MSType::MS_TYPE_STRING } } },
+				{ "substr", Builtin::Substring, { MSType::MS_TYPE_STRING, { MSType::MS_TYPE_STRING, MSType::MS_TYPE_INTEGER, MSType::MS_TYPE_INTEGER } } },
+			};
+			for (auto& builtin : builtins)
+			{
+				m_builtinSignatures.push_back(builtin.signature);
+				m_scopes[0].symbols[builtin.name] = { SymbolKind::Builtin, builtin.signature.returnType, static_cast<int>(builtin.builtin), false };
+			}
+		}
+		const Signature& GetSignature(const Symbol& symbol)
+		{
+			if (symbol.kind == SymbolKind::Builtin)
+				return m_builtinSignatures[symbol.index];
+			return m_functionSignatures[symbol.index];
+		}
+
+		void PushScope(ScopeType type)
+		{
+			Scope scope;
+			scope.type = type;
+			scope.top = m_nextRegister;
+			m_scopes.push_back(scope);
+		}
+		void PopScope()
+		{
+			m_scopes.pop_back();
+			m_nextRegister = m_scopes.back().top;
+		}
+		//	Release strings owned by the locals of a scope
+		void DestroyScopeVariables(int iScope)
+		{
+			for (auto& it : m_scopes[iScope].symbols)
+			{
+				if (it.second.kind == SymbolKind::Local && it.second.isOwned)
+					Emit(MSOpcode::Decrement, it.second.index);
+			}
+		}
+		int GetCurrentScope(ScopeType type)
+		{
+			for (int i = m_scopes.size() - 1; i >= 0; --i)
+			{
+				if (m_scopes[i].type == type)
+					return i;
+			}
+			return -1;
+		}
+
+		//	Operand converted to type, numeric types convert to each other
+		Operand Convert(Operand operand, MSType type)
+		{
+			if (operand.type == type)
+				return operand;
+
+			if (operand.type == MSType::MS_TYPE_STRING || type == MSType::MS_TYPE_STRING || operand.type == MSType::MS_TYPE_VOID || type == MSType::MS_TYPE_VOID)
+				throw MSCompileException("type mismatch");
+
+			Operand result = { AllocRegister(), type, true };
+			if (type == MSType::MS_TYPE_FLOAT)
+				Emit(MSOpcode::IntToFloat, result.reg, operand.reg);	//	bool is 0/1 already
+			else if (type == MSType::MS_TYPE_INTEGER)
+				Emit(operand.type == MSType::MS_TYPE_FLOAT ? MSOpcode::FloatToInt : MSOpcode::Move, result.reg, operand.reg);
+			else
+				Emit(operand.type == MSType::MS_TYPE_FLOAT ? MSOpcode::FloatToBool : MSOpcode::IntToBool, result.reg, operand.reg);
+			return result;
+		}
+		//	Same conversions as MSIRCompiler::ConvertValuesForOperation
+		MSType GetOperationType(MSType lhs, MSType rhs)
+		{
+			if (lhs == MSType::MS_TYPE_STRING || rhs == MSType::MS_TYPE_STRING || lhs == MSType::MS_TYPE_VOID || rhs == MSType::MS_TYPE_VOID)
+				throw MSCompileException("operands not supported");
+
+			if (lhs == rhs)
+				return lhs;
+			if (lhs == MSType::MS_TYPE_FLOAT || rhs == MSType::MS_TYPE_FLOAT)
+				return MSType::MS_TYPE_FLOAT;
+			return MSType::MS_TYPE_INTEGER;
+		}
+		//	Release a string temporary once it has been used
+		void ReleaseOperand(const Operand& operand)
+		{
+			if (operand.isRValue && operand.type == MSType::MS_TYPE_STRING)
+				Emit(MSOpcode::Decrement, operand.reg);
+		}
+
+		Operand CompileExpression(ASTNullNode* pNode)
+		{
+			MSValue value;
+			value.s = nullptr;
+
+			Operand result = { AllocRegister(), MSType::MS_TYPE_STRING, false };
+			Emit(MSOpcode::LoadConstant, result.reg, AddConstant(value));
+			return result;
+		}
+		Operand CompileExpression(ASTBooleanNode* pNode)
+		{
+			MSValue value;
+			value.i = pNode->m_value ? 1 : 0;
+
+			Operand result = { AllocRegister(), MSType::MS_TYPE_BOOLEAN, true };
+			Emit(MSOpcode::LoadConstant, result.reg, AddConstant(value));
+			return result;
+		}
+		Operand CompileExpression(ASTIntegerNode* pNode)
+		{
+			MSValue value;
+			value.i = pNode->m_value;
+
+			Operand result = { AllocRegister(), MSType::MS_TYPE_INTEGER, true };
+			Emit(MSOpcode::LoadConstant, result.reg, AddConstant(value));
+			return result;
+		}
+		Operand CompileExpression(ASTFloatNode* pNode)
+		{
+			MSValue value;
+			value.f = pNode->m_value;
+
+			Operand result = { AllocRegister(), MSType::MS_TYPE_FLOAT, true };
+			Emit(MSOpcode::LoadConstant, result.reg, AddConstant(value));
+			return result;
+		}
+		Operand CompileExpression(ASTStringNode* pNode)
+		{
+			//	Not an R-value, constant is owned by the program
+			Operand result = { AllocRegister(), MSType::MS_TYPE_STRING, false };
+			Emit(MSOpcode::LoadConstant, result.reg, GetConstantString(pNode->m_value));
+			return result;
+		}
+		Operand CompileExpression(ASTNameNode* pNode)
+		{
+			Symbol symbol = GetSymbol(pNode->m_name);
+			if (symbol.kind == SymbolKind::Local)
+			{
+				//	Used in place, no copy
+				Operand result = { symbol.index, symbol.type, false };
+				return result;
+			}
+			else if (symbol.kind == SymbolKind::Global)
+			{
+				Operand result = { AllocRegister(), symbol.type, false };
+				Emit(MSOpcode::LoadGlobal, result.reg, symbol.index);
+				return result;
+			}
+
+			throw MSCompileException((pNode->m_name + " is not a variable").str().c_str());
+		}
+		Operand CompileExpression(ASTBinaryOperationNode* pNode)
+		{
+			if (pNode->m_operator == MSOperator::MS_OPERATOR_AND || pNode->m_operator == MSOperator::MS_OPERATOR_OR)
+				return CompileLogicalOperation(pNode);
+
+			Operand lhs = CompileExpression(pNode->m_expression1);
+			Operand rhs = CompileExpression(pNode->m_expression2);
+
+			MSType type = GetOperationType(lhs.type, rhs.type);
+			Operand lhsValue = Convert(lhs, type);
+			Operand rhsValue = Convert(rhs, type);
+
+			bool isFloat = type == MSType::MS_TYPE_FLOAT;
+			MSOpcode op;
+			bool isArithmetic = true;
+			switch (pNode->m_operator)
+			{
+			case MSOperator::MS_OPERATOR_ADD:
+				op = isFloat ? MSOpcode::AddFloat : MSOpcode::AddInt;
+				break;
+			case MSOperator::MS_OPERATOR_SUBTRACT:
+				op = isFloat ? MSOpcode::SubtractFloat : MSOpcode::SubtractInt;
+				break;
+			case MSOperator::MS_OPERATOR_MULTIPLY:
+				op = isFloat ? MSOpcode::MultiplyFloat : MSOpcode::MultiplyInt;
+				break;
+			case MSOperator::MS_OPERATOR_DIVIDE:
+				op = isFloat ? MSOpcode::DivideFloat : MSOpcode::DivideInt;
+				break;
+			case MSOperator::MS_OPERATOR_MODULO:
+				op = isFloat ? MSOpcode::ModuloFloat : MSOpcode::ModuloInt;
+				break;
+			default:
+				isArithmetic = false;
+				switch (pNode->m_operator)
+				{
+				case MSOperator::MS_OPERATOR_EQUALITY:
+					op = isFloat ? MSOpcode::EqualFloat : MSOpcode::EqualInt;
+					break;
+				case MSOperator::MS_OPERATOR_INEQUALITY:
+					op = isFloat ? MSOpcode::NotEqualFloat : MSOpcode::NotEqualInt;
+					break;
+				case MSOperator::MS_OPERATOR_GREATER:
+					op = isFloat ? MSOpcode::GreaterFloat : MSOpcode::GreaterInt;
+					break;
+				case MSOperator::MS_OPERATOR_LESSER:
+					op = isFloat ? MSOpcode::LesserFloat : MSOpcode::LesserInt;
+					break;
+				case MSOperator::MS_OPERATOR_GREATEREQUAL:
+					op = isFloat ? MSOpcode::GreaterEqualFloat : MSOpcode::GreaterEqualInt;
+					break;
+				case MSOperator::MS_OPERATOR_LESSEREQUAL:
+					op = isFloat ? MSOpcode::LesserEqualFloat : MSOpcode::LesserEqualInt;
+					break;
+				default:
+					throw MSCompileException("operator not supported");
+				}
+			}
+
+			Operand result = { AllocRegister(), isArithmetic ? type : MSType::MS_TYPE_BOOLEAN, true };
+			Emit(op, result.reg, lhsValue.reg, rhsValue.reg);
+
+			//	bool arithmetic wraps like 1 bit integers
+			if (isArithmetic && type == MSType::MS_TYPE_BOOLEAN)
+				Emit(MSOpcode::TruncateBool, result.reg, result.reg);
+
+			return result;
+		}
+		//	Short-circuit 'and'/'or', right operand is only evaluated when the left one does not decide the result
+		Operand CompileLogicalOperation(ASTBinaryOperationNode* pNode)
+		{
+			Operand result = { AllocRegister(), MSType::MS_TYPE_BOOLEAN, true };
+
+			CompileCondition(pNode->m_expression1, result.reg);
+			int jump = Emit(pNode->m_operator == MSOperator::MS_OPERATOR_AND ? MSOpcode::JumpIfFalse : MSOpcode::JumpIfTrue, result.reg);
+
+			CompileCondition(pNode->m_expression2, result.reg);
+			PatchJump(jump);
+
+			return result;
+		}
+		//	Compile an expression to a bool in register reg
+		void CompileCondition(IASTNode* pNode, int reg)
+		{
+			Operand value = CompileExpression(pNode);
+			switch (value.type)
+			{
+			case MSType::MS_TYPE_BOOLEAN:
+				Emit(MSOpcode::Move, reg, value.reg);
+				break;
+			case MSType::MS_TYPE_INTEGER:
+				Emit(MSOpcode::IntToBool, reg, value.reg);
+				break;
+			case MSType::MS_TYPE_FLOAT:
+				Emit(MSOpcode::FloatToBool, reg, value.reg);
+				break;
+			default:
+				throw MSCompileException("comparison operands not supported");
+			}
+		}
+		//	Compile arguments into consecutive registers, converted to the parameter types. Returns the first register.
+		int CompileArguments(ASTCallNode* pNode, const std::vector<MSType>& types, std::vector<Operand>& operands)
+		{
+			if (pNode->m_arguments.size() != types.size())
+				throw MSCompileException((pNode->m_name + ": wrong number of arguments").str().c_str());
+
+			int base = m_nextRegister;
+			for (int i = 0; i < types.size(); ++i)
+				AllocRegister();
+
+			for (int i = 0; i < types.size(); ++i)
+			{
+				Operand operand = CompileExpression(pNode->m_arguments[i]);
+				operands.push_back(operand);
+
+				Emit(MSOpcode::Move, base + i, Convert(operand, types[i]).reg);
+			}
+			return base;
+		}
+		Operand CompileExpression(ASTCallNode* pNode)
+		{
+			Symbol symbol = GetSymbol(pNode->m_name);
+
+			std::vector<MSType> types;
+			if (symbol.kind == SymbolKind::Import)
+			{
+				const MSSymbol& import = m_pProgram->imports[symbol.index];
+				types.assign(import.functionData.parameterTypes, import.functionData.parameterTypes + import.functionData.count);
+			}
+			else if (symbol.kind == SymbolKind::Function || symbol.kind == SymbolKind::Builtin)
+				types = GetSignature(symbol).argumentTypes;
+			else
+				throw MSCompileException((pNode->m_name + " is not a function").str().c_str());
+
+			//	Result first, so it is not overwritten by the callee window
+			Operand result = { AllocRegister(), symbol.type, true };
+
+			std::vector<Operand> operands;
+			int base = CompileArguments(pNode, types, operands);
+
+			switch (symbol.kind)
+			{
+			case SymbolKind::Import:
+				Emit(MSOpcode::CallHost, result.reg, symbol.index, base);
+				break;
+			case SymbolKind::Function:
+				Emit(MSOpcode::Call, result.reg, symbol.index, base);
+				break;
+			case SymbolKind::Builtin:
+				switch (static_cast<Builtin>(symbol.index))
+				{
+				case Builtin::StringLength:
+					Emit(MSOpcode::StringLength, result.reg, base);
+					break;
+				case Builtin::StringConcat:
+					Emit(MSOpcode::StringConcat, result.reg, base);
+					break;
+				case Builtin::StringCompare:
+					Emit(MSOpcode::StringCompare, result.reg, base);
+					break;
+				case Builtin::Substring:
+					Emit(MSOpcode::Substring, result.reg, base);
+					break;
+				}
+				break;
+			}
+
+			//	Temporaries are above the arguments, in the callee window, so the callee may have overwritten them.
+			//	Argument registers are never written by the callee, release string temporaries from there.
+			for (int i = 0; i < operands.size(); ++i)
+				ReleaseOperand({ base + i, operands[i].type, operands[i].isRValue });
+
+			return result;
+		}
+		Operand CompileExpression(IASTNode* pNode)
+		{
+			if (is_type<ASTNullNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTNullNode*>(pNode));
+			else if (is_type<ASTBooleanNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTBooleanNode*>(pNode));
+			else if (is_type<ASTIntegerNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTIntegerNode*>(pNode));
+			else if (is_type<ASTFloatNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTFloatNode*>(pNode));
+			else if (is_type<ASTStringNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTStringNode*>(pNode));
+			else if (is_type<ASTNameNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTNameNode*>(pNode));
+			else if (is_type<ASTBinaryOperationNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTBinaryOperationNode*>(pNode));
+			else if (is_type<ASTCallNode>(pNode))
+				return CompileExpression(dynamic_cast<ASTCallNode*>(pNode));
+			else
+				throw MSCompileException("invalid expression");
+		}
+
+		bool CompileBlock(const pool_vector<IASTNode*>& statements)
+		{
+			for (auto pStatement : statements)
+			{
+				bool reachable = CompileStatement(pStatement);
+
+				//	Temporaries are dead after each statement
+				m_nextRegister = m_scopes.back().top;
+
+				if (!reachable)
+					return false;
+			}
+			return true;
+		}
+
+		//	Store an operand in a string variable, taking a reference and releasing the old value
+		void StoreString(const Operand& value, int reg)
+		{
+			//	Increment first, value may be the variable itself
+			if (!value.isRValue)
+				Emit(MSOpcode::Increment, value.reg);
+			Emit(MSOpcode::Decrement, reg);
+			Emit(MSOpcode::Move, reg, value.reg);
+		}
+
+		/*
+		All these return true if compilation should keep going with following statements.
+		False if following statements are unreachable.
+		*/
+		bool CompileStatement(ASTAssignmentNode* pNode)
+		{
+			if (pNode->m_type == MSType::MS_TYPE_VOID)
+			{
+				Symbol symbol = GetSymbol(pNode->m_name);
+				Operand value = Convert(CompileExpression(pNode->m_expression), symbol.type);
+
+				if (symbol.kind == SymbolKind::Local)
+				{
+					if (symbol.type == MSType::MS_TYPE_STRING)
+						StoreString(value, symbol.index);
+					else
+						Emit(MSOpcode::Move, symbol.index, value.reg);
+				}
+				else if (symbol.kind == SymbolKind::Global)
+				{
+					if (symbol.type == MSType::MS_TYPE_STRING)
+					{
+						int old = AllocRegister();
+						Emit(MSOpcode::LoadGlobal, old, symbol.index);
+						if (!value.isRValue)
+							Emit(MSOpcode::Increment, value.reg);
+						Emit(MSOpcode::Decrement, old);
+					}
+					Emit(MSOpcode::StoreGlobal, symbol.index, value.reg);
+				}
+				else
+					throw MSCompileException((pNode->m_name + " is not a variable").str().c_str());
+			}
+			else
+			{
+				if (IsSymbolDefined(pNode->m_name))
+					throw MSCompileException((pNode->m_name + " redefinition").str().c_str());
+
+				if (m_scopes.size() > 1)
+				{
+					//	Register is kept until the end of the scope
+					int reg = AllocRegister();
+					m_scopes.back().top = m_nextRegister;
+
+					Operand value = Convert(CompileExpression(pNode->m_expression), pNode->m_type);
+					if (pNode->m_type == MSType::MS_TYPE_STRING && !value.isRValue)
+						Emit(MSOpcode::Increment, value.reg);
+					Emit(MSOpcode::Move, reg, value.reg);
+
+					m_scopes.back().symbols[pNode->m_name] = { SymbolKind::Local, pNode->m_type, reg, pNode->m_type == MSType::MS_TYPE_STRING };
+				}
+				else
+				{
+					//	Globals are initialized when the program is created, like the static initializers of MSIRCompiler
+					MSValue value;
+					if (!GetConstantValue(pNode->m_expression, pNode->m_type, &value))
+						throw MSCompileException("global variable with non constant initialization not supported");
+
+					if (pNode->m_type == MSType::MS_TYPE_STRING)
+						ms_rt_hdlinc(value.s);
+
+					m_pProgram->globals.push_back(value);
+					m_pProgram->globalTypes.push_back(pNode->m_type);
+					m_scopes.back().symbols[pNode->m_name] = { SymbolKind::Global, pNode->m_type, static_cast<int>(m_pProgram->globals.size()) - 1, false };
+				}
+			}
+
+			return true;
+		}
+		//	Value of a literal, converted to type
+		bool GetConstantValue(IASTNode* pNode, MSType type, MSValue* pValue)
+		{
+			if (is_type<ASTIntegerNode>(pNode) && type == MSType::MS_TYPE_INTEGER)
+				pValue->i = dynamic_cast<ASTIntegerNode*>(pNode)->m_value;
+			else if (is_type<ASTIntegerNode>(pNode) && type == MSType::MS_TYPE_FLOAT)
+				pValue->f = static_cast<float>(dynamic_cast<ASTIntegerNode*>(pNode)->m_value);
+			else if (is_type<ASTFloatNode>(pNode) && type == MSType::MS_TYPE_FLOAT)
+				pValue->f = dynamic_cast<ASTFloatNode*>(pNode)->m_value;
+			else if (is_type<ASTBooleanNode>(pNode) && type == MSType::MS_TYPE_BOOLEAN)
+				pValue->i = dynamic_cast<ASTBooleanNode*>(pNode)->m_value ? 1 : 0;
+			else if (is_type<ASTStringNode>(pNode) && type == MSType::MS_TYPE_STRING)
+				*pValue = m_pProgram->constants[GetConstantString(dynamic_cast<ASTStringNode*>(pNode)->m_value)];
+			else if (is_type<ASTNullNode>(pNode) && type == MSType::MS_TYPE_STRING)
+				pValue->s = nullptr;
+			else
+				return false;
+
+			return true;
+		}
+		bool CompileStatement(ASTIfNode* pNode)
+		{
+			int condition = AllocRegister();
+			CompileCondition(pNode->m_expression, condition);
+			int elseJump = Emit(MSOpcode::JumpIfFalse, condition);
+			m_nextRegister = m_scopes.back().top;
+
+			PushScope(ScopeType::If);
+			bool ifReachable = CompileBlock(pNode->m_statements);
+			if (ifReachable)
+				DestroyScopeVariables(m_scopes.size() - 1);
+			PopScope();
+
+			if (pNode->m_elseStatements.empty())
+			{
+				PatchJump(elseJump);
+				return true;
+			}
+
+			int endJump = ifReachable ? Emit(MSOpcode::Jump) : -1;
+			PatchJump(elseJump);
+
+			PushScope(ScopeType::If);
+			bool elseReachable = CompileBlock(pNode->m_elseStatements);
+			if (elseReachable)
+				DestroyScopeVariables(m_scopes.size() - 1);
+			PopScope();
+
+			if (endJump != -1)
+				PatchJump(endJump);
+
+			return ifReachable || elseReachable;
+		}
+		bool CompileStatement(ASTWhileNode* pNode)
+		{
+			int start = GetCodeSize();
+
+			int condition = AllocRegister();
+			CompileCondition(pNode->m_expression, condition);
+			int endJump = Emit(MSOpcode::JumpIfFalse, condition);
+			m_nextRegister = m_scopes.back().top;
+
+			PushScope(ScopeType::While);
+			m_scopes.back().continueTarget = start;
+
+			if (CompileBlock(pNode->m_statements))
+			{
+				DestroyScopeVariables(m_scopes.size() - 1);
+				Emit(MSOpcode::Jump, 0, start);
+			}
+
+			std::vector<int> breakJumps = m_scopes.back().breakJumps;
+			PopScope();
+
+			PatchJump(endJump);
+			for (auto jump : breakJumps)
+				PatchJump(jump);
+
+			return true;
+		}
+		bool CompileStatement(ASTReturnNode* pNode)
+		{
+			int iScope = GetCurrentScope(ScopeType::Function);
+			if (iScope == -1)
+				throw MSCompileException("illegal return");
+
+			Operand value = Convert(CompileExpression(pNode->m_expression), m_functionSignatures[m_function].returnType);
+
+			//	Caller owns the result
+			if (value.type == MSType::MS_TYPE_STRING && !value.isRValue)
+				Emit(MSOpcode::Increment, value.reg);
+
+			for (int i = m_scopes.size() - 1; i >= iScope; --i)
+				DestroyScopeVariables(i);
+
+			Emit(MSOpcode::Return, value.reg);
+			return false;
+		}
+		bool CompileStatement(ASTBreakNode* pNode)
+		{
+			int iScope = GetCurrentScope(ScopeType::While);
+			if (iScope == -1)
+				throw MSCompileException("illegal break");
+
+			for (int i = m_scopes.size() - 1; i >= iScope; --i)
+				DestroyScopeVariables(i);
+
+			m_scopes[iScope].breakJumps.push_back(Emit(MSOpcode::Jump));
+			return false;
+		}
+		bool CompileStatement(ASTContinueNode* pNode)
+		{
+			int iScope = GetCurrentScope(ScopeType::While);
+			if (iScope == -1)
+				throw MSCompileException("illegal continue");
+
+			for (int i = m_scopes.size() - 1; i >= iScope; --i)
+				DestroyScopeVariables(i);
+
+			Emit(MSOpcode::Jump, 0, m_scopes[iScope].continueTarget);
+			return false;
+		}
+		bool CompileStatement(IASTNode* pNode)
+		{
+			if (is_type<ASTAssignmentNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTAssignmentNode*>(pNode));
+			else if (is_type<ASTIfNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTIfNode*>(pNode));
+			else if (is_type<ASTReturnNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTReturnNode*>(pNode));
+			else if (is_type<ASTBreakNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTBreakNode*>(pNode));
+			else if (is_type<ASTContinueNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTContinueNode*>(pNode));
+			else if (is_type<ASTWhileNode>(pNode))
+				return CompileStatement(dynamic_cast<ASTWhileNode*>(pNode));
+			else if (is_type<ASTCallNode>(pNode))
+			{
+				ReleaseOperand(CompileExpression(dynamic_cast<ASTCallNode*>(pNode)));
+				return true;
+			}
+			else
+				throw MSCompileException("invalid statement");
+		}
+
+		void CompileFunction(ASTFunctionNode* pNode)
+		{
+			Signature signature;
+			signature.returnType = pNode->m_retType;
+			for (auto& argument : pNode->m_arguments)
+				signature.argumentTypes.push_back(argument.first);
+			m_functionSignatures.push_back(signature);
+
+			MSBytecodeFunction function;
+			function.name = pNode->m_name;
+			function.argumentCount = pNode->m_arguments.size();
+			function.registerCount = function.argumentCount;
+			m_pProgram->functions.push_back(function);
+
+			//	Visible to itself, so it can recurse
+			int index = m_pProgram->functions.size() - 1;
+			m_scopes[0].symbols[pNode->m_name] = { SymbolKind::Function, pNode->m_retType, index, false };
+
+			int oldFunction = m_function;
+			int oldNextRegister = m_nextRegister;
+			m_function = index;
+			m_nextRegister = function.argumentCount;
+
+			PushScope(ScopeType::Function);
+
+			//	String arguments are borrowed from the caller. If the function assigns one, it takes its own reference
+			//	in another register, so the argument registers are left untouched for the caller to release.
+			for (int i = 0; i < pNode->m_arguments.size(); ++i)
+			{
+				Symbol symbol = { SymbolKind::Local, pNode->m_arguments[i].first, i, false };
+				if (symbol.type == MSType::MS_TYPE_STRING && IsNameAssigned(ASTNodeList(pNode->m_statements), pNode->m_arguments[i].second))
+				{
+					symbol.index = AllocRegister();
+					symbol.isOwned = true;
+					Emit(MSOpcode::Increment, i);
+					Emit(MSOpcode::Move, symbol.index, i);
+				}
+				m_scopes.back().symbols[pNode->m_arguments[i].second] = symbol;
+			}
+			m_scopes.back().top = m_nextRegister;
+
+			if (CompileBlock(pNode->m_statements))
+			{
+				DestroyScopeVariables(m_scopes.size() - 1);
+				Emit(MSOpcode::ReturnVoid);
+			}
+
+			m_scopes.pop_back();
+			m_function = oldFunction;
+			m_nextRegister = oldNextRegister;
+		}
+	public:
+		MSBytecodeCompiler(const char* name)
+			: m_name(name),
+			m_pProgram(std::make_unique<MSBytecodeProgram>())
+		{
+			Scope scope;
+			scope.type = ScopeType::Global;
+			scope.top = 0;
+			m_scopes.push_back(scope);
+
+			DeclareBuiltins();
+		}
+
+		//	Small scripts the host cannot call into, typically run once. Host functions need LLVM compiled code.
+		static bool IsInterpreterCandidate(ASTNodeList tree)
+		{
+			int count = 0;
+			bool usesExport = UsesExport(tree);
+			auto f = [&](IASTNode* pNode)
+			{
+				if (is_type<ASTFunctionNode>(pNode) && IsFunctionExported(dynamic_cast<ASTFunctionNode*>(pNode), usesExport))
+					return false;
+				return ++count <= MaxInterpretedNodes;
+			};
+			return VisitAST(tree, f);
+		}
+
+		void CompileAll(const pool_vector<IASTNode*>& tree)
+		{
+			MSBytecodeFunction entry;
+			entry.name = m_name + "::$";
+			m_pProgram->functions.push_back(entry);
+			m_functionSignatures.push_back(Signature{ MSType::MS_TYPE_VOID });
+			m_function = 0;
+
+			for (auto pNode : tree)
+			{
+				if (is_type<ASTFunctionNode>(pNode))
+					CompileFunction(dynamic_cast<ASTFunctionNode*>(pNode));
+				else
+					CompileStatement(pNode);
+
+				m_nextRegister = m_scopes.back().top;
+			}
+
+			Emit(MSOpcode::ReturnVoid);
+		}
+
+		//	Make an external symbol available to the script. Added to the program on first use.
+		void RegisterImport(MSSymbol* pSymbol)
+		{
+			m_imports[pSymbol->name] = pSymbol;
+		}
+
+		//	Imports actually referenced by the script
+		const std::vector<MSSymbol*>& GetUsedImports() const
+		{
+			return m_usedImports;
+		}
+
+		std::unique_ptr<MSBytecodeProgram> TakeProgram()
+		{
+			return std::move(m_pProgram);
+		}
+	};
+}
@@ -1,25 +1,346 @@
 #pragma once
 #include "stdafx.h"
 
+//	MSCompileException
+#include "MSIRCompiler.hpp"
 
-class MSCacheCompiler
-	: llvm::orc::SimpleCompiler
+/*
+Persistent object cache.
+Object files of a script are stored in a file named after a hash of everything that affects code generation:
+source text, compile options, host symbol signatures and LLVM version. A script compiled again with the same
+inputs is loaded from that file, skipping parsing and compilation. The same files can be loaded with MSLink.
+*/
+namespace MyScript
 {
-public:
-	MSCacheCompiler(llvm::TargetMachine &TM)
-		: llvm::orc::SimpleCompiler(TM)
-	{}
+	//	Exported function of a precompiled script
+	struct MSCachedSymbol
+	{
+		std::string			name;
+		MSType				resultType;
+		std::vector<MSType>	parameterTypes;
+	};
+	//	Everything needed to link a script without its source
+	struct MSCacheEntry
+	{
+		std::string								id;
+		//	Hash of host symbol signatures the objects were compiled against
+		std::string								symbolsKey;
+		std::vector<MSCachedSymbol>				exportedSymbols;
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>>	objects;
+	};
 
-	llvm::object::OwningBinary<llvm::object::ObjectFile> operator()(llvm::Module &M) const
+	class MSObjectCache
+		: public llvm::ObjectCache,
+		mystd::NonCopyable
 	{
-		llvm::object::OwningBinary<llvm::object::ObjectFile> obj = llvm::orc::SimpleCompiler::operator()(M);
+		static const uint32_t Magic = 0x434F534D;	//	"MSOC"
+		//	Increment when the file format or the generated code changes
+		static const uint32_t FormatVersion = 1;
+
+		class Hasher
+		{
+			llvm::MD5 m_hash;
+		public:
+			void Add(uint32_t value)
+			{
+				m_hash.update(llvm::ArrayRef<uint8_t>(reinterpret_cast<const uint8_t*>(&value), sizeof(value)));
+			}
+			//	Length first, so consecutive strings cannot be confused
+			void Add(llvm::StringRef s)
+			{
+				Add(static_cast<uint32_t>(s.size()));
+				m_hash.update(s);
+			}
+			std::string Final()
+			{
+				llvm::MD5::MD5Result result;
+				m_hash.final(result);
+
+				llvm::SmallString<32> s;
+				llvm::MD5::stringifyResult(result, s);
+				return s.str().str();
+			}
+		};
+		class Writer
+		{
+			std::string& m_buffer;
+		public:
+			Writer(std::string& buffer)
+				: m_buffer(buffer)
+			{
+
+			}
+			void Write(uint32_t value)
+			{
+				m_buffer.append(reinterpret_cast<const char*>(&value), sizeof(value));
+			}
+			void Write(llvm::StringRef s)
+			{
+				Write(static_cast<uint32_t>(s.size()));
+				m_buffer.append(s.data(), s.size());
+			}
+		};
+		class Reader
+		{
+			llvm::StringRef m_buffer;
+		public:
+			Reader(llvm::StringRef buffer)
+				: m_buffer(buffer)
+			{
+
+			}
+			uint32_t ReadInt()
+			{
+				if (m_buffer.size() < sizeof(uint32_t))
+					throw MSCompileException("invalid precompiled script");
+
+				uint32_t value;
+				memcpy(&value, m_buffer.data(), sizeof(value));
+				m_buffer = m_buffer.drop_front(sizeof(value));
+				return value;
+			}
+			llvm::StringRef ReadString()
+			{
+				uint32_t size = ReadInt();
+				if (m_buffer.size() < size)
+					throw MSCompileException("invalid precompiled script");
+
+				llvm::StringRef s = m_buffer.take_front(size);
+				m_buffer = m_buffer.drop_front(size);
+				return s;
+			}
+		};
+
+		static void AddSymbols(Hasher& hasher, const MSSymbol* pSymbols, DWORD nSymbols)
+		{
+			hasher.Add(nSymbols);
+			for (DWORD i = 0; i < nSymbols; ++i)
+			{
+				const MSSymbol& s = pSymbols[i];
+				hasher.Add(s.name);
+				hasher.Add(s.type);
+				if (s.type == MSSymbolType::MS_SYMBOL_FUNCTION)
+				{
+					hasher.Add(s.functionData.resultType);
+					hasher.Add(s.functionData.callingConvention);
+					hasher.Add(s.functionData.count);
+					for (int j = 0; j < s.functionData.count; ++j)
+						hasher.Add(s.functionData.parameterTypes[j]);
+				}
+				else
+					hasher.Add(s.variableData.type);
+			}
+		}
+		static std::string GetPath(llvm::StringRef directory, llvm::StringRef key)
+		{
+			llvm::SmallString<128> path(directory);
+			llvm::sys::path::append(path, key + ".mso");
+			return path.str().str();
+		}
+
+		//	Objects compiled for a module being captured, by capture token
+		std::map<std::string, std::vector<std::unique_ptr<llvm::MemoryBuffer>>> m_capturedObjects;
+		//	Scripts are compiled from several threads
+		std::mutex m_captureMutex;
+		//	Makes capture tokens unique, a script id can be compiled twice at the same time
+		uint64_t m_captureCount = 0;
+	public:
+		//	Addresses are not part of it, they are resolved when linking
+		static std::string GetSymbolsKey(const MSSymbol* pSymbols, DWORD nSymbols)
+		{
+			Hasher hasher;
+			AddSymbols(hasher, pSymbols, nSymbols);
+			return hasher.Final();
+		}
+		static std::string GetKey(LPCSTR id, LPCSTR source, DWORD sourceLength, const MSSymbol* pSymbols, DWORD nSymbols, const MSCompileOptions& options)
+		{
+			Hasher hasher;
+			hasher.Add(FormatVersion);
+			hasher.Add(LLVM_VERSION_STRING);
+			hasher.Add(llvm::sys::getProcessTriple());
+
+			//	Symbol names are prefixed with the script id
+			hasher.Add(id);
+			hasher.Add(llvm::StringRef(source, sourceLength));
+
+			hasher.Add(options.optimizationLevel);
+			hasher.Add(options.targetCPU != NULL ? options.targetCPU : "");
+			hasher.Add(options.targetFeatures != NULL ? options.targetFeatures : "");
+
+			AddSymbols(hasher, pSymbols, nSymbols);
+			return hasher.Final();
+		}
+
+		static std::string Serialize(const MSCacheEntry& entry)
+		{
+			std::string buffer;
+			Writer writer(buffer);
+
+			writer.Write(Magic);
+			writer.Write(FormatVersion);
+			writer.Write(LLVM_VERSION_STRING);
+			writer.Write(llvm::sys::getProcessTriple());
+			writer.Write(entry.symbolsKey);
+			writer.Write(entry.id);
+
+			writer.Write(static_cast<uint32_t>(entry.exportedSymbols.size()));
+			for (auto& s : entry.exportedSymbols)
+			{
+				writer.Write(s.name);
+				writer.Write(s.resultType);
+				writer.Write(static_cast<uint32_t>(s.parameterTypes.size()));
+				for (auto type : s.parameterTypes)
+					writer.Write(type);
+			}
+
+			writer.Write(static_cast<uint32_t>(entry.objects.size()));
+			for (auto& pObject : entry.objects)
+				writer.Write(pObject->getBuffer());
+
+			return buffer;
+		}
+		//	Throws if the buffer is not a precompiled script for this LLVM version and target
+		static void Deserialize(llvm::StringRef buffer, MSCacheEntry& entry)
+		{
+			Reader reader(buffer);
+
+			if (reader.ReadInt() != Magic || reader.ReadInt() != FormatVersion)
+				throw MSCompileException("invalid precompiled script");
+			if (reader.ReadString() != LLVM_VERSION_STRING || reader.ReadString() != llvm::sys::getProcessTriple())
+				throw MSCompileException("precompiled script was built for another LLVM version or target");
+
+			entry.symbolsKey = reader.ReadString();
+			entry.id = reader.ReadString();
+
+			uint32_t symbolCount = reader.ReadInt();
+			for (uint32_t i = 0; i < symbolCount; ++i)
+			{
+				MSCachedSymbol s;
+				s.name = reader.ReadString();
+				s.resultType = static_cast<MSType>(reader.ReadInt());
+
+				uint32_t count = reader.ReadInt();
+				if (count > 10)
+					throw MSCompileException("invalid precompiled script");
+				for (uint32_t j = 0; j < count; ++j)
+					s.parameterTypes.push_back(static_cast<MSType>(reader.ReadInt()));
+
+				entry.exportedSymbols.push_back(std::move(s));
+			}
+
+			uint32_t objectCount = reader.ReadInt();
+			for (uint32_t i = 0; i < objectCount; ++i)
+				entry.objects.push_back(llvm::MemoryBuffer::getMemBufferCopy(reader.ReadString(), entry.id));
+		}
+
+		//	Returns false on a cache miss. Unreadable or outdated files are misses.
+		static bool Load(llvm::StringRef directory, llvm::StringRef key, MSCacheEntry& entry)
+		{
+			llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> buffer = llvm::MemoryBuffer::getFile(GetPath(directory, key));
+			if (!buffer)
+				return false;
+
+			try
+			{
+				Deserialize((*buffer)->getBuffer(), entry);
+				return true;
+			}
+			catch (MSCompileException)
+			{
+				entry = MSCacheEntry();
+				return false;
+			}
+		}
+		//	Failures are ignored, the script is just compiled again next time
+		static void Store(llvm::StringRef directory, llvm::StringRef key, const MSCacheEntry& entry)
+		{
+			if (llvm::sys::fs::create_directories(directory))
+				return;
+
+			//	Written to a temporary file then renamed, so other processes never read a partial file
+			int fd;
+			llvm::SmallString<128> tempPath;
+			if (llvm::sys::fs::createUniqueFile(GetPath(directory, key) + ".%%%%%%%%", fd, tempPath))
+				return;
+
+			{
+				llvm::raw_fd_ostream os(fd, true);
+				os << Serialize(entry);
+				os.close();
+				if (os.has_error())
+				{
+					os.clear_error();
+					llvm::sys::fs::remove(tempPath);
+					return;
+				}
+			}
+
+			if (llvm::sys::fs::rename(tempPath, GetPath(directory, key)))
+				llvm::sys::fs::remove(tempPath);
+		}
+
+		//	Keep the objects compiled for modules identified by the returned token, until TakeObjects.
+		//	Script ids are C strings, a token starting with '\0' never matches a script module.
+		std::string BeginCapture()
+		{
+			std::lock_guard<std::mutex> lock(m_captureMutex);
+			std::string token = std::string(1, '\0') + "capture" + std::to_string(++m_captureCount);
+			m_capturedObjects[token];
+			return token;
+		}
+		std::vector<std::unique_ptr<llvm::MemoryBuffer>> TakeObjects(const std::string& token)
+		{
+			std::vector<std::unique_ptr<llvm::MemoryBuffer>> objects;
+
+			std::lock_guard<std::mutex> lock(m_captureMutex);
+			auto it = m_capturedObjects.find(token);
+			if (it != m_capturedObjects.end())
+			{
+				objects = std::move(it->second);
+				m_capturedObjects.erase(it);
+			}
+			return objects;
+		}
+		void AddObject(const std::string& token, llvm::MemoryBufferRef object)
+		{
+			std::lock_guard<std::mutex> lock(m_captureMutex);
+			auto it = m_capturedObjects.find(token);
+			if (it != m_capturedObjects.end())
+				it->second.push_back(llvm::MemoryBuffer::getMemBufferCopy(object.getBuffer(), object.getBufferIdentifier()));
+		}
+
+		void notifyObjectCompiled(const llvm::Module* M, llvm::MemoryBufferRef Obj) override
+		{
+			AddObject(M->getModuleIdentifier(), Obj);
+		}
+		//	Lookups are done by MSCompile with the source hash, before any module exists
+		std::unique_ptr<llvm::MemoryBuffer> getObject(const llvm::Module* M) override
+		{
+			return nullptr;
+		}
+	};
+
+	//	Compiler of the compile layer, objects are handed to the cache
+	class MSCachingCompiler
+		: llvm::orc::SimpleCompiler
+	{
+		llvm::ObjectCache* m_pCache;
+	public:
+		MSCachingCompiler(llvm::TargetMachine& TM, llvm::ObjectCache* pCache)
+			: llvm::orc::SimpleCompiler(TM),
+			m_pCache(pCache)
+		{
+
+		}
 
-		std::ofstream file = std::ofstream(M.getName().str() + ".precompiled", std::fstream::binary | std::fstream::trunc);
-		file.seekp(0, std::fstream::beg);
+		llvm::object::OwningBinary<llvm::object::ObjectFile> operator()(llvm::Module& M) const
+		{
+			llvm::object::OwningBinary<llvm::object::ObjectFile> obj = llvm::orc::SimpleCompiler::operator()(M);
 
-		llvm::MemoryBufferRef buffer = obj.getBinary()->getMemoryBufferRef();
-		file.write(buffer.getBufferStart(), buffer.getBufferSize());
+			if (obj.getBinary() != nullptr)
+				m_pCache->notifyObjectCompiled(&M, obj.getBinary()->getMemoryBufferRef());
 
-		return obj;
-	}
-};
\ No newline at end of file
+			return obj;
+		}
+	};
+}
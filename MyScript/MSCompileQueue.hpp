@@ -0,0 +1,240 @@
+#pragma once
+#include "stdafx.h"
+
+#include "MyScript.h"
+#include "IMSBase.h"
+
+/*
+Asynchronous compilation.
+Compilations queued by MSCompileAsync run on a few background threads, highest priority first, then in order.
+Each one is shared by the queue and the handle returned to the host, which polls, waits for or cancels it.
+*/
+namespace MyScript
+{
+	class MSCompileTask
+		: mystd::NonCopyable
+	{
+	public:
+		//	Returns the script, nullptr when the compilation failed
+		typedef std::function<IMSBase*()> CompileFunctionT;
+	private:
+		friend class MSCompileQueue;
+
+		CompileFunctionT			m_compile;
+		MSCompilePriority			m_priority;
+		unsigned long long			m_sequence = 0;
+		MSCompileCallback			m_callback;
+		LPVOID						m_userData;
+
+		std::mutex					m_mutex;
+		std::condition_variable		m_condition;
+		MSCompileStatus				m_status = MSCompileStatus::MS_COMPILE_PENDING;
+		bool						m_canceled = false;
+		std::unique_ptr<IMSBase>	m_pScript;
+
+		//	Returns false when canceled before it started
+		bool Start()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_status != MSCompileStatus::MS_COMPILE_PENDING)
+				return false;
+
+			m_status = MSCompileStatus::MS_COMPILE_RUNNING;
+			return true;
+		}
+		void Complete(MSCompileStatus status, std::unique_ptr<IMSBase> pScript)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_status = status;
+				m_pScript = std::move(pScript);
+			}
+			Notify(status);
+		}
+		//	Status is final, called without the lock
+		void Notify(MSCompileStatus status)
+		{
+			m_condition.notify_all();
+
+			if (m_callback != NULL)
+				m_callback(m_userData, status);
+		}
+		void Run()
+		{
+			if (!Start())
+				return;
+
+			//	An exception leaving a compile thread would terminate the host
+			std::unique_ptr<IMSBase> pScript;
+			try
+			{
+				pScript.reset(m_compile());
+			}
+			catch (...)
+			{
+				pScript.reset();
+			}
+
+			bool canceled;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				canceled = m_canceled;
+			}
+
+			//	Result of a compilation canceled while running is dropped
+			if (canceled)
+				Complete(MSCompileStatus::MS_COMPILE_CANCELED, nullptr);
+			else if (pScript)
+				Complete(MSCompileStatus::MS_COMPILE_SUCCEEDED, std::move(pScript));
+			else
+				Complete(MSCompileStatus::MS_COMPILE_FAILED, nullptr);
+		}
+	public:
+		MSCompileTask(CompileFunctionT compile, MSCompilePriority priority, MSCompileCallback callback, LPVOID userData)
+			: m_compile(compile),
+			m_priority(priority),
+			m_callback(callback),
+			m_userData(userData)
+		{
+
+		}
+
+		//	timeout in milliseconds, 0 to poll, INFINITE to wait for completion
+		MSCompileStatus Wait(DWORD timeout)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			auto isDone = [this]() { return m_status != MSCompileStatus::MS_COMPILE_PENDING && m_status != MSCompileStatus::MS_COMPILE_RUNNING; };
+
+			if (timeout == INFINITE)
+				m_condition.wait(lock, isDone);
+			else
+				m_condition.wait_for(lock, std::chrono::milliseconds(timeout), isDone);
+
+			return m_status;
+		}
+		//	A pending compilation never runs. A running one completes, but its script is destroyed.
+		bool Cancel()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_status == MSCompileStatus::MS_COMPILE_RUNNING)
+				{
+					m_canceled = true;
+					return true;
+				}
+				if (m_status != MSCompileStatus::MS_COMPILE_PENDING)
+					return false;
+
+				//	Still in the queue, set with the check so a compile thread cannot start it meanwhile
+				m_status = MSCompileStatus::MS_COMPILE_CANCELED;
+			}
+			Notify(MSCompileStatus::MS_COMPILE_CANCELED);
+			return true;
+		}
+		//	Ownership of the script goes to the caller, later calls return nullptr
+		IMSBase* TakeScript()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_pScript.release();
+		}
+	};
+
+	//	Handle returned to the host. The task may outlive it, until a compile thread is done with it.
+	class MSCompileHandle
+		: public IMSBase
+	{
+		std::shared_ptr<MSCompileTask> m_pTask;
+	public:
+		MSCompileHandle(std::shared_ptr<MSCompileTask> pTask)
+			: m_pTask(pTask)
+		{
+
+		}
+
+		MSCompileTask* GetTask()
+		{
+			return m_pTask.get();
+		}
+	};
+
+	class MSCompileQueue
+		: mystd::NonCopyable
+	{
+		struct TaskOrder
+		{
+			bool operator()(const std::shared_ptr<MSCompileTask>& a, const std::shared_ptr<MSCompileTask>& b) const
+			{
+				if (a->m_priority != b->m_priority)
+					return a->m_priority < b->m_priority;
+				return a->m_sequence > b->m_sequence;
+			}
+		};
+
+		std::priority_queue<std::shared_ptr<MSCompileTask>, std::vector<std::shared_ptr<MSCompileTask>>, TaskOrder> m_queue;
+		unsigned long long		m_sequence = 0;
+		std::mutex				m_mutex;
+		std::condition_variable	m_condition;
+		bool					m_stop = false;
+
+		//	Must be last, threads start in the constructor
+		std::vector<std::thread> m_threads;
+
+		void Run()
+		{
+			while (true)
+			{
+				std::shared_ptr<MSCompileTask> pTask;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+					if (m_stop)
+						return;
+
+					pTask = m_queue.top();
+					m_queue.pop();
+				}
+
+				pTask->Run();
+			}
+		}
+	public:
+		//	Large scripts split their code generation across cores, so only use part of them
+		MSCompileQueue(unsigned threadCount = std::max(1u, std::thread::hardware_concurrency() / 2))
+		{
+			for (unsigned i = 0; i < threadCount; ++i)
+				m_threads.emplace_back(&MSCompileQueue::Run, this);
+		}
+		//	Running compilations complete, pending ones are canceled
+		~MSCompileQueue()
+		{
+			std::vector<std::shared_ptr<MSCompileTask>> pending;
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+				while (!m_queue.empty())
+				{
+					pending.push_back(m_queue.top());
+					m_queue.pop();
+				}
+			}
+			m_condition.notify_all();
+
+			for (auto& thread : m_threads)
+				thread.join();
+
+			for (auto& pTask : pending)
+				pTask->Cancel();
+		}
+
+		void Enqueue(std::shared_ptr<MSCompileTask> pTask)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				pTask->m_sequence = m_sequence++;
+				m_queue.push(pTask);
+			}
+			m_condition.notify_one();
+		}
+	};
+}
@@ -12,6 +12,13 @@
 #include "MSRuntime.h"
 
 #include "MSCachingCompiler.hpp"
+#include "MSOptimizer.hpp"
+#include "MSTierManager.hpp"
+#include "MSInterpreter.hpp"
+#include "MSResourcePool.hpp"
+#include "MSCompileQueue.hpp"
+#include "MSWorkerPool.hpp"
+#include "MSMemoryManager.hpp"
 
 /*
 This class holds LLVM context, and compiler/optimizer. It is responsible of
@@ -19,51 +26,37 @@ actual compiling and execution of scripts.
 */
 namespace MyScript
 {
+	//	Mangled name -> address of every symbol a script module may reference
+	typedef llvm::StringMap<llvm::JITTargetAddress> MSSymbolIndex;
+
 	class MSSymbolResolver
 		: public llvm::JITSymbolResolver
 	{
-		llvm::DataLayout* m_pLayout = nullptr;
-		MSScript* m_pScript = nullptr;
-
-		std::string GetMangledName(const std::string& name)
-		{
-			std::string MangledName;
-			llvm::raw_string_ostream MangledNameStream(MangledName);
-			llvm::Mangler::getNameWithPrefix(MangledNameStream, name, *m_pLayout);
-			return MangledNameStream.str();
-		}
+		const MSSymbolIndex* m_pIndex = nullptr;
+		//	Symbols of the script being linked, looked up first
+		std::shared_ptr<const MSSymbolIndex> m_pScriptSymbols;
 
 		MSSymbolResolver() = delete;
 	public:
-		MSSymbolResolver(MSScript* pScript, llvm::DataLayout* pLayout)
-			: m_pScript(pScript),
-			m_pLayout(pLayout)
+		MSSymbolResolver(const MSSymbolIndex* pIndex, std::shared_ptr<const MSSymbolIndex> pScriptSymbols = nullptr)
+			: m_pIndex(pIndex),
+			m_pScriptSymbols(pScriptSymbols)
 		{
 			
 		}
 		llvm::JITSymbol findSymbolInLogicalDylib(const std::string &Name)
 		{
-			if (Name == GetMangledName("hdlinc"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_hdlinc), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("hdldec"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_hdldec), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("strlen"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_strlen), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("strcat"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_strcat), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("strcmp"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_strcmp), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("substr"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_substr), llvm::JITSymbolFlags::None);
-			if (Name == GetMangledName("strgetptr"))
-				return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(ms_rt_strgetptr), llvm::JITSymbolFlags::None);
-
-			for (auto& symbol : m_pScript->GetImportedSymbols())
+			if (m_pScriptSymbols)
 			{
-				if (GetMangledName(m_pScript->GetName() + "::" + symbol.name) == Name)
-					return llvm::JITSymbol(reinterpret_cast<llvm::JITTargetAddress>(symbol.address), llvm::JITSymbolFlags::None);
+				auto it = m_pScriptSymbols->find(Name);
+				if (it != m_pScriptSymbols->end())
+					return llvm::JITSymbol(it->second, llvm::JITSymbolFlags::None);
 			}
 
+			auto it = m_pIndex->find(Name);
+			if (it != m_pIndex->end())
+				return llvm::JITSymbol(it->second, llvm::JITSymbolFlags::None);
+
 			throw MSCompileException(("symbol not found " + Name).c_str());
 		}
 		llvm::JITSymbol findSymbol(const std::string &Name)
@@ -71,6 +64,128 @@ namespace MyScript
 			throw MSCompileException(("symbol not found " + Name).c_str());
 		}
 	};
+	/*
+	Compile callback manager for the compile on demand layer. Lazy compilation runs on the thread that first
+	calls a stub. The whole callback runs under the JIT lock, trampoline lookup included: when two threads first
+	call the same function at once, the second one waits and then finds the trampoline already repointed.
+	Callbacks of a module set that were never called are given back when it is removed.
+	*/
+	class MSCompileCallbackManager
+		: public llvm::orc::JITCompileCallbackManager
+	{
+		std::mutex* m_pMutex;
+		//	Receives trampolines of the module set being added
+		std::vector<llvm::JITTargetAddress>* m_pTrampolines = nullptr;
+	protected:
+		MSCompileCallbackManager(std::mutex* pMutex)
+			: llvm::orc::JITCompileCallbackManager(0),
+			m_pMutex(pMutex)
+		{
+
+		}
+
+		//	Called by the resolver block, from the thread that calls a stub
+		static llvm::JITTargetAddress Reenter(void* pManager, void* pTrampoline)
+		{
+			MSCompileCallbackManager* pThis = static_cast<MSCompileCallbackManager*>(pManager);
+
+			std::lock_guard<std::mutex> lock(*pThis->m_pMutex);
+			return pThis->executeCompileCallback(static_cast<llvm::JITTargetAddress>(reinterpret_cast<uintptr_t>(pTrampoline)));
+		}
+	public:
+		static std::unique_ptr<MSCompileCallbackManager> Create(const llvm::Triple& triple, std::mutex* pMutex);
+
+		//	Called with the JIT lock held, like everything below
+		CompileCallbackInfo getCompileCallback()
+		{
+			CompileCallbackInfo info = llvm::orc::JITCompileCallbackManager::getCompileCallback();
+			if (m_pTrampolines != nullptr)
+				m_pTrampolines->push_back(info.getAddress());
+			return info;
+		}
+
+		//	Trampolines created until EndModuleSet are added to pTrampolines
+		void BeginModuleSet(std::vector<llvm::JITTargetAddress>* pTrampolines)
+		{
+			m_pTrampolines = pTrampolines;
+		}
+		void EndModuleSet()
+		{
+			m_pTrampolines = nullptr;
+		}
+		//	Once the module set is removed. Trampolines already called were given back by executeCompileCallback.
+		void ReleaseCallbacks(const std::vector<llvm::JITTargetAddress>& trampolines)
+		{
+			for (auto trampoline : trampolines)
+			{
+				auto it = ActiveTrampolines.find(trampoline);
+				if (it != ActiveTrampolines.end())
+				{
+					ActiveTrampolines.erase(it);
+					AvailableTrampolines.push_back(trampoline);
+				}
+			}
+		}
+	};
+	//	Same as llvm::orc::LocalJITCompileCallbackManager, but reentry goes through MSCompileCallbackManager::Reenter
+	template<typename TargetT>
+	class MSLocalCompileCallbackManager
+		: public MSCompileCallbackManager
+	{
+		llvm::sys::OwningMemoryBlock m_resolverBlock;
+		std::vector<llvm::sys::OwningMemoryBlock> m_trampolineBlocks;
+
+		static llvm::sys::OwningMemoryBlock AllocateExecutableMemory(size_t size)
+		{
+			std::error_code error;
+			llvm::sys::OwningMemoryBlock block(llvm::sys::Memory::allocateMappedMemory(size, nullptr, llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_WRITE, error));
+			if (error)
+				throw MSCompileException("cannot allocate lazy compilation trampolines");
+			return block;
+		}
+		static void Protect(llvm::sys::OwningMemoryBlock& block)
+		{
+			if (llvm::sys::Memory::protectMappedMemory(block.getMemoryBlock(), llvm::sys::Memory::MF_READ | llvm::sys::Memory::MF_EXEC))
+				throw MSCompileException("cannot protect lazy compilation trampolines");
+		}
+
+		void grow() override
+		{
+			llvm::sys::OwningMemoryBlock block = AllocateExecutableMemory(llvm::sys::Process::getPageSize());
+
+			unsigned count = (llvm::sys::Process::getPageSize() - TargetT::PointerSize) / TargetT::TrampolineSize;
+			uint8_t* pTrampolines = static_cast<uint8_t*>(block.base());
+			TargetT::writeTrampolines(pTrampolines, m_resolverBlock.base(), count);
+
+			for (unsigned i = 0; i < count; ++i)
+				AvailableTrampolines.push_back(static_cast<llvm::JITTargetAddress>(reinterpret_cast<uintptr_t>(pTrampolines + i * TargetT::TrampolineSize)));
+
+			Protect(block);
+			m_trampolineBlocks.push_back(std::move(block));
+		}
+	public:
+		MSLocalCompileCallbackManager(std::mutex* pMutex)
+			: MSCompileCallbackManager(pMutex),
+			m_resolverBlock(AllocateExecutableMemory(TargetT::ResolverCodeSize))
+		{
+			TargetT::writeResolverCode(static_cast<uint8_t*>(m_resolverBlock.base()), &MSCompileCallbackManager::Reenter, static_cast<MSCompileCallbackManager*>(this));
+			Protect(m_resolverBlock);
+		}
+	};
+	inline std::unique_ptr<MSCompileCallbackManager> MSCompileCallbackManager::Create(const llvm::Triple& triple, std::mutex* pMutex)
+	{
+		switch (triple.getArch())
+		{
+		case llvm::Triple::x86:
+			return std::make_unique<MSLocalCompileCallbackManager<llvm::orc::OrcI386>>(pMutex);
+		case llvm::Triple::x86_64:
+			if (triple.getOS() == llvm::Triple::Win32)
+				return std::make_unique<MSLocalCompileCallbackManager<llvm::orc::OrcX86_64_Win32>>(pMutex);
+			return std::make_unique<MSLocalCompileCallbackManager<llvm::orc::OrcX86_64_SysV>>(pMutex);
+		default:
+			throw MSCompileException("lazy compilation is not supported on this target");
+		}
+	}
 	class MSContext
 		: public IMSBase
 	{
@@ -82,17 +197,142 @@ namespace MyScript
 		typedef llvm::orc::ObjectLinkingLayer<> ObjectLinkingLayerT;
 		typedef llvm::orc::IRCompileLayer<ObjectLinkingLayerT> IRCompileLayerT;
 		typedef llvm::orc::IRTransformLayer<IRCompileLayerT, OptimizeFunctionT> IRTransformLayerT;
-		typedef llvm::orc::CompileOnDemandLayer<IRTransformLayerT> CompileOnDemandLayerT;
+		typedef llvm::orc::CompileOnDemandLayer<IRTransformLayerT, MSCompileCallbackManager> CompileOnDemandLayerT;
+
+		//	Calls before a function is recompiled with optimizations, in tiered mode
+		static const int DefaultTierUpThreshold = 1000;
+		//	Smaller scripts are compiled on the calling thread, splitting them is not worth it
+		static const int MinFunctionsPerPartition = 64;
+		//	Compilations an IR context is used for before being replaced, its constants and types are never freed
+		static const unsigned MaxContextUses = 256;
+
+		/*
+		IR contexts and target machines are not thread safe, each compilation takes its own from these.
+		They are shared by every context of the process, so a new context reuses what previous ones created.
+		*/
+		static MSResourcePool<llvm::LLVMContext>& GetContextPool()
+		{
+			static MSResourcePool<llvm::LLVMContext> pool([]() { return std::make_unique<llvm::LLVMContext>(); }, MaxContextUses);
+			return pool;
+		}
+		//	Code generation level of target machines follows the optimization level of scripts
+		static MSResourcePool<MSTarget>& GetTargetPool(MSOptimizationLevel level = MSOptimizationLevel::MS_OPTIMIZATION_O2)
+		{
+			auto factory = [](llvm::CodeGenOpt::Level codeGenLevel)
+			{
+				return [codeGenLevel]() { return std::make_unique<MSTarget>(std::unique_ptr<llvm::TargetMachine>(llvm::EngineBuilder().setOptLevel(codeGenLevel).selectTarget())); };
+			};
+			//	By optimization level
+			static MSResourcePool<MSTarget> pools[] =
+			{
+				{ factory(llvm::CodeGenOpt::None) },
+				{ factory(llvm::CodeGenOpt::Less) },
+				{ factory(llvm::CodeGenOpt::Default) },
+				{ factory(llvm::CodeGenOpt::Aggressive) },
+				{ factory(llvm::CodeGenOpt::Default) },
+			};
+			return pools[level];
+		}
+		//	Target registration is process-wide, only done by the first context
+		static void InitializeLLVM()
+		{
+			static std::once_flag initialized;
+			std::call_once(initialized, []()
+			{
+				llvm::InitializeNativeTarget();
+				llvm::InitializeNativeTargetAsmPrinter();
+				llvm::InitializeNativeTargetAsmParser();
+			});
+		}
+
+		//	JIT memory of every script, memory managers give it back when layers remove them so it is destroyed last
+		MSSlabAllocator m_slabAllocator;
+
+		//	JIT resources of a script, released when its handle is closed
+		struct LoadedScript
+		{
+			//	Host symbols and variables of this compilation, by mangled name. They are not in the shared index,
+			//	a script can be compiled again with the same id while its previous version is still loaded.
+			std::shared_ptr<MSSymbolIndex>				pSymbols = std::make_shared<MSSymbolIndex>();
+			//	Tiered scripts, IR kept to recompile their hot functions and the code of recompiled ones
+			MSTierManager::Script*						pTierScript = nullptr;
+			std::vector<ObjectLinkingLayerT::ObjSetHandleT>	tierObjectSets;
+			bool										hasObjectSet = false;
+			ObjectLinkingLayerT::ObjSetHandleT			objectSet;
+			bool										hasModuleSet = false;
+			CompileOnDemandLayerT::ModuleSetHandleT		moduleSet;
+			//	Lazy scripts, compile callbacks of their functions
+			std::vector<llvm::JITTargetAddress>			trampolines;
+			//	Lazy scripts, the compile on demand layer keeps their module
+			std::unique_ptr<llvm::LLVMContext>			pContext;
+			//	Owned by the layer
+			MSMemoryManager*							pMemoryManager = nullptr;
+		};
+		//	Declared before the layers, contexts must outlive the modules they hold
+		std::map<MSScript*, LoadedScript> m_loadedScripts;
 
-		llvm::LLVMContext m_context;
+		//	Code of a replaced version of a reloadable script, removed once no thread runs it
+		struct RetiredCode
+		{
+			LoadedScript	loaded;
+			//	State of the version, its first entry counts calls in flight
+			LONG_PTR*		pState;
+		};
+		/*
+		Exported functions of a reloadable script are called through entry thunks, compiled with its first version
+		and never replaced. The current version is described by a state: calls in flight, then its function addresses
+		in name order. Thunks count the call in the state before reading the address, and decrement it once the
+		function returned to them, see CreateReloadThunks.
+		*/
+		struct ReloadableScript
+		{
+			unsigned										version = 0;
+			//	Function name -> code of the current version
+			std::map<std::string, llvm::JITTargetAddress>	targets;
+			//	Function name -> entry thunk. Versions being compiled have none, their code goes to the reloaded script.
+			std::map<std::string, llvm::JITTargetAddress>	entries;
+			LoadedScript									entryCode;
+			//	Variable of the thunks pointing to the current state
+			LONG_PTR* volatile*								ppState = nullptr;
+			//	States of every version. A thread may still count itself in a retired one before seeing the current
+			//	one, so they are only freed with the script.
+			std::list<std::unique_ptr<LONG_PTR[]>>			states;
+			std::list<RetiredCode>							retired;
+		};
+		std::map<MSScript*, ReloadableScript> m_reloadableScripts;
+		//	Names given by GetReloadName, compiled as new versions of a reloadable script
+		std::set<std::string> m_reloadVersions;
+		//	Scripts closed after the context have nothing left to unload
+		std::shared_ptr<bool> m_pLifetime = std::make_shared<bool>(true);
+#ifdef MS_BENCHMARK_HOOKS
+		//	Only read when a compilation starts, see MSSetRefcountCalls
+		std::atomic<bool> m_refcountCalls{ false };
+#endif
 
+		//	Target of the pooled target machines, for lazy compilation stubs
+		llvm::Triple m_triple;
+		//	Receives objects of the compile layer, used by the compiler so must outlive it
+		MSObjectCache m_objectCache;
 		std::unique_ptr<ObjectLinkingLayerT> m_pObjectLayer;
 		std::unique_ptr<IRCompileLayerT> m_pCompileLayer;
 		std::unique_ptr<IRTransformLayerT> m_pOptimizeLayer;
-		//std::unique_ptr<llvm::orc::JITCompileCallbackManager> m_pCompileCallbackManager;
-		//std::unique_ptr<CompileOnDemandLayerT> m_pCompileOnDemandLayer;
+		//	Created on first lazy compilation
+		std::unique_ptr<MSCompileCallbackManager> m_pCompileCallbackManager;
+		std::unique_ptr<CompileOnDemandLayerT> m_pCompileOnDemandLayer;
 		std::unique_ptr<llvm::DataLayout> m_pLayout;
-		std::unique_ptr<MemoryPool> m_pMemoryPool;
+
+		//	Runtime functions, shared by every script
+		MSSymbolIndex m_symbolIndex;
+
+		//	Layers and symbol index are shared by every compiling thread, and the tier-up thread
+		std::mutex m_jitMutex;
+		//	Created on first tiered compilation. Its thread stops before the layers it uses are destroyed.
+		std::unique_ptr<MSTierManager> m_pTierManager;
+		//	Created on first parallel compilation, asynchronous compilations also use it so it is stopped after them
+		std::unique_ptr<MSWorkerPool> m_pWorkerPool;
+		//	Created on first asynchronous compilation, its threads use everything above.
+		//	Declared last so its threads stop first, running compilations may still add tiered scripts.
+		std::unique_ptr<MSCompileQueue> m_pCompileQueue;
 
 		std::string GetMangledName(const std::string& name)
 		{
@@ -102,41 +342,685 @@ namespace MyScript
 			return MangledNameStream.str();
 		}
 
-		std::unique_ptr<llvm::Module> OptimizeModule(std::unique_ptr<llvm::Module> M)
+		void RegisterSymbol(const std::string& name, void* address)
 		{
-			// Create a function pass manager.
-			auto FPM = llvm::make_unique<llvm::legacy::FunctionPassManager>(M.get());
+			m_symbolIndex[GetMangledName(name)] = reinterpret_cast<llvm::JITTargetAddress>(address);
+		}
+
+		//	Host symbols are prefixed with the script name, they are resolved for this compilation only
+		void RegisterImports(MSScript* pScript, LoadedScript& loaded)
+		{
+			for (auto& s : pScript->GetImportedSymbols())
+				(*loaded.pSymbols)[GetMangledName(pScript->GetName() + "::" + s.name)] = reinterpret_cast<llvm::JITTargetAddress>(s.address);
+		}
+		//	Script is unloaded when its handle is closed
+		void AddLoadedScript(MSScript* pScript, LoadedScript loaded)
+		{
+			m_loadedScripts[pScript] = std::move(loaded);
 
-			// Add some optimizations.
-			FPM->add(llvm::createInstructionCombiningPass());
-			FPM->add(llvm::createReassociatePass());
-			FPM->add(llvm::createGVNPass());
-			FPM->add(llvm::createCFGSimplificationPass());
-			FPM->doInitialization();
+			//	Previous versions of reloadable scripts may have become idle since they were replaced
+			for (auto& reloadable : m_reloadableScripts)
+				RemoveIdleCode(reloadable.second);
 
-			// Run the optimizations over all functions in the module being added to
-			// the JIT.
-			for (auto &F : *M)
-				FPM->run(F);
+			std::weak_ptr<bool> lifetime = m_pLifetime;
+			pScript->SetUnload([this, lifetime, pScript]()
+			{
+				if (!lifetime.expired())
+					Unload(pScript);
+			});
+		}
+		//	Remove code from the JIT, its memory managers give the pages back. Returns the IR context of a lazy script.
+		std::unique_ptr<llvm::LLVMContext> RemoveCode(LoadedScript& loaded)
+		{
+			if (loaded.hasObjectSet)
+				m_pObjectLayer->removeObjectSet(loaded.objectSet);
+			if (loaded.hasModuleSet)
+			{
+				m_pCompileOnDemandLayer->removeModuleSet(loaded.moduleSet);
+				m_pCompileCallbackManager->ReleaseCallbacks(loaded.trampolines);
+			}
+			for (auto& handle : loaded.tierObjectSets)
+				m_pObjectLayer->removeObjectSet(handle);
 
+			return std::move(loaded.pContext);
+		}
+		void Unload(MSScript* pScript)
+		{
+			//	Tier-up thread is done with the script first, it links recompiled functions with the JIT lock
+			MSTierManager::Script* pTierScript = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(m_jitMutex);
+
+				auto it = m_loadedScripts.find(pScript);
+				if (it != m_loadedScripts.end())
+					pTierScript = it->second.pTierScript;
+			}
+			if (pTierScript != nullptr)
+				m_pTierManager->RemoveScript(pTierScript);
+
+			std::unique_ptr<llvm::LLVMContext> pContext;
+			{
+				std::lock_guard<std::mutex> lock(m_jitMutex);
+
+				auto it = m_loadedScripts.find(pScript);
+				if (it == m_loadedScripts.end())
+					return;
+
+				pContext = RemoveCode(it->second);
+				m_loadedScripts.erase(it);
+
+				//	Host is done with the script, so with its previous versions and its entry thunks too
+				auto reloadable = m_reloadableScripts.find(pScript);
+				if (reloadable != m_reloadableScripts.end())
+				{
+					for (auto& retired : reloadable->second.retired)
+						RemoveCode(retired.loaded);
+					RemoveCode(reloadable->second.entryCode);
+					m_reloadableScripts.erase(reloadable);
+				}
+			}
+
+			//	Its modules are destroyed, so the context can be reused
+			if (pContext)
+				GetContextPool().Release(std::move(pContext));
+		}
+
+		//	Entry point and exported functions of a script, in the order of reload states
+		static std::vector<std::string> GetReloadTargets(MSScript* pScript)
+		{
+			std::set<std::string> names = { "$" };
+			for (auto& s : pScript->GetExportedSymbols())
+				names.insert(s.name);
+			return std::vector<std::string>(names.begin(), names.end());
+		}
+		/*
+		Entry thunks of a reloadable script, in a module of their own. Each one does:
+			state = current state; ++state[0]; if (state != current state) { --state[0]; retry; }
+			result = state[1 + index](args); --state[0]; return result;
+		A thread counted in a retired state has seen it is still current after counting itself, so a version whose
+		count is 0 after it was retired is never entered again. The decrement runs in the thunk, not in the version.
+		*/
+		std::unique_ptr<llvm::Module> CreateReloadThunks(llvm::Module& module, MSScript* pScript)
+		{
+			llvm::LLVMContext& context = module.getContext();
+			const std::string& scriptName = pScript->GetName();
+
+			std::unique_ptr<llvm::Module> pThunks = llvm::make_unique<llvm::Module>(scriptName + ".entries", context);
+			pThunks->setDataLayout(*m_pLayout);
+
+			llvm::Type* intPtrType = m_pLayout->getIntPtrType(context);
+			llvm::PointerType* statePtrType = intPtrType->getPointerTo();
+			llvm::Constant* one = llvm::ConstantInt::get(intPtrType, 1);
+			unsigned alignment = m_pLayout->getPointerABIAlignment();
+
+			llvm::GlobalVariable* current = new llvm::GlobalVariable(*pThunks, statePtrType, false, llvm::GlobalValue::ExternalLinkage,
+				llvm::ConstantPointerNull::get(statePtrType), scriptName + "::$state");
+
+			std::vector<std::string> names = GetReloadTargets(pScript);
+			for (int index = 0; index < names.size(); ++index)
+			{
+				llvm::Function* pFunction = module.getFunction(scriptName + "::" + names[index]);
+				if (pFunction == nullptr)
+					throw MSCompileException("reloadable function not found");
+
+				llvm::Function* thunk = llvm::Function::Create(pFunction->getFunctionType(), llvm::Function::ExternalLinkage, scriptName + "::" + names[index] + ".entry", pThunks.get());
+				thunk->setCallingConv(pFunction->getCallingConv());
+
+				llvm::BasicBlock* block = llvm::BasicBlock::Create(context, "", thunk);
+				llvm::BasicBlock* enterBlock = llvm::BasicBlock::Create(context, "enter", thunk);
+				llvm::BasicBlock* retryBlock = llvm::BasicBlock::Create(context, "retry", thunk);
+				llvm::BasicBlock* callBlock = llvm::BasicBlock::Create(context, "call", thunk);
+
+				llvm::IRBuilder<> builder(block);
+				builder.CreateBr(enterBlock);
+
+				builder.SetInsertPoint(enterBlock);
+				llvm::LoadInst* state = builder.CreateLoad(current);
+				state->setAlignment(alignment);
+				state->setAtomic(llvm::AtomicOrdering::SequentiallyConsistent);
+				builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, state, one, llvm::AtomicOrdering::SequentiallyConsistent);
+				llvm::LoadInst* check = builder.CreateLoad(current);
+				check->setAlignment(alignment);
+				check->setAtomic(llvm::AtomicOrdering::SequentiallyConsistent);
+				builder.CreateCondBr(builder.CreateICmpEQ(state, check), callBlock, retryBlock);
+
+				//	Reloaded meanwhile, the retired version may already be removed
+				builder.SetInsertPoint(retryBlock);
+				builder.CreateAtomicRMW(llvm::AtomicRMWInst::Sub, state, one, llvm::AtomicOrdering::Release);
+				builder.CreateBr(enterBlock);
+
+				builder.SetInsertPoint(callBlock);
+				llvm::Value* target = builder.CreateLoad(builder.CreateConstGEP1_32(state, index + 1));
+				llvm::Value* callee = builder.CreateIntToPtr(target, pFunction->getType());
+
+				std::vector<llvm::Value*> args;
+				for (auto& arg : thunk->args())
+					args.push_back(&arg);
+
+				//	Not a tail call, the count is decremented after it returns
+				llvm::CallInst* call = builder.CreateCall(callee, args);
+				call->setCallingConv(pFunction->getCallingConv());
+
+				builder.CreateAtomicRMW(llvm::AtomicRMWInst::Sub, state, one, llvm::AtomicOrdering::Release);
+
+				if (thunk->getReturnType()->isVoidTy())
+					builder.CreateRetVoid();
+				else
+					builder.CreateRet(call);
+			}
+			return pThunks;
+		}
+		//	New state with the targets of a version, made current by the caller
+		LONG_PTR* CreateReloadState(ReloadableScript& reloadable, const std::map<std::string, llvm::JITTargetAddress>& targets)
+		{
+			std::unique_ptr<LONG_PTR[]> pState(new LONG_PTR[targets.size() + 1]);
+			pState[0] = 0;
+
+			int index = 1;
+			for (auto& target : targets)
+				pState[index++] = static_cast<LONG_PTR>(target.second);
+
+			reloadable.states.push_back(std::move(pState));
+			return reloadable.states.back().get();
+		}
+		//	Host gets entry thunk addresses, they stay valid when the script is reloaded. thunkObjects is empty for new versions.
+		void AddReloadableScript(MSScript* pScript, ObjectLinkingLayerT::ObjSetHandleT objectSet, std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> thunkObjects)
+		{
+			const std::string& name = pScript->GetName();
+			ReloadableScript& reloadable = m_reloadableScripts[pScript];
+
+			reloadable.targets["$"] = m_pObjectLayer->findSymbolIn(objectSet, GetMangledName(name + "::$"), false).getAddress();
+			for (auto& s : pScript->GetExportedSymbols())
+				reloadable.targets[s.name] = reinterpret_cast<llvm::JITTargetAddress>(s.address);
+
+			if (thunkObjects.empty())
+				return;
+
+			LinkObjects(std::move(thunkObjects), reloadable.entryCode);
+			ObjectLinkingLayerT::ObjSetHandleT handle = reloadable.entryCode.objectSet;
+			reloadable.ppState = reinterpret_cast<LONG_PTR* volatile*>(m_pObjectLayer->findSymbolIn(handle, GetMangledName(name + "::$state"), false).getAddress());
+			*reloadable.ppState = CreateReloadState(reloadable, reloadable.targets);
+
+			for (auto& target : reloadable.targets)
+				reloadable.entries[target.first] = m_pObjectLayer->findSymbolIn(handle, GetMangledName(name + "::" + target.first + ".entry"), false).getAddress();
+
+			for (auto& s : pScript->GetExportedSymbols())
+				s.address = reinterpret_cast<void*>(reloadable.entries[s.name]);
+		}
+		//	Remove retired versions no thread runs anymore, threads entering a thunk now only count themselves in the current state
+		void RemoveIdleCode(ReloadableScript& reloadable)
+		{
+			//	Counts are read after the state was switched
+			MemoryBarrier();
+
+			for (auto it = reloadable.retired.begin(); it != reloadable.retired.end();)
+			{
+				if (static_cast<volatile LONG_PTR*>(it->pState)[0] == 0)
+				{
+					RemoveCode(it->loaded);
+					it = reloadable.retired.erase(it);
+				}
+				else
+				{
+					++it;
+				}
+			}
+		}
+		//	Host keeps the addresses it got, so it must be able to call them the same way
+		static bool HaveSameExports(MSScript* pScript, MSScript* pOther)
+		{
+			std::vector<MSSymbol>& symbols = pScript->GetExportedSymbols();
+			std::vector<MSSymbol>& otherSymbols = pOther->GetExportedSymbols();
+			if (symbols.size() != otherSymbols.size())
+				return false;
+
+			for (auto& s : symbols)
+			{
+				auto it = std::find_if(otherSymbols.begin(), otherSymbols.end(), [&](const MSSymbol& other) { return strcmp(s.name, other.name) == 0; });
+				if (it == otherSymbols.end() || it->functionData.resultType != s.functionData.resultType || it->functionData.count != s.functionData.count ||
+					!std::equal(s.functionData.parameterTypes, s.functionData.parameterTypes + s.functionData.count, it->functionData.parameterTypes))
+					return false;
+			}
+			return true;
+		}
+
+		//	Runtime functions are the same for every script, so only mangle them once
+		void RegisterRuntimeSymbols()
+		{
+			RegisterSymbol("hdlinc", ms_rt_hdlinc);
+			RegisterSymbol("hdldec", ms_rt_hdldec);
+			RegisterSymbol("hdlfree", ms_rt_hdlfree);
+			RegisterSymbol("strlen", ms_rt_strlen);
+			RegisterSymbol("strcat", ms_rt_strcat);
+			RegisterSymbol("strcmp", ms_rt_strcmp);
+			RegisterSymbol("substr", ms_rt_substr);
+			RegisterSymbol("strcat_scratch", ms_rt_strcat_scratch);
+			RegisterSymbol("substr_scratch", ms_rt_substr_scratch);
+			RegisterSymbol("strconcat_n", ms_rt_strconcat_n);
+			RegisterSymbol("strconcat_n_scratch", ms_rt_strconcat_n_scratch);
+			RegisterSymbol("strgetptr", ms_rt_strgetptr);
+			RegisterSymbol("tierup", MSTierManager::TierUp);
+		}
+
+		//	Run LLVM standard pipeline for the optimization level of the module
+		std::unique_ptr<llvm::Module> OptimizeModule(std::unique_ptr<llvm::Module> M)
+		{
+			MSOptimizationLevel level = MSOptimizer::GetOptimizationLevel(*M);
+
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+			pTarget->Optimize(*M);
+			GetTargetPool(level).Release(std::move(pTarget));
 			return std::move(M);
 		}
+		//	Machine code of lazy functions, O0 ones use fast instruction selection
+		llvm::object::OwningBinary<llvm::object::ObjectFile> GenerateCode(llvm::Module& M)
+		{
+			MSOptimizationLevel level = MSOptimizer::GetOptimizationLevel(M);
+
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+			llvm::object::OwningBinary<llvm::object::ObjectFile> object = MSCachingCompiler(pTarget->GetTargetMachine(), &m_objectCache)(M);
+			GetTargetPool(level).Release(std::move(pTarget));
+			return object;
+		}
+		//	One function per partition, so a function is only compiled when first called
+		CompileOnDemandLayerT* GetCompileOnDemandLayer()
+		{
+			if (!m_pCompileOnDemandLayer)
+			{
+				m_pCompileCallbackManager = MSCompileCallbackManager::Create(m_triple, &m_jitMutex);
+				m_pCompileOnDemandLayer = llvm::make_unique<CompileOnDemandLayerT>(
+					*m_pOptimizeLayer,
+					[](llvm::Function& F) { return std::set<llvm::Function*>({ &F }); },
+					*m_pCompileCallbackManager,
+					llvm::orc::createLocalIndirectStubsManagerBuilder(m_triple)
+				);
+			}
+			return m_pCompileOnDemandLayer.get();
+		}
+		//	Address in the code of a script, a stub for lazy scripts. Other versions of the script may define the same
+		//	names, so only its own code is searched. This does not compile lazy functions.
+		llvm::JITTargetAddress FindSymbolIn(const LoadedScript& loaded, const std::string& mangledName)
+		{
+			if (loaded.hasModuleSet)
+				return m_pCompileOnDemandLayer->findSymbolIn(loaded.moduleSet, mangledName, false).getAddress();
+			if (loaded.hasObjectSet)
+				return m_pObjectLayer->findSymbolIn(loaded.objectSet, mangledName, false).getAddress();
+			return 0;
+		}
+
+		//	Objects of a set are linked together, so they can reference each other. Other symbols are resolved with
+		//	pScriptSymbols, then the shared index. ppMemoryManager receives the memory manager of the set when not NULL.
+		ObjectLinkingLayerT::ObjSetHandleT LinkObjects(std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects,
+			std::shared_ptr<const MSSymbolIndex> pScriptSymbols, MSMemoryManager** ppMemoryManager = nullptr)
+		{
+			std::vector<std::unique_ptr<llvm::object::OwningBinary<llvm::object::ObjectFile>>> objectSet;
+			for (auto& object : objects)
+				objectSet.push_back(llvm::make_unique<llvm::object::OwningBinary<llvm::object::ObjectFile>>(std::move(object)));
+
+			std::unique_ptr<MSMemoryManager> pMemoryManager = std::make_unique<MSMemoryManager>(&m_slabAllocator);
+			if (ppMemoryManager != nullptr)
+				*ppMemoryManager = pMemoryManager.get();
+
+			return m_pObjectLayer->addObjectSet(std::move(objectSet),
+				std::move(pMemoryManager),
+				std::make_unique<MSSymbolResolver>(&m_symbolIndex, pScriptSymbols));
+		}
+		//	Code of a script, loaded receives the set
+		void LinkObjects(std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects, LoadedScript& loaded)
+		{
+			loaded.objectSet = LinkObjects(std::move(objects), loaded.pSymbols, &loaded.pMemoryManager);
+			loaded.hasObjectSet = true;
+		}
+
+		//	Number of partitions for parallel code generation, 1 to compile on the calling thread
+		unsigned GetPartitionCount(llvm::Module& module)
+		{
+			unsigned functionCount = 0;
+			for (auto& function : module)
+			{
+				if (!function.isDeclaration())
+					++functionCount;
+			}
+			return std::max(1u, std::min(std::thread::hardware_concurrency(), functionCount / MinFunctionsPerPartition));
+		}
+		//	Optimize and generate code on the calling thread, without the JIT lock
+		std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> CompileModule(std::unique_ptr<llvm::Module> pModule, std::vector<std::unique_ptr<llvm::MemoryBuffer>>* pObjects)
+		{
+			MSOptimizationLevel level = MSOptimizer::GetOptimizationLevel(*pModule);
+
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+			pTarget->Optimize(*pModule);
+
+			//	Object goes through the cache. The module is renamed to the capture token,
+			//	two compiles of the same script id must not share captured objects.
+			std::string token;
+			if (pObjects != nullptr)
+			{
+				token = m_objectCache.BeginCapture();
+				pModule->setModuleIdentifier(token);
+			}
+
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+			objects.push_back(MSCachingCompiler(pTarget->GetTargetMachine(), &m_objectCache)(*pModule));
+
+			if (pObjects != nullptr)
+				*pObjects = m_objectCache.TakeObjects(token);
+
+			GetTargetPool(level).Release(std::move(pTarget));
+			return objects;
+		}
+		//	Machine code of a partition, on a thread of its own. It is loaded in an IR context of the pool.
+		static void GeneratePartition(const llvm::SmallVector<char, 0>& bitcode, MSOptimizationLevel level, llvm::SmallVector<char, 0>& object)
+		{
+			std::unique_ptr<llvm::LLVMContext> pContext = GetContextPool().Acquire();
+			{
+				llvm::MemoryBufferRef buffer(llvm::StringRef(bitcode.data(), bitcode.size()), "partition");
+				llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(buffer, *pContext);
+				if (!module)
+				{
+					llvm::consumeError(module.takeError());
+					throw MSCompileException("invalid partition");
+				}
+
+				std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+
+				llvm::raw_svector_ostream stream(object);
+				llvm::legacy::PassManager codeGenPasses;
+				if (pTarget->GetTargetMachine().addPassesToEmitFile(codeGenPasses, stream, llvm::TargetMachine::CGFT_ObjectFile))
+					throw MSCompileException("cannot generate machine code");
+				codeGenPasses.run(**module);
+
+				GetTargetPool(level).Release(std::move(pTarget));
+			}
+			//	Partition module is destroyed
+			GetContextPool().Release(std::move(pContext));
+		}
+		/*
+		Optimize the whole module, so functions can still be inlined across partitions, then split it
+		and generate machine code for each partition on the worker pool. Each job takes an LLVM context
+		and a target machine from the pools, partitions are moved there as bitcode.
+		*/
+		std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> CompileParallel(std::unique_ptr<llvm::Module> pModule, unsigned partitionCount, std::vector<std::unique_ptr<llvm::MemoryBuffer>>* pObjects)
+		{
+			//	Partitions are generated at the level of the script
+			MSOptimizationLevel level = MSOptimizer::GetOptimizationLevel(*pModule);
+
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+			pTarget->Optimize(*pModule);
+			GetTargetPool(level).Release(std::move(pTarget));
+
+			//	Locals used by several partitions are made hidden globals, they are resolved within the set
+			std::vector<llvm::SmallVector<char, 0>> bitcodes;
+			llvm::SplitModule(std::move(pModule), partitionCount, [&](std::unique_ptr<llvm::Module> pPartition)
+			{
+				bitcodes.emplace_back();
+				llvm::raw_svector_ostream stream(bitcodes.back());
+				llvm::WriteBitcodeToFile(pPartition.get(), stream);
+			});
+
+			std::vector<llvm::SmallVector<char, 0>> buffers(bitcodes.size());
+			//	Exceptions cannot leave the pool threads, they are thrown again here
+			std::vector<std::string> errors(bitcodes.size());
+
+			std::vector<std::function<void()>> jobs;
+			for (size_t i = 0; i < bitcodes.size(); ++i)
+			{
+				jobs.push_back([&, i]()
+				{
+					try
+					{
+						GeneratePartition(bitcodes[i], level, buffers[i]);
+					}
+					catch (MSCompileException e)
+					{
+						errors[i] = e.what();
+					}
+					catch (...)
+					{
+						errors[i] = "cannot generate machine code";
+					}
+				});
+			}
+			GetWorkerPool()->Run(jobs);
+
+			for (auto& error : errors)
+			{
+				if (!error.empty())
+					throw MSCompileException(error.c_str());
+			}
+
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+			for (auto& buffer : buffers)
+			{
+				std::unique_ptr<llvm::MemoryBuffer> pBuffer = llvm::MemoryBuffer::getMemBufferCopy(llvm::StringRef(buffer.data(), buffer.size()));
+				if (pObjects != nullptr)
+					pObjects->push_back(llvm::MemoryBuffer::getMemBufferCopy(pBuffer->getBuffer()));
+
+				auto object = llvm::object::ObjectFile::createObjectFile(pBuffer->getMemBufferRef());
+				if (!object)
+				{
+					llvm::consumeError(object.takeError());
+					throw MSCompileException("invalid object file");
+				}
+				objects.emplace_back(std::move(*object), std::move(pBuffer));
+			}
+			return objects;
+		}
+
+		MSTierManager* GetTierManager()
+		{
+			if (!m_pTierManager)
+			{
+				m_pTierManager = std::make_unique<MSTierManager>(
+					[this](MSTierManager::Function& function)
+				{
+					return RecompileHotFunction(function);
+				}
+				);
+			}
+			return m_pTierManager.get();
+		}
+		/*
+		Replace each exported function by a stub, that counts calls then calls the actual function through a pointer.
+		The stub asks the tier manager to recompile the function when the count reaches threshold.
+		*/
+		std::vector<MSTierManager::Function*> InsertTierUpStubs(llvm::Module& module, MSTierManager::Script* pTierScript, int threshold)
+		{
+			llvm::LLVMContext& context = module.getContext();
+			llvm::Type* intType = llvm::Type::getInt32Ty(context);
+			llvm::Type* pointerType = llvm::Type::getInt8PtrTy(context);
+
+			std::array<llvm::Type*, 1> argTypes = { pointerType };
+			llvm::Function* tierUpFunc = llvm::Function::Create(llvm::FunctionType::get(llvm::Type::getVoidTy(context), argTypes, false),
+				llvm::Function::ExternalLinkage, "tierup", &module);
+
+			std::vector<llvm::Function*> exportedFunctions;
+			for (auto& function : module)
+			{
+				if (!function.isDeclaration() && !function.hasLocalLinkage() && function.getName() != pTierScript->name + "::$")
+					exportedFunctions.push_back(&function);
+			}
+
+			std::vector<MSTierManager::Function*> tierFunctions;
+			for (auto pFunction : exportedFunctions)
+			{
+				std::string name = pFunction->getName();
+				pFunction->setName(name + ".tier0");
+
+				//	Stub takes the place of the function, for the host and for other script functions
+				llvm::Function* stub = llvm::Function::Create(pFunction->getFunctionType(), llvm::Function::ExternalLinkage, name, &module);
+				pFunction->replaceAllUsesWith(stub);
+				pFunction->setLinkage(llvm::Function::InternalLinkage);
+
+				llvm::GlobalVariable* target = new llvm::GlobalVariable(module, pFunction->getType(), false, llvm::GlobalValue::ExternalLinkage, pFunction, name + ".ptr");
+				llvm::GlobalVariable* counter = new llvm::GlobalVariable(module, intType, false, llvm::GlobalValue::InternalLinkage, llvm::ConstantInt::get(intType, 0), name + ".count");
+
+				MSTierManager::Function* pTierFunction = GetTierManager()->AddFunction(pTierScript, name);
+				tierFunctions.push_back(pTierFunction);
+
+				llvm::BasicBlock* block = llvm::BasicBlock::Create(context, "", stub);
+				llvm::BasicBlock* tierUpBlock = llvm::BasicBlock::Create(context, "tierup", stub);
+				llvm::BasicBlock* callBlock = llvm::BasicBlock::Create(context, "call", stub);
+
+				//	Count is not atomic, a few calls may be missed when called from several threads
+				llvm::IRBuilder<> builder(block);
+				llvm::Value* count = builder.CreateAdd(builder.CreateLoad(counter), llvm::ConstantInt::get(intType, 1));
+				builder.CreateStore(count, counter);
+				llvm::Value* isHot = builder.CreateICmpEQ(count, llvm::ConstantInt::get(intType, threshold));
+				builder.CreateCondBr(isHot, tierUpBlock, callBlock, llvm::MDBuilder(context).createBranchWeights(1, threshold));
+
+				builder.SetInsertPoint(tierUpBlock);
+				llvm::Type* intPtrType = module.getDataLayout().getIntPtrType(context);
+				std::array<llvm::Value*, 1> tierUpArgs = { builder.CreateIntToPtr(llvm::ConstantInt::get(intPtrType, reinterpret_cast<uintptr_t>(pTierFunction)), pointerType) };
+				builder.CreateCall(tierUpFunc, tierUpArgs);
+				builder.CreateBr(callBlock);
+
+				//	Pointer is updated by the tier-up thread
+				builder.SetInsertPoint(callBlock);
+				llvm::LoadInst* callee = builder.CreateLoad(target);
+				callee->setAlignment(module.getDataLayout().getPointerABIAlignment());
+				callee->setAtomic(llvm::AtomicOrdering::Acquire);
+
+				std::vector<llvm::Value*> args;
+				for (auto& arg : stub->args())
+					args.push_back(&arg);
+
+				llvm::CallInst* call = builder.CreateCall(callee, args);
+				call->setTailCall();
+
+				if (stub->getReturnType()->isVoidTy())
+					builder.CreateRetVoid();
+				else
+					builder.CreateRet(call);
+			}
+			return tierFunctions;
+		}
+		//	Tier 0: compile without optimization, calls to exported functions go through counting stubs
+		void CompileTiered(MSScript* pScript, std::unique_ptr<llvm::Module> pModule, int threshold, LoadedScript& loaded)
+		{
+			//	Script variables are shared by both tiers, so give them a unique name and make them visible
+			std::vector<std::string> variables;
+			for (auto& variable : pModule->globals())
+			{
+				if (variable.hasName() && variable.hasLocalLinkage())
+				{
+					variable.setName(pScript->GetName() + "::" + variable.getName());
+					variable.setLinkage(llvm::GlobalValue::ExternalLinkage);
+					variables.push_back(variable.getName());
+				}
+			}
+
+			MSTierManager::Script* pTierScript = GetTierManager()->AddScript(pScript->GetName(), *pModule);
+			std::vector<MSTierManager::Function*> tierFunctions = InsertTierUpStubs(*pModule, pTierScript, threshold);
+
+			//	No optimization, so code generation uses fast instruction selection
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+			std::unique_ptr<MSTarget> pBaselineTarget = GetTargetPool(MSOptimizationLevel::MS_OPTIMIZATION_O0).Acquire();
+			objects.push_back(llvm::orc::SimpleCompiler(pBaselineTarget->GetTargetMachine())(*pModule));
+			GetTargetPool(MSOptimizationLevel::MS_OPTIMIZATION_O0).Release(std::move(pBaselineTarget));
+
+			LinkObjects(std::move(objects), loaded);
+			loaded.pTierScript = pTierScript;
+
+			//	Recompiled functions of this script are linked against its variables
+			for (auto& variable : variables)
+			{
+				std::string mangledName = GetMangledName(variable);
+				(*loaded.pSymbols)[mangledName] = m_pObjectLayer->findSymbolIn(loaded.objectSet, mangledName, false).getAddress();
+			}
+
+			for (auto pTierFunction : tierFunctions)
+				pTierFunction->ppTarget = reinterpret_cast<void**>(m_pObjectLayer->findSymbolIn(loaded.objectSet, GetMangledName(pTierFunction->name + ".ptr"), false).getAddress());
+		}
+		//	Machine code of a hot function, from the script IR. Everything else in the module becomes internal to it.
+		std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> GenerateHotFunction(llvm::LLVMContext& context, MSTierManager::Function& function, const std::string& name)
+		{
+			MSTierManager::Script* pTierScript = function.pScript;
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+
+			llvm::MemoryBufferRef buffer(llvm::StringRef(pTierScript->bitcode.data(), pTierScript->bitcode.size()), pTierScript->name);
+			llvm::Expected<std::unique_ptr<llvm::Module>> module = llvm::parseBitcodeFile(buffer, context);
+			if (!module)
+			{
+				llvm::consumeError(module.takeError());
+				return objects;
+			}
+			std::unique_ptr<llvm::Module> pModule = std::move(*module);
+
+			for (auto& f : *pModule)
+			{
+				if (f.isDeclaration())
+					continue;
+
+				if (f.getName() == function.name)
+					f.setName(name);
+				else
+					f.setLinkage(llvm::Function::InternalLinkage);
+			}
+			//	Script variables live in tier 0 module
+			for (auto& variable : pModule->globals())
+			{
+				if (!variable.hasLocalLinkage() && variable.hasInitializer())
+					variable.setInitializer(nullptr);
+			}
+
+			//	At least O2, this is what tiering is for
+			MSOptimizationLevel level = std::max(MSOptimizer::GetOptimizationLevel(*pModule), MSOptimizationLevel::MS_OPTIMIZATION_O2);
+
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool(level).Acquire();
+			MSOptimizer::RunOptimizationPipeline(*pModule, pTarget->GetTargetMachine(), level);
+			objects.push_back(llvm::orc::SimpleCompiler(pTarget->GetTargetMachine())(*pModule));
+			GetTargetPool(level).Release(std::move(pTarget));
+			return objects;
+		}
+		//	Tier 1: recompile a single function with optimizations, on the tier-up thread. The IR context comes from the
+		//	pool, so it is replaced once worn out like those of other compilations.
+		void* RecompileHotFunction(MSTierManager::Function& function)
+		{
+			MSTierManager::Script* pTierScript = function.pScript;
+			std::string name = function.name + ".tier1";
+
+			std::unique_ptr<llvm::LLVMContext> pContext = GetContextPool().Acquire();
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects = GenerateHotFunction(*pContext, function, name);
+			GetContextPool().Release(std::move(pContext));
+
+			if (objects.empty())
+				return nullptr;
+
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+
+			//	Tier-ups are rare, a linear search is enough
+			auto loaded = std::find_if(m_loadedScripts.begin(), m_loadedScripts.end(),
+				[&](const std::pair<MSScript* const, LoadedScript>& entry) { return entry.second.pTierScript == pTierScript; });
+			if (loaded == m_loadedScripts.end())
+				return nullptr;
+
+			//	Removed with the script
+			ObjectLinkingLayerT::ObjSetHandleT handle = LinkObjects(std::move(objects), loaded->second.pSymbols);
+			loaded->second.tierObjectSets.push_back(handle);
+			return reinterpret_cast<void*>(m_pObjectLayer->findSymbolIn(handle, GetMangledName(name), false).getAddress());
+		}
 	public:
+		//	Expensive parts are taken from the process-wide pools, or created on first use
 		MSContext()
 		{
-			llvm::InitializeNativeTarget();
-			llvm::InitializeNativeTargetAsmPrinter();
-			llvm::InitializeNativeTargetAsmParser();
+			InitializeLLVM();
 
-			auto targetMachine = llvm::EngineBuilder().selectTarget();
+			std::unique_ptr<MSTarget> pTarget = GetTargetPool().Acquire();
+			m_pLayout = llvm::make_unique<llvm::DataLayout>(pTarget->GetTargetMachine().createDataLayout());
+			m_triple = pTarget->GetTargetMachine().getTargetTriple();
+			GetTargetPool().Release(std::move(pTarget));
 
-			m_pLayout = llvm::make_unique<llvm::DataLayout>(targetMachine->createDataLayout());
+			RegisterRuntimeSymbols();
 
 			m_pObjectLayer = llvm::make_unique<llvm::orc::ObjectLinkingLayer<>>();
-			m_pCompileLayer = llvm::make_unique<llvm::orc::IRCompileLayer<llvm::orc::ObjectLinkingLayer<>>>(*m_pObjectLayer, llvm::orc::SimpleCompiler(*targetMachine));
-			//m_pCompileLayer = llvm::make_unique<llvm::orc::IRCompileLayer<llvm::orc::ObjectLinkingLayer<>>>(*m_pObjectLayer, MSCachingCompiler(*targetMachine));
+			m_pCompileLayer = llvm::make_unique<llvm::orc::IRCompileLayer<llvm::orc::ObjectLinkingLayer<>>>(*m_pObjectLayer,
+				[this](llvm::Module& M)
+			{
+				return GenerateCode(M);
+			}
+			);
 
-			m_pMemoryPool = std::make_unique<MemoryPool>(1024);
 			m_pOptimizeLayer = llvm::make_unique<IRTransformLayerT>(
 				*m_pCompileLayer,
 				[this](std::unique_ptr<llvm::Module> M)
@@ -145,66 +1029,267 @@ namespace MyScript
 			}
 			);
 		}
+		~MSContext()
+		{
+			//	Stop compile threads first, running compilations may still add tiered scripts.
+			//	Then the tier-up thread, before the layers it uses are destroyed.
+			m_pCompileQueue.reset();
+			//	Scripts still open are not unloaded when closed, their code goes with the layers
+			m_pLifetime.reset();
+			m_pTierManager.reset();
+		}
 
-		void UpdateSymbols(MSScript* pScript)
+		void UpdateSymbols(MSScript* pScript, const LoadedScript& loaded)
 		{
 			std::string name = pScript->GetName();
 
 			for (auto& s : pScript->GetExportedSymbols())
+				s.address = reinterpret_cast<void*>(FindSymbolIn(loaded, GetMangledName(name + "::" + s.name)));
+		}
+		//	Link a precompiled script, host symbols are those it was compiled against
+		void Link(MSScript* pScript, MSCacheEntry& entry)
+		{
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+			for (auto& pBuffer : entry.objects)
 			{
-				std::string mangledName = GetMangledName(name + "::" + s.name);
-				s.address = reinterpret_cast<void*>(m_pOptimizeLayer->findSymbol(mangledName, false).getAddress());
+				auto object = llvm::object::ObjectFile::createObjectFile(pBuffer->getMemBufferRef());
+				if (!object)
+				{
+					llvm::consumeError(object.takeError());
+					throw MSCompileException("invalid object file");
+				}
+				objects.emplace_back(std::move(*object), std::move(pBuffer));
 			}
+
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+
+			LoadedScript loaded;
+			RegisterImports(pScript, loaded);
+
+			LinkObjects(std::move(objects), loaded);
+
+			UpdateSymbols(pScript, loaded);
+			AddLoadedScript(pScript, std::move(loaded));
 		}
-		/*void Link(std::unique_ptr<llvm::MemoryBuffer> ObjBuffer)
+		//	pObjects receives a copy of the object files when not NULL, for the persistent cache. Lazy and tiered scripts have none.
+		//	pModule must be created in a context of AcquireContext, see ReleaseContext.
+		void Compile(MSScript* pScript, std::unique_ptr<llvm::Module> pModule, const MSCompileOptions& options, std::vector<std::unique_ptr<llvm::MemoryBuffer>>* pObjects = nullptr)
 		{
-			std::vector<std::unique_ptr<llvm::object::OwningBinary<llvm::object::ObjectFile>>> Objects;
+			pModule->setDataLayout(*m_pLayout);
 
-			auto Obj = llvm::object::ObjectFile::createObjectFile(ObjBuffer->getMemBufferRef());
+			MSOptimizer::ApplyCompileOptions(*pModule, options);
 
-			auto Object = llvm::make_unique<llvm::object::OwningBinary<llvm::object::ObjectFile>>(std::move(*Obj), std::move(ObjBuffer));
+			//	First version of a reloadable script also compiles the entry thunks
+			bool reloadable = options.reloadable && !options.tiered && !options.lazy;
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> thunkObjects;
+			if (reloadable && !IsReloadVersion(pScript->GetName()))
+				thunkObjects = CompileModule(CreateReloadThunks(*pModule, pScript), nullptr);
 
-			//	Add object to object layer
-			Objects.push_back(std::move(Object));
+			//	Eager scripts are optimized and compiled without the lock, so several threads compile at once. Only linking is serialized.
+			std::vector<llvm::object::OwningBinary<llvm::object::ObjectFile>> objects;
+			if (!options.tiered && !options.lazy)
+			{
+				unsigned partitionCount = GetPartitionCount(*pModule);
+				if (partitionCount > 1)
+					objects = CompileParallel(std::move(pModule), partitionCount, pObjects);
+				else
+					objects = CompileModule(std::move(pModule), pObjects);
+			}
 
-			std::unique_ptr<MSSymbolResolver> pResolver = std::make_unique<MSSymbolResolver>(m_pLayout.get());
-			m_pObjectLayer->addObjectSet(
-				Objects,
-				llvm::make_unique<llvm::SectionMemoryManager>(),
-				std::move(pResolver));
+			std::lock_guard<std::mutex> lock(m_jitMutex);
 
-		}*/
-		void Compile(MSScript* pScript, std::unique_ptr<llvm::Module> pModule)
-		{
-			//	Add the script module as a module set
+			LoadedScript loaded;
+			RegisterImports(pScript, loaded);
 
-			std::vector<std::unique_ptr<llvm::Module>> moduleSet;
-			
-			pModule->setDataLayout(*m_pLayout);
-			moduleSet.emplace_back(std::move(pModule));
+			if (options.tiered)
+			{
+				CompileTiered(pScript, std::move(pModule), options.tierUpThreshold != 0 ? options.tierUpThreshold : DefaultTierUpThreshold, loaded);
+			}
+			else if (options.lazy)
+			{
+				//	Lazy: functions are compiled separately on first call, through stubs
+				std::vector<std::unique_ptr<llvm::Module>> moduleSet;
+				moduleSet.emplace_back(std::move(pModule));
 
-			
-			// This is used to resolve symbols used INSIDE the script (like function calls and such)
-			std::unique_ptr<MSSymbolResolver> pResolver = std::make_unique<MSSymbolResolver>(pScript, m_pLayout.get());
+				//	One memory manager for all the functions of the script
+				std::unique_ptr<MSMemoryManager> pMemoryManager = std::make_unique<MSMemoryManager>(&m_slabAllocator);
+				loaded.pMemoryManager = pMemoryManager.get();
 
-			m_pOptimizeLayer->addModuleSet(std::move(moduleSet),
-				llvm::make_unique<llvm::SectionMemoryManager>(),
-				std::move(pResolver));
+				CompileOnDemandLayerT* pLayer = GetCompileOnDemandLayer();
+				m_pCompileCallbackManager->BeginModuleSet(&loaded.trampolines);
+				try
+				{
+					// This is used to resolve symbols used INSIDE the script (like function calls and such)
+					loaded.moduleSet = pLayer->addModuleSet(std::move(moduleSet),
+						std::move(pMemoryManager),
+						std::make_unique<MSSymbolResolver>(&m_symbolIndex, loaded.pSymbols));
+				}
+				catch (...)
+				{
+					m_pCompileCallbackManager->EndModuleSet();
+					throw;
+				}
+				m_pCompileCallbackManager->EndModuleSet();
+				loaded.hasModuleSet = true;
+			}
+			else
+			{
+				LinkObjects(std::move(objects), loaded);
+			}
 
 			//	Now that the script is actually compiled, update all the exported symbols so it can be used
-			UpdateSymbols(pScript);
+			UpdateSymbols(pScript, loaded);
+			if (reloadable)
+				AddReloadableScript(pScript, loaded.objectSet, std::move(thunkObjects));
+
+			AddLoadedScript(pScript, std::move(loaded));
 		}
 		void Execute(MSScript* pScript)
 		{
+			//	Interpreted scripts have no machine code
+			if (pScript->GetProgram())
+			{
+				MSInterpreter::Execute(*pScript->GetProgram());
+				return;
+			}
+
 			//	Just get the main function of the script and call it.
 			std::string mangledName = GetMangledName(pScript->GetName() + "::$");
-			void(*entryPoint)() = reinterpret_cast<void(*)()>(m_pOptimizeLayer->findSymbol(mangledName, false).getAddress());
 
-			entryPoint();
+			void(*entryPoint)() = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(m_jitMutex);
+
+				//	Current version of a reloadable script
+				auto reloadable = m_reloadableScripts.find(pScript);
+				auto loaded = m_loadedScripts.find(pScript);
+				if (reloadable != m_reloadableScripts.end())
+					entryPoint = reinterpret_cast<void(*)()>(reloadable->second.entries["$"]);
+				else if (loaded != m_loadedScripts.end())
+					entryPoint = reinterpret_cast<void(*)()>(FindSymbolIn(loaded->second, mangledName));
+			}
+
+			if (entryPoint != nullptr)
+				entryPoint();
+		}
+		//	Script name for the next version of a reloadable script, its symbols must not collide with the current ones
+		std::string GetReloadName(MSScript* pScript)
+		{
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+
+			auto reloadable = m_reloadableScripts.find(pScript);
+			if (reloadable == m_reloadableScripts.end())
+				throw MSCompileException("script is not reloadable");
+
+			std::string name = pScript->GetName() + ".v" + std::to_string(++reloadable->second.version);
+			m_reloadVersions.insert(name);
+			return name;
+		}
+		bool IsReloadVersion(const std::string& name)
+		{
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+			return m_reloadVersions.erase(name) != 0;
+		}
+		/*
+		Switch the entry thunks of a reloadable script to pNew, compiled from its new source with GetReloadName.
+		All of them switch at once with the state, calls in flight finish in the previous version. pNew gives its code to pScript.
+		*/
+		void Reload(MSScript* pScript, MSScript* pNew)
+		{
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+
+			auto reloadable = m_reloadableScripts.find(pScript);
+			auto next = m_reloadableScripts.find(pNew);
+			if (reloadable == m_reloadableScripts.end() || next == m_reloadableScripts.end())
+				throw MSCompileException("script is not reloadable");
+
+			if (!HaveSameExports(pScript, pNew))
+				throw MSCompileException("reloaded script must export the same functions");
+
+			ReloadableScript& state = reloadable->second;
+			LONG_PTR* pState = CreateReloadState(state, next->second.targets);
+			LONG_PTR* pOldState = reinterpret_cast<LONG_PTR*>(InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(state.ppState), pState));
+
+			state.retired.push_back({ std::move(m_loadedScripts[pScript]), pOldState });
+			m_loadedScripts[pScript] = std::move(m_loadedScripts[pNew]);
+			m_loadedScripts.erase(pNew);
+
+			state.targets = next->second.targets;
+			m_reloadableScripts.erase(next);
+
+			//	Versions no thread is counted in anymore, this one included when it was idle
+			RemoveIdleCode(state);
+
+			//	Its code now belongs to pScript
+			pNew->SetUnload(nullptr);
+		}
+		//	JIT memory of a script, or of the whole context when pScript is nullptr. Returns false for interpreted scripts,
+		//	which have no machine code. Only the baseline code of tiered scripts is counted.
+		bool GetMemoryInfo(MSScript* pScript, MSMemoryInfo& info)
+		{
+			if (pScript == nullptr)
+			{
+				info.codeSize = static_cast<DWORD>(m_slabAllocator.GetUsedSize(MSMemoryKind::Code));
+				info.readOnlySize = static_cast<DWORD>(m_slabAllocator.GetUsedSize(MSMemoryKind::ReadOnly));
+				info.readWriteSize = static_cast<DWORD>(m_slabAllocator.GetUsedSize(MSMemoryKind::ReadWrite));
+				info.reservedSize = static_cast<DWORD>(m_slabAllocator.GetReservedSize());
+				return true;
+			}
+
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+
+			auto it = m_loadedScripts.find(pScript);
+			if (it == m_loadedScripts.end() || it->second.pMemoryManager == nullptr)
+				return false;
+
+			MSMemoryManager* pMemoryManager = it->second.pMemoryManager;
+			info.codeSize = static_cast<DWORD>(pMemoryManager->GetSize(MSMemoryKind::Code));
+			info.readOnlySize = static_cast<DWORD>(pMemoryManager->GetSize(MSMemoryKind::ReadOnly));
+			info.readWriteSize = static_cast<DWORD>(pMemoryManager->GetSize(MSMemoryKind::ReadWrite));
+			info.reservedSize = 0;
+			return true;
+		}
+		MSWorkerPool* GetWorkerPool()
+		{
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+			if (!m_pWorkerPool)
+				m_pWorkerPool = std::make_unique<MSWorkerPool>();
+			return m_pWorkerPool.get();
+		}
+		MSCompileQueue* GetCompileQueue()
+		{
+			std::lock_guard<std::mutex> lock(m_jitMutex);
+			if (!m_pCompileQueue)
+				m_pCompileQueue = std::make_unique<MSCompileQueue>();
+			return m_pCompileQueue.get();
 		}
-		llvm::LLVMContext* GetContext()
+#ifdef MS_BENCHMARK_HOOKS
+		void SetRefcountCalls(bool enable)
 		{
-			return &m_context;
+			m_refcountCalls = enable;
+		}
+		bool GetRefcountCalls() const
+		{
+			return m_refcountCalls;
+		}
+#endif
+		//	IR context for a single compilation
+		std::unique_ptr<llvm::LLVMContext> AcquireContext()
+		{
+			return GetContextPool().Acquire();
+		}
+		//	Give back a context once its modules are destroyed. Lazy scripts keep theirs in the JIT until they are unloaded.
+		void ReleaseContext(MSScript* pScript, std::unique_ptr<llvm::LLVMContext> pContext, const MSCompileOptions& options)
+		{
+			if (options.lazy && !options.tiered)
+			{
+				std::lock_guard<std::mutex> lock(m_jitMutex);
+				m_loadedScripts[pScript].pContext = std::move(pContext);
+			}
+			else
+			{
+				GetContextPool().Release(std::move(pContext));
+			}
 		}
 	};
 }
\ No newline at end of file
@@ -2,6 +2,7 @@
 #include "stdafx.h"
 
 #include "IASTNode.hpp"
+#include "ASTUtility.hpp"
 
 #include "Utility.hpp"
 
@@ -45,6 +46,10 @@ namespace MyScript
 		llvm::BasicBlock*						outBlock;
 		ScopeType								type;
 		std::map<llvm::StringRef, llvm::Value*>	localSymbols;
+		//	Handles not owned by the scope (arguments never assigned), so never refcounted
+		std::set<llvm::Value*>					borrowedSymbols;
+		//	Statements following the one being compiled in this scope
+		ASTNodeList								nextStatements;
 	};
 	/*
 	This translate an AST to LLVM IR
@@ -85,13 +90,39 @@ namespace MyScript
 		// { i32 refcount, i8* ptr }
 		llvm::StructType* m_handleType = nullptr;
 
-		llvm::Function* m_handleIncrementFunc = nullptr;
-		llvm::Function* m_handleDecrementFunc = nullptr;
+		llvm::Function* m_handleFreeFunc = nullptr;
+#ifdef MS_BENCHMARK_HOOKS
+		llvm::Function* m_handleIncFunc = nullptr;
+		llvm::Function* m_handleDecFunc = nullptr;
+		//	Benchmark baseline, refcounting through hdlinc/hdldec calls as before it was generated inline
+		bool m_refcountCalls = false;
+#endif
 		llvm::Function* m_getstrptrFunc = nullptr;
+
+		llvm::Function* m_strlenFunc = nullptr;
+		llvm::Function* m_strcatFunc = nullptr;
+		llvm::Function* m_strcmpFunc = nullptr;
+		llvm::Function* m_substrFunc = nullptr;
+		llvm::Function* m_strcatScratchFunc = nullptr;
+		llvm::Function* m_substrScratchFunc = nullptr;
+		llvm::Function* m_strconcatFunc = nullptr;
+		llvm::Function* m_strconcatScratchFunc = nullptr;
+
+		//	Size of stack memory reserved for each string temporary that does not escape (handle included)
+		static const int ScratchStringSize = 256;
+		//	Longest string literal compared inline, longer ones call the runtime
+		static const int InlineCompareLength = 16;
 				
 		std::map<OrderableArrayRef<uint16_t>, llvm::Constant*> m_stringConstants;
 		std::string m_name;
 
+		//	Script being compiled declares functions with 'export'
+		bool m_usesExport = false;
+
+		//	Host symbols available to the script. Only declared in the module when first referenced.
+		llvm::StringMap<MSSymbol*>	m_imports;
+		std::vector<MSSymbol*>		m_usedImports;
+
 		//	Return type name
 		std::string DebugTypeName(llvm::Type* type)
 		{
@@ -515,109 +546,220 @@ namespace MyScript
 			else
 				throw MSCompileException("comparison operands not supported");
 		}
-		llvm::Value* ComputeAnd(llvm::Value* lhs, llvm::Value* rhs)
+		//	Convert a value to bool, as done by 'and'/'or'
+		llvm::Value* ComputeTruthValue(llvm::Value* value)
 		{
-			llvm::Type* lhsType = lhs->getType();
-			llvm::Type* rhsType = lhs->getType();
+			llvm::Type* type = value->getType();
 
-			if (lhsType == m_floatType)
+			if (type == m_floatType)
 			{
-				lhs = m_pBuilder->CreateFCmpONE(lhs, llvm::ConstantFP::get(*m_pContext, llvm::APFloat(0.0f)));
+				return m_pBuilder->CreateFCmpONE(value, llvm::ConstantFP::get(*m_pContext, llvm::APFloat(0.0f)));
 			}
-			else if (lhsType == m_intType)
+			else if (type == m_intType)
 			{
-				lhs = m_pBuilder->CreateICmpNE(lhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(32, 0)));
+				return m_pBuilder->CreateICmpNE(value, llvm::ConstantInt::get(*m_pContext, llvm::APInt(32, 0)));
 			}
-			else if (lhsType == m_boolType)
+			else if (type == m_boolType)
 			{
-				lhs = m_pBuilder->CreateICmpNE(lhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(1, 0)));
+				return value;
 			}
 			else
 				throw MSCompileException("comparison operands not supported");
+		}
 
-			if (rhsType == m_floatType)
-			{
-				rhs = m_pBuilder->CreateFCmpONE(rhs, llvm::ConstantFP::get(*m_pContext, llvm::APFloat(0.0f)));
-			}
-			else if (rhsType == m_intType)
+		/*
+		Generate code for handle reference counting.
+		Refcount update is done inline, only freeing the handle requires a runtime call.
+		*/
+		void ComputeHandleIncrement(llvm::Value* ptr)
+		{
+#ifdef MS_BENCHMARK_HOOKS
+			if (m_refcountCalls)
 			{
-				rhs = m_pBuilder->CreateICmpNE(rhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(32, 0)));
+				std::vector<llvm::Value*> args = { ptr };
+				m_pBuilder->CreateCall(m_handleIncFunc, args);
+				return;
 			}
-			else if (rhsType == m_boolType)
+#endif
+
+			//	null is never refcounted
+			if (llvm::isa<llvm::ConstantPointerNull>(ptr))
+				return;
+
+			//	Constant handles are never null, no need to check
+			if (llvm::isa<llvm::Constant>(ptr))
 			{
-				rhs = m_pBuilder->CreateICmpNE(rhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(1, 0)));
+				ComputeRefcountAdd(ptr, 1);
+				return;
 			}
-			else
-				throw std::exception();
 
-			return m_pBuilder->CreateAnd(lhs, rhs);
-		}
-		llvm::Value* ComputeOr(llvm::Value* lhs, llvm::Value* rhs)
-		{
-			llvm::Type* lhsType = lhs->getType();
-			llvm::Type* rhsType = rhs->getType();
+			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
 
+			llvm::BasicBlock* incBlock = llvm::BasicBlock::Create(*m_pContext, "hdlinc", function);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*m_pContext, "hdlinc.end", function);
 
-			if (lhsType == m_floatType)
-			{
-				lhs = m_pBuilder->CreateFCmpONE(lhs, llvm::ConstantFP::get(*m_pContext, llvm::APFloat(0.0f)));
-			}
-			else if (lhsType == m_intType)
-			{
-				lhs = m_pBuilder->CreateICmpNE(lhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(32, 0)));
-			}
-			else if (lhsType == m_boolType)
+			m_pBuilder->CreateCondBr(m_pBuilder->CreateIsNull(ptr), mergeBlock, incBlock);
+
+			m_pBuilder->SetInsertPoint(incBlock);
+			ComputeRefcountAdd(ptr, 1);
+			m_pBuilder->CreateBr(mergeBlock);
+
+			m_pBuilder->SetInsertPoint(mergeBlock);
+		}
+		void ComputeHandleDecrement(llvm::Value* ptr)
+		{
+#ifdef MS_BENCHMARK_HOOKS
+			if (m_refcountCalls)
 			{
-				lhs = m_pBuilder->CreateICmpNE(lhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(1, 0)));
+				std::vector<llvm::Value*> args = { ptr };
+				m_pBuilder->CreateCall(m_handleDecFunc, args);
+				return;
 			}
+#endif
+
+			if (llvm::isa<llvm::ConstantPointerNull>(ptr))
+				return;
+
+			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
+
+			llvm::BasicBlock* decBlock = llvm::BasicBlock::Create(*m_pContext, "hdldec", function);
+			llvm::BasicBlock* freeBlock = llvm::BasicBlock::Create(*m_pContext, "hdldec.free", function);
+			llvm::BasicBlock* storeBlock = llvm::BasicBlock::Create(*m_pContext, "hdldec.store", function);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*m_pContext, "hdldec.end", function);
+
+			if (llvm::isa<llvm::Constant>(ptr))
+				m_pBuilder->CreateBr(decBlock);
 			else
-				throw MSCompileException("comparison operands not supported");
+				m_pBuilder->CreateCondBr(m_pBuilder->CreateIsNull(ptr), mergeBlock, decBlock);
 
-			if (rhsType == m_floatType)
-			{
-				rhs = m_pBuilder->CreateFCmpONE(rhs, llvm::ConstantFP::get(*m_pContext, llvm::APFloat(0.0f)));
-			}
-			else if (rhsType == m_intType)
-			{
-				rhs = m_pBuilder->CreateICmpNE(rhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(32, 0)));
-			}
-			else if (rhsType == m_boolType)
+			//	Last reference, call the runtime to free memory
+			m_pBuilder->SetInsertPoint(decBlock);
+			llvm::Value* pRefcount = m_pBuilder->CreateStructGEP(m_handleType, ptr, 0);
+			llvm::Value* refcount = m_pBuilder->CreateLoad(pRefcount);
+			llvm::Value* isLast = m_pBuilder->CreateICmpEQ(refcount, llvm::ConstantInt::get(m_intType, 1));
+			m_pBuilder->CreateCondBr(isLast, freeBlock, storeBlock, llvm::MDBuilder(*m_pContext).createBranchWeights(1, 16));
+
+			m_pBuilder->SetInsertPoint(freeBlock);
+			std::vector<llvm::Value*> args =
 			{
-				rhs = m_pBuilder->CreateICmpNE(rhs, llvm::ConstantInt::get(*m_pContext, llvm::APInt(1, 0)));
-			}
-			else
-				throw MSCompileException("comparison operands not supported");
+				ptr
+			};
+			m_pBuilder->CreateCall(m_handleFreeFunc, args);
+			m_pBuilder->CreateBr(mergeBlock);
 
-			return m_pBuilder->CreateOr(lhs, rhs);
+			m_pBuilder->SetInsertPoint(storeBlock);
+			m_pBuilder->CreateStore(m_pBuilder->CreateSub(refcount, llvm::ConstantInt::get(m_intType, 1)), pRefcount);
+			m_pBuilder->CreateBr(mergeBlock);
+
+			m_pBuilder->SetInsertPoint(mergeBlock);
+		}
+		//	refcount += value, ptr must not be null
+		void ComputeRefcountAdd(llvm::Value* ptr, int value)
+		{
+			llvm::Value* pRefcount = m_pBuilder->CreateStructGEP(m_handleType, ptr, 0);
+			llvm::Value* refcount = m_pBuilder->CreateLoad(pRefcount);
+			m_pBuilder->CreateStore(m_pBuilder->CreateAdd(refcount, llvm::ConstantInt::get(m_intType, value)), pRefcount);
 		}
 
 		/*
-		Generate code for handle reference counting
+		Inline versions of string builtins.
 		*/
-		void ComputeHandleIncrement(llvm::Value* ptr)
+		//	Pointer to the string data of a handle, ptr must not be null
+		llvm::Value* ComputeStringPtr(llvm::Value* ptr)
 		{
+			llvm::Value* data = m_pBuilder->CreateLoad(m_pBuilder->CreateStructGEP(m_handleType, ptr, 1));
+			return m_pBuilder->CreatePointerCast(data, m_stringType->getPointerTo());
+		}
+		//	strlen(ptr), null strings have a length of 0
+		llvm::Value* ComputeStringLength(llvm::Value* ptr)
+		{
+			if (llvm::isa<llvm::ConstantPointerNull>(ptr))
+				return llvm::ConstantInt::get(m_intType, 0);
 
-			std::vector<llvm::Value*> args =
-			{
-				ptr
-			};
-			llvm::Value* result = m_pBuilder->CreateCall(m_handleIncrementFunc, args);
+			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
 
-			/*std::vector<llvm::Value*> idx =
-			{
-				llvm::ConstantInt::get(m_intType, 0),
-				llvm::ConstantInt::get(m_intType, 0),
-			};
-			llvm::Value* pRefcount = m_pBuilder->CreateGEP(ptr, idx);
-			m_pBuilder*/
+			llvm::BasicBlock* nullBlock = m_pBuilder->GetInsertBlock();
+			llvm::BasicBlock* loadBlock = llvm::BasicBlock::Create(*m_pContext, "strlen", function);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*m_pContext, "strlen.end", function);
+
+			m_pBuilder->CreateCondBr(m_pBuilder->CreateIsNull(ptr), mergeBlock, loadBlock);
+
+			m_pBuilder->SetInsertPoint(loadBlock);
+			llvm::Value* size = m_pBuilder->CreateLoad(m_pBuilder->CreateStructGEP(m_stringType, ComputeStringPtr(ptr), 0));
+			m_pBuilder->CreateBr(mergeBlock);
+
+			m_pBuilder->SetInsertPoint(mergeBlock);
+			llvm::PHINode* result = m_pBuilder->CreatePHI(m_intType, 2);
+			result->addIncoming(llvm::ConstantInt::get(m_intType, 0), nullBlock);
+			result->addIncoming(size, loadBlock);
+
+			return result;
 		}
-		void ComputeHandleDecrement(llvm::Value* ptr)
+		/*
+		strcmp(ptr, literal) == 0, literal includes the terminating 0.
+		Sizes are compared first. Characters of short literals are then compared inline, longer ones call the runtime.
+		*/
+		llvm::Value* ComputeStringEqualsLiteral(llvm::Value* ptr, llvm::ArrayRef<uint16_t> literal)
 		{
-			std::vector<llvm::Value*> args =
+			llvm::ArrayRef<uint16_t> chars = literal.drop_back();
+
+			//	null and "" are equal
+			if (chars.empty())
+				return m_pBuilder->CreateICmpEQ(ComputeStringLength(ptr), llvm::ConstantInt::get(m_intType, 0));
+
+			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
+
+			llvm::BasicBlock* nullBlock = m_pBuilder->GetInsertBlock();
+			llvm::BasicBlock* sizeBlock = llvm::BasicBlock::Create(*m_pContext, "streq", function);
+			llvm::BasicBlock* dataBlock = llvm::BasicBlock::Create(*m_pContext, "streq.data", function);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*m_pContext, "streq.end", function);
+
+			m_pBuilder->CreateCondBr(m_pBuilder->CreateIsNull(ptr), mergeBlock, sizeBlock);
+
+			m_pBuilder->SetInsertPoint(sizeBlock);
+			llvm::Value* str = ComputeStringPtr(ptr);
+			llvm::Value* size = m_pBuilder->CreateLoad(m_pBuilder->CreateStructGEP(m_stringType, str, 0));
+			llvm::Value* sameSize = m_pBuilder->CreateICmpEQ(size, llvm::ConstantInt::get(m_intType, chars.size()));
+			m_pBuilder->CreateCondBr(sameSize, dataBlock, mergeBlock);
+
+			m_pBuilder->SetInsertPoint(dataBlock);
+			llvm::Value* equals = nullptr;
+			if (chars.size() <= InlineCompareLength)
 			{
-				ptr
-			};
-			llvm::Value* result = m_pBuilder->CreateCall(m_handleDecrementFunc, args);
+				//	OR together the differences of each character, no branch
+				llvm::Value* diff = llvm::ConstantInt::get(m_charType, 0);
+				for (int i = 0; i < chars.size(); ++i)
+				{
+					std::vector<llvm::Value*> indices =
+					{
+						llvm::ConstantInt::get(m_intType, 0),
+						llvm::ConstantInt::get(m_intType, 1),
+						llvm::ConstantInt::get(m_intType, i),
+					};
+					llvm::Value* c = m_pBuilder->CreateLoad(m_pBuilder->CreateInBoundsGEP(m_stringType, str, indices));
+					diff = m_pBuilder->CreateOr(diff, m_pBuilder->CreateXor(c, llvm::ConstantInt::get(m_charType, chars[i])));
+				}
+				equals = m_pBuilder->CreateICmpEQ(diff, llvm::ConstantInt::get(m_charType, 0));
+			}
+			else
+			{
+				std::vector<llvm::Value*> args =
+				{
+					ptr,
+					GetConstantString(OrderableArrayRef<uint16_t>(literal.data(), literal.size())),
+				};
+				equals = m_pBuilder->CreateICmpEQ(m_pBuilder->CreateCall(m_strcmpFunc, args), llvm::ConstantInt::get(m_intType, 0));
+			}
+			dataBlock = m_pBuilder->GetInsertBlock();
+			m_pBuilder->CreateBr(mergeBlock);
+
+			m_pBuilder->SetInsertPoint(mergeBlock);
+			llvm::PHINode* result = m_pBuilder->CreatePHI(m_boolType, 3);
+			result->addIncoming(llvm::ConstantInt::getFalse(*m_pContext), nullBlock);
+			result->addIncoming(llvm::ConstantInt::getFalse(*m_pContext), sizeBlock);
+			result->addIncoming(equals, dataBlock);
+
+			return result;
 		}
 
 		bool IsSymbolDefined(const llvm::StringRef& s)
@@ -629,11 +771,12 @@ namespace MyScript
 					return true;
 			}
 
-			return false;
+			//	Imports live in global scope, even if not declared yet
+			return m_imports.count(s) != 0;
 		}
 
-		//	Get symbol with name. Throw Symbol not found exception on failure.
-		llvm::Value* GetSymbol(const llvm::StringRef& s)
+		//	Symbol with name, nullptr if not declared. Unlike GetSymbol, imports not used yet are not declared.
+		llvm::Value* FindDeclaredSymbol(const llvm::StringRef& s)
 		{
 			for (auto itScope = m_scopes.rbegin(); itScope != m_scopes.rend(); ++itScope)
 			{
@@ -641,6 +784,20 @@ namespace MyScript
 				if (it != itScope->localSymbols.end())
 					return it->second;
 			}
+			return nullptr;
+		}
+
+		//	Get symbol with name. Throw Symbol not found exception on failure.
+		llvm::Value* GetSymbol(const llvm::StringRef& s)
+		{
+			llvm::Value* val = FindDeclaredSymbol(s);
+			if (val)
+				return val;
+
+			//	Not declared yet, maybe an import
+			auto itImport = m_imports.find(s);
+			if (itImport != m_imports.end())
+				return CreateImportDeclaration(itImport->second);
 			
 			throw MSCompileException(("unresolved symbol " + s).str().c_str());
 		}
@@ -719,11 +876,15 @@ namespace MyScript
 			
 			llvm::FunctionType* funcType = llvm::FunctionType::get(llvm::Type::getVoidTy(*m_pContext), argTypes, false);
 
-			m_handleIncrementFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hdlinc", m_pModule.get());
-			m_handleDecrementFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hdldec", m_pModule.get());
+			m_handleFreeFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hdlfree", m_pModule.get());
+#ifdef MS_BENCHMARK_HOOKS
+			m_handleIncFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hdlinc", m_pModule.get());
+			m_handleDecFunc = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, "hdldec", m_pModule.get());
+#endif
 
 			//	Register string functions
-			m_scopes[0].localSymbols["strlen"] = llvm::Function::Create(llvm::FunctionType::get(m_intType, argTypes, false), llvm::Function::ExternalLinkage, "strlen", m_pModule.get());
+			m_strlenFunc = llvm::Function::Create(llvm::FunctionType::get(m_intType, argTypes, false), llvm::Function::ExternalLinkage, "strlen", m_pModule.get());
+			m_scopes[0].localSymbols["strlen"] = m_strlenFunc;
 
 			std::array<llvm::Type*, 2> strconcat_argTypes;
 			strconcat_argTypes[0] = m_handleType->getPointerTo();
@@ -731,11 +892,13 @@ namespace MyScript
 
 			llvm::FunctionType* strconcat_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), strconcat_argTypes, false);
 
-			m_scopes[0].localSymbols["strcat"] = llvm::Function::Create(strconcat_funcType, llvm::Function::ExternalLinkage, "strcat", m_pModule.get());
+			m_strcatFunc = llvm::Function::Create(strconcat_funcType, llvm::Function::ExternalLinkage, "strcat", m_pModule.get());
+			m_scopes[0].localSymbols["strcat"] = m_strcatFunc;
 
 			llvm::FunctionType* strcmp_funcType = llvm::FunctionType::get(m_intType, strconcat_argTypes, false);
 
-			m_scopes[0].localSymbols["strcmp"] = llvm::Function::Create(strcmp_funcType, llvm::Function::ExternalLinkage, "strcmp", m_pModule.get());
+			m_strcmpFunc = llvm::Function::Create(strcmp_funcType, llvm::Function::ExternalLinkage, "strcmp", m_pModule.get());
+			m_scopes[0].localSymbols["strcmp"] = m_strcmpFunc;
 
 
 			std::array<llvm::Type*, 3> substr_argTypes;
@@ -745,11 +908,61 @@ namespace MyScript
 
 			llvm::FunctionType* substr_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), substr_argTypes, false);
 			
-			m_scopes[0].localSymbols["substr"] = llvm::Function::Create(substr_funcType, llvm::Function::ExternalLinkage, "substr", m_pModule.get());
+			m_substrFunc = llvm::Function::Create(substr_funcType, llvm::Function::ExternalLinkage, "substr", m_pModule.get());
+			m_scopes[0].localSymbols["substr"] = m_substrFunc;
+
+			//	Scratch versions take a buffer and its size as additional arguments
+			std::array<llvm::Type*, 4> strconcat_scratch_argTypes;
+			strconcat_scratch_argTypes[0] = m_handleType->getPointerTo();
+			strconcat_scratch_argTypes[1] = m_handleType->getPointerTo();
+			strconcat_scratch_argTypes[2] = m_pointerType;
+			strconcat_scratch_argTypes[3] = m_intType;
+
+			llvm::FunctionType* strconcat_scratch_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), strconcat_scratch_argTypes, false);
+			m_strcatScratchFunc = llvm::Function::Create(strconcat_scratch_funcType, llvm::Function::ExternalLinkage, "strcat_scratch", m_pModule.get());
+
+			std::array<llvm::Type*, 5> substr_scratch_argTypes;
+			substr_scratch_argTypes[0] = m_handleType->getPointerTo();
+			substr_scratch_argTypes[1] = m_intType;
+			substr_scratch_argTypes[2] = m_intType;
+			substr_scratch_argTypes[3] = m_pointerType;
+			substr_scratch_argTypes[4] = m_intType;
+
+			llvm::FunctionType* substr_scratch_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), substr_scratch_argTypes, false);
+			m_substrScratchFunc = llvm::Function::Create(substr_scratch_funcType, llvm::Function::ExternalLinkage, "substr_scratch", m_pModule.get());
+
+			//	N-ary concatenation, takes an array of handles
+			std::array<llvm::Type*, 2> strconcat_n_argTypes;
+			strconcat_n_argTypes[0] = m_handleType->getPointerTo()->getPointerTo();
+			strconcat_n_argTypes[1] = m_intType;
+
+			llvm::FunctionType* strconcat_n_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), strconcat_n_argTypes, false);
+			m_strconcatFunc = llvm::Function::Create(strconcat_n_funcType, llvm::Function::ExternalLinkage, "strconcat_n", m_pModule.get());
+
+			std::array<llvm::Type*, 4> strconcat_n_scratch_argTypes;
+			strconcat_n_scratch_argTypes[0] = m_handleType->getPointerTo()->getPointerTo();
+			strconcat_n_scratch_argTypes[1] = m_intType;
+			strconcat_n_scratch_argTypes[2] = m_pointerType;
+			strconcat_n_scratch_argTypes[3] = m_intType;
+
+			llvm::FunctionType* strconcat_n_scratch_funcType = llvm::FunctionType::get(m_handleType->getPointerTo(), strconcat_n_scratch_argTypes, false);
+			m_strconcatScratchFunc = llvm::Function::Create(strconcat_n_scratch_funcType, llvm::Function::ExternalLinkage, "strconcat_n_scratch", m_pModule.get());
 
 
 			llvm::FunctionType* strgetptr_funcType = llvm::FunctionType::get(m_charType->getPointerTo(), argTypes, false);
 			m_getstrptrFunc = llvm::Function::Create(strgetptr_funcType, llvm::Function::ExternalLinkage, "strgetptr", m_pModule.get());
+
+			//	None of the runtime functions throw or call back into the script. Those that only read strings can be CSE'd and hoisted out of loops.
+			for (auto func : { m_handleFreeFunc, m_strlenFunc, m_strcatFunc, m_strcmpFunc, m_substrFunc, m_strcatScratchFunc,
+				m_substrScratchFunc, m_strconcatFunc, m_strconcatScratchFunc, m_getstrptrFunc })
+			{
+				func->addFnAttr(llvm::Attribute::NoUnwind);
+				func->addFnAttr(llvm::Attribute::NoRecurse);
+			}
+			for (auto func : { m_strlenFunc, m_strcmpFunc, m_getstrptrFunc })
+			{
+				func->addFnAttr(llvm::Attribute::ReadOnly);
+			}
 		}
 
 		llvm::Value* ConvertStringToCString(llvm::Value* ptr)
@@ -836,64 +1049,308 @@ namespace MyScript
 		{
 			*isRValue = true;
 
+			if (pNode->m_operator == MSOperator::MS_OPERATOR_AND || pNode->m_operator == MSOperator::MS_OPERATOR_OR)
+				return CompileLogicalOperation(pNode);
+
+			if (IsLiteralStringComparison(pNode))
+				return CompileLiteralStringComparison(pNode);
+
 			bool lhsIsRValue;
 			bool rhsIsRValue;
 			llvm::Value* lhs = CompileExpression(pNode->m_expression1, &lhsIsRValue);
 			llvm::Value* rhs = CompileExpression(pNode->m_expression2, &rhsIsRValue);
 
+			//	Keep the original handles, operands may be converted below
+			llvm::Value* lhsHandle = lhsIsRValue && IsHandlePtr(lhs) ? lhs : nullptr;
+			llvm::Value* rhsHandle = rhsIsRValue && IsHandlePtr(rhs) ? rhs : nullptr;
+
 			llvm::Type* type = ConvertValuesForOperation(&lhs, &rhs);
 
+			llvm::Value* result = nullptr;
 			switch (pNode->m_operator)
 			{
 			case MSOperator::MS_OPERATOR_ADD:
-				return ComputeAdd(lhs, rhs);
-			case MSOperator::MS_OPERATOR_AND:
-				return ComputeAnd(lhs, rhs);
+				result = ComputeAdd(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_DIVIDE:
-				return ComputeDivide(lhs, rhs);
+				result = ComputeDivide(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_EQUALITY:
-				return ComputeEquality(lhs, rhs);
+				result = ComputeEquality(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_GREATER:
-				return ComputeGreater(lhs, rhs);
+				result = ComputeGreater(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_GREATEREQUAL:
-				return ComputeGreaterOrEqual(lhs, rhs);
+				result = ComputeGreaterOrEqual(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_INEQUALITY:
-				return ComputeInequality(lhs, rhs);
+				result = ComputeInequality(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_LESSER:
-				return ComputeLesser(lhs, rhs);
+				result = ComputeLesser(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_LESSEREQUAL:
-				return ComputeLesserOrEqual(lhs, rhs);
+				result = ComputeLesserOrEqual(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_MODULO:
-				return ComputeModulo(lhs, rhs);
+				result = ComputeModulo(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_MULTIPLY:
-				return ComputeMultiply(lhs, rhs);
-			case MSOperator::MS_OPERATOR_OR:
-				return ComputeOr(lhs, rhs);
+				result = ComputeMultiply(lhs, rhs);
+				break;
 			case MSOperator::MS_OPERATOR_SUBTRACT:
-				return ComputeSubtract(lhs, rhs);
+				result = ComputeSubtract(lhs, rhs);
+				break;
 			default:
 				throw std::exception();
 			}
 
 			//	Now that we dont need it anymore, destroy if RValue
-			if (lhsIsRValue && IsHandlePtr(lhs))
+			if (lhsHandle)
 			{
-				ComputeHandleDecrement(lhs);
+				ComputeHandleDecrement(lhsHandle);
 			}
-			if (rhsIsRValue && IsHandlePtr(rhs))
+			if (rhsHandle)
 			{
-				ComputeHandleDecrement(rhs);
+				ComputeHandleDecrement(rhsHandle);
 			}
+
+			return result;
 		}
-		llvm::Value* CompileExpression(ASTCallNode* pNode, bool* isRValue)
+		/*
+		Short-circuit 'and'/'or': the right operand is only evaluated when the left one does not decide the result.
+		Each operand is compiled in its own block, so the string temporaries it creates are also released there.
+		*/
+		llvm::Value* CompileLogicalOperation(ASTBinaryOperationNode* pNode)
+		{
+			bool isAnd = pNode->m_operator == MSOperator::MS_OPERATOR_AND;
+
+			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
+
+			llvm::Value* lhs = CompileCondition(pNode->m_expression1);
+			//	Operand may have created blocks (nested 'and'/'or', inline refcounting)
+			llvm::BasicBlock* lhsBlock = m_pBuilder->GetInsertBlock();
+
+			llvm::BasicBlock* rhsBlock = llvm::BasicBlock::Create(*m_pContext, isAnd ? "and.rhs" : "or.rhs", function);
+			llvm::BasicBlock* mergeBlock = llvm::BasicBlock::Create(*m_pContext, isAnd ? "and.end" : "or.end");
+
+			if (isAnd)
+				m_pBuilder->CreateCondBr(lhs, rhsBlock, mergeBlock);
+			else
+				m_pBuilder->CreateCondBr(lhs, mergeBlock, rhsBlock);
+
+			m_pBuilder->SetInsertPoint(rhsBlock);
+			llvm::Value* rhs = CompileCondition(pNode->m_expression2);
+			rhsBlock = m_pBuilder->GetInsertBlock();
+			m_pBuilder->CreateBr(mergeBlock);
+
+			function->getBasicBlockList().push_back(mergeBlock);
+			m_pBuilder->SetInsertPoint(mergeBlock);
+
+			llvm::PHINode* result = m_pBuilder->CreatePHI(m_boolType, 2);
+			result->addIncoming(llvm::ConstantInt::get(m_boolType, isAnd ? 0 : 1), lhsBlock);
+			result->addIncoming(rhs, rhsBlock);
+
+			return result;
+		}
+		//	strcmp(s, "literal") == 0, strcmp(s, null) != 0 and such
+		bool IsLiteralStringComparison(ASTBinaryOperationNode* pNode)
+		{
+			if (pNode->m_operator != MSOperator::MS_OPERATOR_EQUALITY && pNode->m_operator != MSOperator::MS_OPERATOR_INEQUALITY)
+				return false;
+
+			IASTNode* pCall = pNode->m_expression1;
+			IASTNode* pZero = pNode->m_expression2;
+			if (!IsCallTo(pCall, m_strcmpFunc))
+				std::swap(pCall, pZero);
+
+			if (!IsCallTo(pCall, m_strcmpFunc) || !is_type<ASTIntegerNode>(pZero) || dynamic_cast<ASTIntegerNode*>(pZero)->m_value != 0)
+				return false;
+
+			ASTCallNode* pCallNode = dynamic_cast<ASTCallNode*>(pCall);
+			if (pCallNode->m_arguments.size() != 2)
+				return false;
+
+			return IsStringLiteral(pCallNode->m_arguments[0]) || IsStringLiteral(pCallNode->m_arguments[1]);
+		}
+		bool IsStringLiteral(IASTNode* pNode)
+		{
+			return is_type<ASTStringNode>(pNode) || is_type<ASTNullNode>(pNode);
+		}
+		//	Inline comparison against the literal, the runtime strcmp is not called
+		llvm::Value* CompileLiteralStringComparison(ASTBinaryOperationNode* pNode)
+		{
+			ASTCallNode* pCallNode = dynamic_cast<ASTCallNode*>(is_type<ASTCallNode>(pNode->m_expression1) ? pNode->m_expression1 : pNode->m_expression2);
+
+			IASTNode* pString = pCallNode->m_arguments[0];
+			IASTNode* pLiteral = pCallNode->m_arguments[1];
+			if (!IsStringLiteral(pLiteral))
+				std::swap(pString, pLiteral);
+
+			//	null compares equal to ""
+			static const uint16_t emptyString[] = { 0 };
+			llvm::ArrayRef<uint16_t> literal = emptyString;
+			if (is_type<ASTStringNode>(pLiteral))
+				literal = dynamic_cast<ASTStringNode*>(pLiteral)->m_value;
+
+			bool isRValue;
+			llvm::Value* ptr = CompileStringOperand(pString, &isRValue);
+
+			llvm::Value* result = ComputeStringEqualsLiteral(ptr, literal);
+			if (pNode->m_operator == MSOperator::MS_OPERATOR_INEQUALITY)
+				result = m_pBuilder->CreateNot(result);
+
+			//	Now that we dont need it anymore, destroy if RValue
+			if (isRValue)
+			{
+				ComputeHandleDecrement(ptr);
+			}
+
+			return result;
+		}
+		//	Compile an operand of 'and'/'or' to a bool
+		llvm::Value* CompileCondition(IASTNode* pNode)
+		{
+			bool isRValue;
+			llvm::Value* value = CompileExpression(pNode, &isRValue);
+			return ComputeTruthValue(value);
+		}
+		//	Arguments that are only read during the call. Host functions only get a C-string, so cannot keep the handle either.
+		bool IsNonEscapingArgument(llvm::Function* func, llvm::Argument* arg)
+		{
+			if (func == m_strlenFunc || func == m_strcmpFunc)
+				return true;
+
+			return arg->getType() == m_charType->getPointerTo();
+		}
+		//	True if pNode is a call to func
+		bool IsCallTo(IASTNode* pNode, llvm::Function* func)
+		{
+			if (!is_type<ASTCallNode>(pNode))
+				return false;
+
+			//	Only a lookup, an import must not be declared (and linked) because the optimizer looked at its call
+			return FindDeclaredSymbol(dynamic_cast<ASTCallNode*>(pNode)->m_name) == func;
+		}
+		//	String temporaries that can be allocated in scratch memory
+		bool IsScratchCandidate(IASTNode* pNode)
+		{
+			return IsCallTo(pNode, m_strcatFunc) || IsCallTo(pNode, m_substrFunc);
+		}
+		//	Compile a strcat/substr call whose result does not escape, so it can live on the stack of the current function
+		llvm::Value* CompileScratchString(ASTCallNode* pNode, bool* isRValue)
 		{
 			*isRValue = true;
 
-			llvm::Function* func = llvm::dyn_cast<llvm::Function>(GetSymbol(pNode->m_name));
-			if (!func)
-				throw std::exception();
+			llvm::AllocaInst* buffer = CreateAlloca(llvm::ArrayType::get(llvm::Type::getInt8Ty(*m_pContext), ScratchStringSize));
+			buffer->setAlignment(8);
+
+			std::vector<llvm::Value*> scratchArgs =
+			{
+				m_pBuilder->CreatePointerCast(buffer, m_pointerType),
+				llvm::ConstantInt::get(m_intType, ScratchStringSize),
+			};
+
+			if (IsCallTo(pNode, m_strcatFunc))
+			{
+				if (IsNestedConcatenation(pNode))
+					return CompileConcatenation(pNode, m_strconcatScratchFunc, scratchArgs);
+				else
+					return CompileCall(pNode, m_strcatScratchFunc, scratchArgs);
+			}
+			else
+				return CompileCall(pNode, m_substrScratchFunc, scratchArgs);
+		}
+
+		//	String that is only read by the caller, temporaries can use scratch memory
+		llvm::Value* CompileStringOperand(IASTNode* pNode, bool* isRValue)
+		{
+			llvm::Value* value = nullptr;
+			if (IsScratchCandidate(pNode))
+				value = CompileScratchString(dynamic_cast<ASTCallNode*>(pNode), isRValue);
+			else
+				value = CompileExpression(pNode, isRValue);
+
+			if (!IsHandlePtr(value))
+				throw MSCompileException("string expected");
+
+			return value;
+		}
+
+		//	strcat(strcat(a, b), c) and such. These are compiled as a single concatenation.
+		bool IsNestedConcatenation(ASTCallNode* pNode)
+		{
+			if (pNode->m_arguments.size() != 2)
+				return false;
+
+			for (auto pArgument : pNode->m_arguments)
+			{
+				if (IsCallTo(pArgument, m_strcatFunc) && dynamic_cast<ASTCallNode*>(pArgument)->m_arguments.size() == 2)
+					return true;
+			}
+			return false;
+		}
+		//	Get all operands of nested strcat calls, from left to right
+		void FlattenConcatenation(ASTCallNode* pNode, std::vector<IASTNode*>& parts)
+		{
+			for (auto pArgument : pNode->m_arguments)
+			{
+				if (IsCallTo(pArgument, m_strcatFunc) && dynamic_cast<ASTCallNode*>(pArgument)->m_arguments.size() == 2)
+					FlattenConcatenation(dynamic_cast<ASTCallNode*>(pArgument), parts);
+				else
+					parts.push_back(pArgument);
+			}
+		}
+		//	Compile nested strcat calls into a single call to func (strconcat_n or its scratch version)
+		llvm::Value* CompileConcatenation(ASTCallNode* pNode, llvm::Function* func, const std::vector<llvm::Value*>& extraArgs)
+		{
+			std::vector<IASTNode*> parts;
+			FlattenConcatenation(pNode, parts);
+
+			llvm::ArrayType* arrayType = llvm::ArrayType::get(m_handleType->getPointerTo(), parts.size());
+			llvm::AllocaInst* array = CreateAlloca(arrayType);
+
+			std::vector<llvm::Value*> values(parts.size());
+			std::vector<bool> valueRValues(parts.size());
+			for (int i = 0; i < parts.size(); ++i)
+			{
+				//	Parts are only read, so temporaries can be in scratch memory too
+				bool isRValue;
+				if (IsScratchCandidate(parts[i]))
+					values[i] = CompileScratchString(dynamic_cast<ASTCallNode*>(parts[i]), &isRValue);
+				else
+					values[i] = CompileExpression(parts[i], &isRValue);
+
+				if (!IsHandlePtr(values[i]))
+					throw MSCompileException("strcat operands must be strings");
+
+				valueRValues[i] = isRValue;
+				m_pBuilder->CreateStore(values[i], m_pBuilder->CreateConstGEP2_32(arrayType, array, 0, i));
+			}
 
+			std::vector<llvm::Value*> args =
+			{
+				m_pBuilder->CreateConstGEP2_32(arrayType, array, 0, 0),
+				llvm::ConstantInt::get(m_intType, parts.size()),
+			};
+			args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+
+			llvm::Value* result = m_pBuilder->CreateCall(func, args);
+
+			for (int i = 0; i < values.size(); ++i)
+			{
+				if (valueRValues[i])
+					ComputeHandleDecrement(values[i]);
+			}
+
+			return result;
+		}
+		llvm::Value* CompileCall(ASTCallNode* pNode, llvm::Function* func, const std::vector<llvm::Value*>& extraArgs)
+		{
 			std::vector<llvm::Value*> args(pNode->m_arguments.size());
+			//	Values before C-string conversion, so string temporaries can be destroyed after the call
+			std::vector<llvm::Value*> handles(pNode->m_arguments.size());
 			std::vector<bool> argRValues(pNode->m_arguments.size());
 
 			auto argIt = func->arg_begin();
@@ -902,8 +1359,12 @@ namespace MyScript
 			{
 				//	fuck vector<bool>
 				bool tmpArgRValue;
-				args[i] = CompileExpression(pNode->m_arguments[i], &tmpArgRValue);
+				if (IsNonEscapingArgument(func, &*argIt) && IsScratchCandidate(pNode->m_arguments[i]))
+					args[i] = CompileScratchString(dynamic_cast<ASTCallNode*>(pNode->m_arguments[i]), &tmpArgRValue);
+				else
+					args[i] = CompileExpression(pNode->m_arguments[i], &tmpArgRValue);
 
+				handles[i] = args[i];
 				
 				//	Convert to C-string if function wants a const wchar_t*
 				if (args[i]->getType() == m_handleType->getPointerTo() && argIt->getType() == m_charType->getPointerTo())
@@ -914,19 +1375,47 @@ namespace MyScript
 				++argIt;
 			}
 
+			args.insert(args.end(), extraArgs.begin(), extraArgs.end());
 			llvm::Value* result = m_pBuilder->CreateCall(func, args);
 
 			//	Now that we dont need it anymore, destroy if RValue
-			for (int i = 0; i < args.size(); ++i)
+			for (int i = 0; i < handles.size(); ++i)
 			{
-				if (argRValues[i] && IsHandlePtr(args[i]))
+				if (argRValues[i] && IsHandlePtr(handles[i]))
 				{
-					ComputeHandleDecrement(args[i]);
+					ComputeHandleDecrement(handles[i]);
 				}
 			}
 
 			return result;
 		}
+		llvm::Value* CompileExpression(ASTCallNode* pNode, bool* isRValue)
+		{
+			*isRValue = true;
+
+			llvm::Function* func = llvm::dyn_cast<llvm::Function>(GetSymbol(pNode->m_name));
+			if (!func)
+				throw std::exception();
+
+			if (func == m_strcatFunc && IsNestedConcatenation(pNode))
+				return CompileConcatenation(pNode, m_strconcatFunc, std::vector<llvm::Value*>());
+
+			//	strlen is just a load of the size field
+			if (func == m_strlenFunc && pNode->m_arguments.size() == 1)
+			{
+				bool argIsRValue;
+				llvm::Value* ptr = CompileStringOperand(pNode->m_arguments[0], &argIsRValue);
+				llvm::Value* result = ComputeStringLength(ptr);
+
+				if (argIsRValue)
+				{
+					ComputeHandleDecrement(ptr);
+				}
+				return result;
+			}
+
+			return CompileCall(pNode, func, std::vector<llvm::Value*>());
+		}
 		llvm::Value* CompileExpression(IASTNode* pNode, bool* isRValue)
 		{
 			if (is_type<ASTNullNode>(pNode))
@@ -983,7 +1472,7 @@ namespace MyScript
 		{
 			for (auto it : m_scopes[iScope].localSymbols)
 			{
-				if (IsHandlePtrPtr(it.second))
+				if (IsHandlePtrPtr(it.second) && m_scopes[iScope].borrowedSymbols.count(it.second) == 0)
 				{
 					llvm::Value* ptr = m_pBuilder->CreateLoad(it.second);
 					ComputeHandleDecrement(ptr);
@@ -1013,6 +1502,45 @@ namespace MyScript
 			return -1;
 		}
 
+		/*
+		If pExpression is a local variable that is never used after the current statement, its reference
+		is moved instead of copied: variable is set to null so destroying the scope does nothing.
+		Returns true if moved, which means the value is now an RValue and must not be incremented.
+		*/
+		bool MoveLocalIfDying(IASTNode* pExpression)
+		{
+			if (!is_type<ASTNameNode>(pExpression))
+				return false;
+
+			int iFunctionScope = GetCurrentFunctionScope();
+			if (iFunctionScope == -1)
+				return false;
+
+			llvm::StringRef name = dynamic_cast<ASTNameNode*>(pExpression)->m_name;
+			for (int i = m_scopes.size() - 1; i >= iFunctionScope; --i)
+			{
+				ScopeInfo& scope = m_scopes[i];
+				if (IsNameReferenced(scope.nextStatements, name))
+					return false;
+
+				auto it = scope.localSymbols.find(name);
+				if (it != scope.localSymbols.end())
+				{
+					if (!IsHandlePtrPtr(it->second) || scope.borrowedSymbols.count(it->second) != 0)
+						return false;
+
+					m_pBuilder->CreateStore(llvm::ConstantPointerNull::get(m_handleType->getPointerTo()), it->second);
+					return true;
+				}
+
+				//	Variable is declared outside of the loop, it could be read again in next iteration
+				if (scope.type == ScopeType::While)
+					return false;
+			}
+
+			return false;
+		}
+
 		template <typename Iter>
 		bool CompileBlock(Iter begin, Iter end = begin + 1)
 		{
@@ -1021,6 +1549,8 @@ namespace MyScript
 
 			for (Iter it = begin; it != end; ++it)
 			{
+				m_scopes.back().nextStatements = ASTNodeList(&*it, end - it).drop_front();
+
 				if (!CompileStatement(*it))
 				{
 					unreachable = true;
@@ -1050,6 +1580,9 @@ namespace MyScript
 				//	So we get correct result if we got stuff like : 'string s = substr(s, 1)'
 				bool isRValue;
 				llvm::Value* expr = CompileExpression(pNode->m_expression, &isRValue);
+
+				if (!isRValue && IsHandlePtr(expr) && MoveLocalIfDying(pNode->m_expression))
+					isRValue = true;
 				
 				//	Decrement old handle
 				if (IsHandlePtrPtr(ptr))
@@ -1074,6 +1607,9 @@ namespace MyScript
 				bool isRValue;
 				llvm::Value* expr = CompileExpression(pNode->m_expression, &isRValue);
 
+				if (!isRValue && IsHandlePtr(expr) && MoveLocalIfDying(pNode->m_expression))
+					isRValue = true;
+
 				llvm::Value* ptr = nullptr;
 				if (m_scopes.size() > 1)
 				{
@@ -1214,7 +1750,10 @@ namespace MyScript
 			bool isRValue;
 			llvm::Value* value = CompileExpression(pNode->m_expression, &isRValue);
 			
-			//	/!\ Could be optimize cause if we return a local variable, we increment, then PopScope decrement
+			//	Returning a local variable just moves it, no need to increment then decrement when destroying the scope.
+			if (!isRValue && IsHandlePtr(value) && MoveLocalIfDying(pNode->m_expression))
+				isRValue = true;
+
 			//	Increment because Call statements, are ALWAYS considered RValue, that means if we return an LValue, its gonna be decremented.
 			if (!isRValue && IsHandlePtr(value))
 			{
@@ -1256,16 +1795,6 @@ namespace MyScript
 		}
 		bool CompileStatement(ASTWhileNode* pNode)
 		{
-			bool isRValue;
-			llvm::Value* condition = CompileExpression(pNode->m_expression, &isRValue);
-			condition = Convert(condition, m_boolType);
-
-			//	Now that we dont need it anymore, destroy if RValue
-			if (isRValue && IsHandlePtr(condition))
-			{
-				ComputeHandleDecrement(condition);
-			}
-
 			llvm::Function* function = m_pBuilder->GetInsertBlock()->getParent();
 
 			llvm::BasicBlock* conditionBlock = llvm::BasicBlock::Create(*m_pContext, "", function);
@@ -1274,8 +1803,19 @@ namespace MyScript
 
 			m_pBuilder->CreateBr(conditionBlock);
 
+			//	Condition is evaluated again on each iteration
 			m_pBuilder->SetInsertPoint(conditionBlock);
 
+			bool isRValue;
+			llvm::Value* condition = CompileExpression(pNode->m_expression, &isRValue);
+			condition = Convert(condition, m_boolType);
+
+			//	Now that we dont need it anymore, destroy if RValue
+			if (isRValue && IsHandlePtr(condition))
+			{
+				ComputeHandleDecrement(condition);
+			}
+
 			m_pBuilder->CreateCondBr(condition, block, mergeBlock);
 
 			function->getBasicBlockList().push_back(block);
@@ -1288,8 +1828,8 @@ namespace MyScript
 			if (CompileBlock(pNode->m_statements.begin(), pNode->m_statements.end()))
 			{
 				DestroyScopeVariables(m_scopes.size() - 1);
-				//	Jump to merge block
-				m_pBuilder->CreateBr(mergeBlock);
+				//	Loop back to condition
+				m_pBuilder->CreateBr(conditionBlock);
 			}
 
 			//	Pop local scope
@@ -1355,7 +1895,10 @@ namespace MyScript
 			//	Get function type
 			llvm::FunctionType* funcType = llvm::FunctionType::get(retType, argTypes, false);
 
-			llvm::Function* func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, m_name + "::" + pNode->m_name, m_pModule.get());
+			//	Functions the host cannot see are internal, so LLVM is free to inline or remove them
+			llvm::GlobalValue::LinkageTypes linkage = IsFunctionExported(pNode, m_usesExport) ? llvm::Function::ExternalLinkage : llvm::Function::InternalLinkage;
+
+			llvm::Function* func = llvm::Function::Create(funcType, linkage, m_name + "::" + pNode->m_name, m_pModule.get());
 			
 			llvm::BasicBlock* block = llvm::BasicBlock::Create(*m_pContext, "", func);
 			auto oldInsertBlock = m_pBuilder->GetInsertBlock();
@@ -1366,27 +1909,27 @@ namespace MyScript
 			PushScope(nullptr, nullptr, ScopeType::Function);
 
 			//	Create arguments
+			//	String arguments are borrowed from the caller. If the function assigns one, it must take its own reference.
 			int i = 0;
 			for (auto& arg : func->args())
 			{
 				llvm::Value* argValue = CreateAlloca(argTypes[i]);
 				m_scopes.back().localSymbols[pNode->m_arguments[i].second] = argValue;
 				m_pBuilder->CreateStore(&arg, argValue);
-				++i;
-			}
-
-			//	Compile statements
 
-			bool unreachable = false;
-			for (auto statement : pNode->m_statements)
-			{
-				if (!CompileStatement(statement))
+				if (IsHandlePtr(&arg))
 				{
-					unreachable = true;
-					break;
+					if (IsNameAssigned(ASTNodeList(pNode->m_statements), pNode->m_arguments[i].second))
+						ComputeHandleIncrement(&arg);
+					else
+						m_scopes.back().borrowedSymbols.insert(argValue);
 				}
+				++i;
 			}
 
+			//	Compile statements
+			bool unreachable = !CompileBlock(pNode->m_statements.begin(), pNode->m_statements.end());
+
 			if (!unreachable)
 			{
 				DestroyScopeVariables(m_scopes.size() - 1);
@@ -1413,6 +1956,8 @@ namespace MyScript
 
 		void CompileAll(const pool_vector<IASTNode*>& tree)
 		{
+			m_usesExport = UsesExport(ASTNodeList(tree));
+
 			llvm::FunctionType* funcType = llvm::FunctionType::get(llvm::Type::getVoidTy(*m_pContext), false);
 
 			llvm::Function* func = llvm::Function::Create(funcType, llvm::Function::ExternalLinkage, m_name + "::$", m_pModule.get());
@@ -1436,10 +1981,91 @@ namespace MyScript
 
 			if (llvm::verifyFunction(*func))
 				throw std::exception();
+
+			RemoveDeadSymbols();
+			InferFunctionAttributes();
+		}
+
+		//	Internal functions that are never called (and the string constants only they used) are not worth generating code for
+		void RemoveDeadSymbols()
+		{
+			//	Removing a function may make the ones it calls dead too
+			bool changed = true;
+			while (changed)
+			{
+				changed = false;
+				for (auto it = m_pModule->begin(); it != m_pModule->end();)
+				{
+					llvm::Function& function = *it++;
+					if (function.hasLocalLinkage() && function.use_empty())
+					{
+						function.eraseFromParent();
+						changed = true;
+					}
+				}
+				for (auto it = m_pModule->global_begin(); it != m_pModule->global_end();)
+				{
+					llvm::GlobalVariable& variable = *it++;
+					variable.removeDeadConstantUsers();
+					if (variable.hasLocalLinkage() && variable.use_empty())
+					{
+						variable.eraseFromParent();
+						changed = true;
+					}
+				}
+			}
+			m_stringConstants.clear();
+		}
+		//	True if f returns true for every function called by 'function'
+		template <typename F>
+		bool AllCallees(llvm::Function& function, F f)
+		{
+			for (auto& block : function)
+			{
+				for (auto& instruction : block)
+				{
+					llvm::CallInst* call = llvm::dyn_cast<llvm::CallInst>(&instruction);
+					if (call == nullptr)
+						continue;
+
+					llvm::Function* callee = call->getCalledFunction();
+					if (callee == nullptr || !f(callee))
+						return false;
+				}
+			}
+			return true;
+		}
+		/*
+		A script function does not throw if none of its callees can, and does not recurse if none of its callees can.
+		Runtime functions have these attributes, host functions do not since they may throw or call back into the script.
+		*/
+		void InferFunctionAttributes()
+		{
+			bool changed = true;
+			while (changed)
+			{
+				changed = false;
+				for (auto& function : *m_pModule)
+				{
+					if (function.isDeclaration())
+						continue;
+
+					if (!function.doesNotThrow() && AllCallees(function, [](llvm::Function* callee) { return callee->doesNotThrow(); }))
+					{
+						function.setDoesNotThrow();
+						changed = true;
+					}
+					if (!function.doesNotRecurse() && AllCallees(function, [&](llvm::Function* callee) { return callee != &function && callee->doesNotRecurse(); }))
+					{
+						function.setDoesNotRecurse();
+						changed = true;
+					}
+				}
+			}
 		}
 
 		//	Create a declaration for external symbols
-		void CreateImportDeclaration(MSSymbol* pSymbol)
+		llvm::Value* CreateImportDeclaration(MSSymbol* pSymbol)
 		{
 			if (pSymbol->type == MSSymbolType::MS_SYMBOL_FUNCTION)
 			{
@@ -1471,9 +2097,33 @@ namespace MyScript
 				else throw std::exception();
 
 				m_scopes[0].localSymbols[pSymbol->name] = func;
+				m_usedImports.push_back(pSymbol);
+				return func;
 			}
+
+			throw MSCompileException((std::string("import not supported ") + pSymbol->name).c_str());
+		}
+
+		//	Make an external symbol available to the script. Declaration is deferred until first use.
+		void RegisterImport(MSSymbol* pSymbol)
+		{
+			m_imports[pSymbol->name] = pSymbol;
 		}
 
+		//	Imports actually referenced by the script
+		const std::vector<MSSymbol*>& GetUsedImports() const
+		{
+			return m_usedImports;
+		}
+
+#ifdef MS_BENCHMARK_HOOKS
+		//	Must be set before CompileAll
+		void SetRefcountCalls(bool enable)
+		{
+			m_refcountCalls = enable;
+		}
+#endif
+
 		std::unique_ptr<llvm::Module>& GetModule()
 		{
 			return m_pModule;
@@ -0,0 +1,317 @@
+#pragma once
+#include "stdafx.h"
+
+#include "MSBytecode.hpp"
+
+/*
+Runs bytecode programs. Registers of all active calls live in a single array, each call using a
+window of it. Calls are handled by the loop itself, so script recursion does not use the native stack.
+*/
+namespace MyScript
+{
+	//	Same type for each argument of a host call
+	template <typename T, size_t>
+	using MSHostSlot = T;
+
+	class MSInterpreter
+		: mystd::NonCopyable
+	{
+#ifdef _WIN64
+		//	Arguments go through a variadic call: floating point arguments are then passed both in integer and SSE
+		//	registers (and in 8 bytes stack slots), so a double holding the raw bits reaches any parameter type.
+		typedef double Slot;
+#else
+		//	Every parameter type takes one 4 bytes stack slot
+		typedef uint32_t Slot;
+#endif
+		typedef intptr_t IntResult;
+
+		struct Frame
+		{
+			const MSBytecodeFunction*	pFunction;
+			const MSInstruction*		pc;
+			size_t						base;
+			//	Caller register receiving the result
+			int							result;
+		};
+
+		template <typename R, size_t... I>
+		static R CallHost(void* address, MSCallingConvention callingConvention, const Slot* slots, std::index_sequence<I...>)
+		{
+#ifdef _WIN64
+			return reinterpret_cast<R(*)(...)>(address)(slots[I]...);
+#else
+			if (callingConvention == MSCallingConvention::MS_CC_STDCALL)
+				return reinterpret_cast<R(__stdcall*)(MSHostSlot<Slot, I>...)>(address)(slots[I]...);
+			return reinterpret_cast<R(__cdecl*)(MSHostSlot<Slot, I>...)>(address)(slots[I]...);
+#endif
+		}
+		template <typename R>
+		static R CallHost(void* address, MSCallingConvention callingConvention, const Slot* slots, int count)
+		{
+			switch (count)
+			{
+			case 0: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<0>());
+			case 1: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<1>());
+			case 2: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<2>());
+			case 3: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<3>());
+			case 4: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<4>());
+			case 5: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<5>());
+			case 6: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<6>());
+			case 7: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<7>());
+			case 8: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<8>());
+			case 9: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<9>());
+			case 10: return CallHost<R>(address, callingConvention, slots, std::make_index_sequence<10>());
+			default:
+				throw std::exception();
+			}
+		}
+		//	Call a host function with the same conversions as MSIRCompiler: strings are passed as C-strings
+		static MSValue CallHost(const MSSymbol& symbol, const MSValue* args)
+		{
+			Slot slots[10];
+			for (int i = 0; i < symbol.functionData.count; ++i)
+			{
+				uint64_t bits = 0;
+				switch (symbol.functionData.parameterTypes[i])
+				{
+				case MSType::MS_TYPE_STRING:
+					bits = reinterpret_cast<uintptr_t>(ms_rt_strgetptr(args[i].s));
+					break;
+				case MSType::MS_TYPE_FLOAT:
+					memcpy(&bits, &args[i].f, sizeof(float));
+					break;
+				default:
+					bits = static_cast<uint32_t>(args[i].i);
+					break;
+				}
+				memcpy(&slots[i], &bits, sizeof(Slot));
+			}
+
+			void* address = symbol.address;
+			MSCallingConvention callingConvention = symbol.functionData.callingConvention;
+			int count = symbol.functionData.count;
+
+			MSValue result;
+			result.s = nullptr;
+			switch (symbol.functionData.resultType)
+			{
+			case MSType::MS_TYPE_VOID:
+				CallHost<void>(address, callingConvention, slots, count);
+				break;
+			case MSType::MS_TYPE_FLOAT:
+				result.f = CallHost<float>(address, callingConvention, slots, count);
+				break;
+			case MSType::MS_TYPE_BOOLEAN:
+				//	Only the low byte is set
+				result.i = static_cast<uint8_t>(CallHost<IntResult>(address, callingConvention, slots, count)) != 0 ? 1 : 0;
+				break;
+			case MSType::MS_TYPE_INTEGER:
+				result.i = static_cast<int>(CallHost<IntResult>(address, callingConvention, slots, count));
+				break;
+			case MSType::MS_TYPE_STRING:
+				//	New reference, owned by the script
+				result.s = reinterpret_cast<MSHandleInternal*>(CallHost<IntResult>(address, callingConvention, slots, count));
+				break;
+			default:
+				throw std::exception();
+			}
+			return result;
+		}
+	public:
+		//	Run the entry point of the program
+		static void Execute(MSBytecodeProgram& program)
+		{
+			std::vector<MSValue> registers;
+			std::vector<Frame> frames;
+
+			const MSBytecodeFunction* pFunction = &program.functions[0];
+			const MSInstruction* pc = pFunction->code.data();
+			size_t base = 0;
+
+			registers.resize(pFunction->registerCount);
+			MSValue* r = registers.data();
+			MSValue* globals = program.globals.data();
+			const MSValue* constants = program.constants.data();
+
+			//	MSVC has no computed goto, a dense switch is compiled to a jump table
+			while (true)
+			{
+				const MSInstruction& i = *pc++;
+				switch (i.op)
+				{
+				case MSOpcode::Move:
+					r[i.a] = r[i.b];
+					break;
+				case MSOpcode::LoadConstant:
+					r[i.a] = constants[i.b];
+					break;
+				case MSOpcode::LoadGlobal:
+					r[i.a] = globals[i.b];
+					break;
+				case MSOpcode::StoreGlobal:
+					globals[i.a] = r[i.b];
+					break;
+				case MSOpcode::Increment:
+					ms_rt_hdlinc(r[i.a].s);
+					break;
+				case MSOpcode::Decrement:
+					ms_rt_hdldec(r[i.a].s);
+					break;
+
+				//	Wrap around like the generated code does
+				case MSOpcode::AddInt:
+					r[i.a].i = static_cast<int>(static_cast<unsigned int>(r[i.b].i) + static_cast<unsigned int>(r[i.c].i));
+					break;
+				case MSOpcode::SubtractInt:
+					r[i.a].i = static_cast<int>(static_cast<unsigned int>(r[i.b].i) - static_cast<unsigned int>(r[i.c].i));
+					break;
+				case MSOpcode::MultiplyInt:
+					r[i.a].i = static_cast<int>(static_cast<unsigned int>(r[i.b].i) * static_cast<unsigned int>(r[i.c].i));
+					break;
+				case MSOpcode::DivideInt:
+					r[i.a].i = r[i.b].i / r[i.c].i;
+					break;
+				case MSOpcode::ModuloInt:
+					r[i.a].i = r[i.b].i % r[i.c].i;
+					break;
+				case MSOpcode::AddFloat:
+					r[i.a].f = r[i.b].f + r[i.c].f;
+					break;
+				case MSOpcode::SubtractFloat:
+					r[i.a].f = r[i.b].f - r[i.c].f;
+					break;
+				case MSOpcode::MultiplyFloat:
+					r[i.a].f = r[i.b].f * r[i.c].f;
+					break;
+				case MSOpcode::DivideFloat:
+					r[i.a].f = r[i.b].f / r[i.c].f;
+					break;
+				case MSOpcode::ModuloFloat:
+					r[i.a].f = std::fmod(r[i.b].f, r[i.c].f);
+					break;
+
+				case MSOpcode::EqualInt:
+					r[i.a].i = r[i.b].i == r[i.c].i;
+					break;
+				case MSOpcode::NotEqualInt:
+					r[i.a].i = r[i.b].i != r[i.c].i;
+					break;
+				case MSOpcode::GreaterInt:
+					r[i.a].i = r[i.b].i > r[i.c].i;
+					break;
+				case MSOpcode::LesserInt:
+					r[i.a].i = r[i.b].i < r[i.c].i;
+					break;
+				case MSOpcode::GreaterEqualInt:
+					r[i.a].i = r[i.b].i >= r[i.c].i;
+					break;
+				case MSOpcode::LesserEqualInt:
+					r[i.a].i = r[i.b].i <= r[i.c].i;
+					break;
+				//	Ordered comparisons, always false with NaN
+				case MSOpcode::EqualFloat:
+					r[i.a].i = r[i.b].f == r[i.c].f;
+					break;
+				case MSOpcode::NotEqualFloat:
+					r[i.a].i = r[i.b].f < r[i.c].f || r[i.b].f > r[i.c].f;
+					break;
+				case MSOpcode::GreaterFloat:
+					r[i.a].i = r[i.b].f > r[i.c].f;
+					break;
+				case MSOpcode::LesserFloat:
+					r[i.a].i = r[i.b].f < r[i.c].f;
+					break;
+				case MSOpcode::GreaterEqualFloat:
+					r[i.a].i = r[i.b].f >= r[i.c].f;
+					break;
+				case MSOpcode::LesserEqualFloat:
+					r[i.a].i = r[i.b].f <= r[i.c].f;
+					break;
+
+				case MSOpcode::IntToFloat:
+					r[i.a].f = static_cast<float>(r[i.b].i);
+					break;
+				case MSOpcode::FloatToInt:
+					r[i.a].i = static_cast<int>(r[i.b].f);
+					break;
+				case MSOpcode::IntToBool:
+					r[i.a].i = r[i.b].i != 0;
+					break;
+				case MSOpcode::FloatToBool:
+					r[i.a].i = r[i.b].f < 0.0f || r[i.b].f > 0.0f;
+					break;
+				case MSOpcode::TruncateBool:
+					r[i.a].i = r[i.b].i & 1;
+					break;
+
+				case MSOpcode::Jump:
+					pc = pFunction->code.data() + i.b;
+					break;
+				case MSOpcode::JumpIfFalse:
+					if (!r[i.a].i)
+						pc = pFunction->code.data() + i.b;
+					break;
+				case MSOpcode::JumpIfTrue:
+					if (r[i.a].i)
+						pc = pFunction->code.data() + i.b;
+					break;
+
+				case MSOpcode::StringLength:
+					r[i.a].i = ms_rt_strlen(r[i.b].s);
+					break;
+				case MSOpcode::StringConcat:
+					r[i.a].s = ms_rt_strcat(r[i.b].s, r[i.b + 1].s);
+					break;
+				case MSOpcode::StringCompare:
+					r[i.a].i = ms_rt_strcmp(r[i.b].s, r[i.b + 1].s);
+					break;
+				case MSOpcode::Substring:
+					r[i.a].s = ms_rt_substr(r[i.b].s, r[i.b + 1].i, r[i.b + 2].i);
+					break;
+
+				case MSOpcode::Call:
+				{
+					Frame frame = { pFunction, pc, base, i.a };
+					frames.push_back(frame);
+
+					//	Arguments are already in place, at the start of the callee window
+					pFunction = &program.functions[i.b];
+					pc = pFunction->code.data();
+					base += i.c;
+
+					if (registers.size() < base + pFunction->registerCount)
+						registers.resize(base + pFunction->registerCount);
+					r = registers.data() + base;
+					break;
+				}
+				case MSOpcode::CallHost:
+					r[i.a] = CallHost(program.imports[i.b], &r[i.c]);
+					break;
+				case MSOpcode::Return:
+				case MSOpcode::ReturnVoid:
+				{
+					MSValue result;
+					if (i.op == MSOpcode::Return)
+						result = r[i.a];
+					else
+						result.s = nullptr;
+
+					if (frames.empty())
+						return;
+
+					Frame& frame = frames.back();
+					pFunction = frame.pFunction;
+					pc = frame.pc;
+					base = frame.base;
+					r = registers.data() + base;
+					r[frame.result] = result;
+
+					frames.pop_back();
+					break;
+				}
+				}
+			}
+		}
+	};
+}
@@ -0,0 +1,295 @@
+#pragma once
+#include "stdafx.h"
+
+//	MSCompileException
+#include "MSIRCompiler.hpp"
+
+/*
+JIT memory shared by all the scripts of a context.
+Sections are sub-allocated from large slabs, so small scripts share pages instead of taking a few each.
+Code and read-only data slabs are mapped twice: the linker writes through a read-write view, and scripts use a
+read-only (and executable for code) view of the same memory, so no page is ever both writable and executable.
+*/
+namespace MyScript
+{
+	enum class MSMemoryKind
+	{
+		Code,
+		ReadOnly,
+		ReadWrite,
+		Count,
+	};
+
+	class MSSlabAllocator
+		: mystd::NonCopyable
+	{
+	public:
+		//	Large pages need a privilege hosts rarely have, so slabs are made of normal pages
+		static const size_t SlabSize = 4 * 1024 * 1024;
+		//	Views are placed at multiples of it
+		static const size_t Granularity = 64 * 1024;
+
+		struct Block
+		{
+			void*		pSlab = nullptr;
+			uint8_t*	pWritable = nullptr;	//	Where the linker writes
+			uint8_t*	pTarget = nullptr;		//	Where scripts use it
+			size_t		size = 0;
+		};
+	private:
+		struct Slab
+		{
+			HANDLE		hMapping = NULL;
+			uint8_t*	pWritable = nullptr;
+			uint8_t*	pTarget = nullptr;
+			size_t		size = 0;
+			//	Offset -> size of free ranges, adjacent ones are merged
+			std::map<size_t, size_t> freeRanges;
+		};
+
+		std::list<Slab> m_slabs[static_cast<int>(MSMemoryKind::Count)];
+		size_t m_usedSizes[static_cast<int>(MSMemoryKind::Count)] = {};
+		size_t m_reservedSize = 0;
+		//	Slabs are placed next to each other when possible, code references data with 32 bits offsets
+		uint8_t* m_pNext = nullptr;
+		std::mutex m_mutex;
+
+		void* MapView(HANDLE hMapping, DWORD access, size_t size)
+		{
+			void* p = MapViewOfFileEx(hMapping, access, 0, 0, size, m_pNext);
+			if (p == nullptr)
+				p = MapViewOfFileEx(hMapping, access, 0, 0, size, nullptr);
+			return p;
+		}
+		Slab& CreateSlab(MSMemoryKind kind, size_t minSize)
+		{
+			Slab slab;
+			slab.size = std::max(SlabSize, (minSize + Granularity - 1) / Granularity * Granularity);
+
+			if (kind == MSMemoryKind::ReadWrite)
+			{
+				slab.pWritable = reinterpret_cast<uint8_t*>(VirtualAlloc(m_pNext, slab.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+				if (slab.pWritable == nullptr)
+					slab.pWritable = reinterpret_cast<uint8_t*>(VirtualAlloc(nullptr, slab.size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE));
+				if (slab.pWritable == nullptr)
+					throw MSCompileException("cannot allocate JIT memory");
+
+				slab.pTarget = slab.pWritable;
+			}
+			else
+			{
+				slab.hMapping = CreateFileMappingW(INVALID_HANDLE_VALUE, NULL, PAGE_EXECUTE_READWRITE,
+					static_cast<DWORD>(static_cast<unsigned long long>(slab.size) >> 32), static_cast<DWORD>(slab.size), NULL);
+				if (slab.hMapping == NULL)
+					throw MSCompileException("cannot allocate JIT memory");
+
+				//	Writable view is only used by the linker, it does not need to be near the code
+				slab.pWritable = reinterpret_cast<uint8_t*>(MapViewOfFile(slab.hMapping, FILE_MAP_WRITE, 0, 0, slab.size));
+				slab.pTarget = reinterpret_cast<uint8_t*>(MapView(slab.hMapping, kind == MSMemoryKind::Code ? FILE_MAP_READ | FILE_MAP_EXECUTE : FILE_MAP_READ, slab.size));
+				if (slab.pWritable == nullptr || slab.pTarget == nullptr)
+				{
+					DestroySlab(slab);
+					throw MSCompileException("cannot allocate JIT memory");
+				}
+			}
+
+			m_pNext = slab.pTarget + slab.size;
+			m_reservedSize += slab.size;
+
+			slab.freeRanges[0] = slab.size;
+			m_slabs[static_cast<int>(kind)].push_back(std::move(slab));
+			return m_slabs[static_cast<int>(kind)].back();
+		}
+		static void DestroySlab(Slab& slab)
+		{
+			if (slab.hMapping == NULL)
+			{
+				if (slab.pWritable != nullptr)
+					VirtualFree(slab.pWritable, 0, MEM_RELEASE);
+				return;
+			}
+
+			if (slab.pTarget != nullptr)
+				UnmapViewOfFile(slab.pTarget);
+			if (slab.pWritable != nullptr)
+				UnmapViewOfFile(slab.pWritable);
+			CloseHandle(slab.hMapping);
+		}
+		//	First fit
+		static bool AllocateIn(Slab& slab, size_t size, size_t alignment, Block& block)
+		{
+			for (auto it = slab.freeRanges.begin(); it != slab.freeRanges.end(); ++it)
+			{
+				size_t offset = it->first;
+				size_t end = it->first + it->second;
+				size_t alignedOffset = (offset + alignment - 1) / alignment * alignment;
+				if (alignedOffset + size > end)
+					continue;
+
+				slab.freeRanges.erase(it);
+				if (alignedOffset > offset)
+					slab.freeRanges[offset] = alignedOffset - offset;
+				if (alignedOffset + size < end)
+					slab.freeRanges[alignedOffset + size] = end - (alignedOffset + size);
+
+				block.pSlab = &slab;
+				block.pWritable = slab.pWritable + alignedOffset;
+				block.pTarget = slab.pTarget + alignedOffset;
+				block.size = size;
+				return true;
+			}
+			return false;
+		}
+	public:
+		~MSSlabAllocator()
+		{
+			for (auto& slabs : m_slabs)
+			{
+				for (auto& slab : slabs)
+					DestroySlab(slab);
+			}
+		}
+
+		Block Allocate(MSMemoryKind kind, size_t size, size_t alignment)
+		{
+			//	Rounded so freed blocks are easier to reuse
+			size = std::max<size_t>((size + 15) / 16 * 16, 16);
+			alignment = std::max<size_t>(alignment, 16);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			Block block;
+			bool allocated = false;
+			for (auto& slab : m_slabs[static_cast<int>(kind)])
+			{
+				if (AllocateIn(slab, size, alignment, block))
+				{
+					allocated = true;
+					break;
+				}
+			}
+			if (!allocated && !AllocateIn(CreateSlab(kind, size + alignment), size, alignment, block))
+				throw MSCompileException("cannot allocate JIT memory");
+
+			m_usedSizes[static_cast<int>(kind)] += block.size;
+			return block;
+		}
+		//	Slabs are kept for the next scripts
+		void Free(MSMemoryKind kind, const Block& block)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+
+			Slab& slab = *reinterpret_cast<Slab*>(block.pSlab);
+			size_t offset = block.pWritable - slab.pWritable;
+			size_t size = block.size;
+
+			auto next = slab.freeRanges.lower_bound(offset);
+			if (next != slab.freeRanges.end() && offset + size == next->first)
+			{
+				size += next->second;
+				next = slab.freeRanges.erase(next);
+			}
+			if (next != slab.freeRanges.begin())
+			{
+				auto previous = std::prev(next);
+				if (previous->first + previous->second == offset)
+				{
+					previous->second += size;
+					m_usedSizes[static_cast<int>(kind)] -= block.size;
+					return;
+				}
+			}
+			slab.freeRanges[offset] = size;
+			m_usedSizes[static_cast<int>(kind)] -= block.size;
+		}
+
+		size_t GetUsedSize(MSMemoryKind kind)
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_usedSizes[static_cast<int>(kind)];
+		}
+		size_t GetReservedSize()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			return m_reservedSize;
+		}
+	};
+
+	/*
+	Memory manager of a script, its sections come from the slabs of the context and go back there when it is removed.
+	Lazy scripts load several objects with the same one, one per compiled function.
+	*/
+	class MSMemoryManager
+		: public llvm::RTDyldMemoryManager
+	{
+		struct Allocation
+		{
+			MSMemoryKind			kind;
+			MSSlabAllocator::Block	block;
+		};
+
+		MSSlabAllocator* m_pAllocator;
+		std::vector<Allocation> m_allocations;
+		//	Allocations of the object being loaded, until they are mapped to their target view
+		size_t m_firstUnmapped = 0;
+		//	Code not yet visible to instruction fetch
+		size_t m_firstUnfinalized = 0;
+		size_t m_sizes[static_cast<int>(MSMemoryKind::Count)] = {};
+
+		uint8_t* Allocate(MSMemoryKind kind, uintptr_t size, unsigned alignment)
+		{
+			MSSlabAllocator::Block block = m_pAllocator->Allocate(kind, size, alignment);
+			m_allocations.push_back({ kind, block });
+			m_sizes[static_cast<int>(kind)] += block.size;
+			return block.pWritable;
+		}
+	public:
+		using llvm::RTDyldMemoryManager::notifyObjectLoaded;
+
+		MSMemoryManager(MSSlabAllocator* pAllocator)
+			: m_pAllocator(pAllocator)
+		{
+
+		}
+		~MSMemoryManager()
+		{
+			for (auto& allocation : m_allocations)
+				m_pAllocator->Free(allocation.kind, allocation.block);
+		}
+
+		uint8_t* allocateCodeSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName) override
+		{
+			return Allocate(MSMemoryKind::Code, Size, Alignment);
+		}
+		uint8_t* allocateDataSection(uintptr_t Size, unsigned Alignment, unsigned SectionID, llvm::StringRef SectionName, bool IsReadOnly) override
+		{
+			return Allocate(IsReadOnly ? MSMemoryKind::ReadOnly : MSMemoryKind::ReadWrite, Size, Alignment);
+		}
+		//	Called before relocations are resolved, so they use the addresses of the target views
+		void notifyObjectLoaded(llvm::RuntimeDyld& RTDyld, const llvm::object::ObjectFile& Obj) override
+		{
+			for (; m_firstUnmapped < m_allocations.size(); ++m_firstUnmapped)
+			{
+				MSSlabAllocator::Block& block = m_allocations[m_firstUnmapped].block;
+				if (block.pTarget != block.pWritable)
+					RTDyld.mapSectionAddress(block.pWritable, reinterpret_cast<uint64_t>(block.pTarget));
+			}
+		}
+		//	Pages already have their final protection
+		bool finalizeMemory(std::string* ErrMsg = nullptr) override
+		{
+			for (; m_firstUnfinalized < m_allocations.size(); ++m_firstUnfinalized)
+			{
+				Allocation& allocation = m_allocations[m_firstUnfinalized];
+				if (allocation.kind == MSMemoryKind::Code)
+					llvm::sys::Memory::InvalidateInstructionCache(allocation.block.pTarget, allocation.block.size);
+			}
+			return false;
+		}
+
+		size_t GetSize(MSMemoryKind kind) const
+		{
+			return m_sizes[static_cast<int>(kind)];
+		}
+	};
+}
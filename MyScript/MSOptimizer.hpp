@@ -0,0 +1,156 @@
+#pragma once
+#include "stdafx.h"
+
+//	MSCompileException
+#include "MSIRCompiler.hpp"
+
+/*
+Optimization pipelines, shared by the JIT and the ahead-of-time compiler.
+*/
+namespace MyScript
+{
+	class MSOptimizer
+		: mystd::NonCopyable
+	{
+		//	Function attribute holding the MSOptimizationLevel of a script, read when optimizing it.
+		//	Attributes follow functions moved to other modules, unlike module flags (lazy compilation).
+		static constexpr const char* OptimizationLevelAttribute = "ms-opt-level";
+	public:
+		//	Store the options in the module itself, so they are available when it is optimized
+		static void ApplyCompileOptions(llvm::Module& module, const MSCompileOptions& options)
+		{
+			if (options.optimizationLevel < MSOptimizationLevel::MS_OPTIMIZATION_O0 || options.optimizationLevel > MSOptimizationLevel::MS_OPTIMIZATION_OS)
+				throw MSCompileException("invalid optimization level");
+
+			//	Code generator picks the subtarget from these attributes, so one target machine can serve every script
+			for (auto& function : module)
+			{
+				if (function.isDeclaration())
+					continue;
+
+				function.addFnAttr(OptimizationLevelAttribute, std::to_string(options.optimizationLevel));
+				if (options.targetCPU != NULL)
+					function.addFnAttr("target-cpu", options.targetCPU);
+				if (options.targetFeatures != NULL)
+					function.addFnAttr("target-features", options.targetFeatures);
+			}
+		}
+		static MSOptimizationLevel GetOptimizationLevel(llvm::Module& module)
+		{
+			//	All functions of a script have the same level
+			for (auto& function : module)
+			{
+				if (function.isDeclaration() || !function.hasFnAttribute(OptimizationLevelAttribute))
+					continue;
+
+				int level;
+				if (!function.getFnAttribute(OptimizationLevelAttribute).getValueAsString().getAsInteger(10, level))
+					return static_cast<MSOptimizationLevel>(level);
+			}
+			return MSOptimizationLevel::MS_OPTIMIZATION_O2;
+		}
+
+		//	LLVM standard pipeline settings for an optimization level, other than O0
+		static void ConfigurePipeline(llvm::PassManagerBuilder& builder, MSOptimizationLevel level)
+		{
+			switch (level)
+			{
+			case MSOptimizationLevel::MS_OPTIMIZATION_O1:
+				builder.OptLevel = 1;
+				break;
+			case MSOptimizationLevel::MS_OPTIMIZATION_O2:
+				builder.OptLevel = 2;
+				break;
+			case MSOptimizationLevel::MS_OPTIMIZATION_O3:
+				builder.OptLevel = 3;
+				break;
+			case MSOptimizationLevel::MS_OPTIMIZATION_OS:
+				builder.OptLevel = 2;
+				builder.SizeLevel = 1;
+				break;
+			}
+
+			//	Locals are allocas, SROA (part of the pipeline) turns them into registers. Helpers are internal so can be inlined.
+			if (builder.OptLevel > 1)
+				builder.Inliner = llvm::createFunctionInliningPass(builder.OptLevel, builder.SizeLevel);
+			builder.LoopVectorize = builder.OptLevel > 1 && builder.SizeLevel == 0;
+			builder.SLPVectorize = builder.OptLevel > 1 && builder.SizeLevel == 0;
+		}
+		//	Function passes, a function pass manager is bound to its module so they are built for each one
+		static void RunFunctionPasses(llvm::Module& module, llvm::TargetMachine& targetMachine, MSOptimizationLevel level)
+		{
+			llvm::PassManagerBuilder builder;
+			ConfigurePipeline(builder, level);
+
+			llvm::legacy::FunctionPassManager FPM(&module);
+			FPM.add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+			builder.populateFunctionPassManager(FPM);
+
+			FPM.doInitialization();
+			for (auto &F : module)
+				FPM.run(F);
+			FPM.doFinalization();
+		}
+		//	Module passes, they can be run again on other modules
+		static std::unique_ptr<llvm::legacy::PassManager> CreateModulePipeline(llvm::TargetMachine& targetMachine, MSOptimizationLevel level)
+		{
+			llvm::PassManagerBuilder builder;
+			ConfigurePipeline(builder, level);
+
+			std::unique_ptr<llvm::legacy::PassManager> pMPM = std::make_unique<llvm::legacy::PassManager>();
+
+			//	Cost models of the target, for the inliner and vectorizers
+			pMPM->add(llvm::createTargetTransformInfoWrapperPass(targetMachine.getTargetIRAnalysis()));
+
+			builder.populateModulePassManager(*pMPM);
+			return pMPM;
+		}
+		//	Run LLVM standard pipeline for an optimization level
+		static void RunOptimizationPipeline(llvm::Module& module, llvm::TargetMachine& targetMachine, MSOptimizationLevel level)
+		{
+			if (level == MSOptimizationLevel::MS_OPTIMIZATION_O0)
+				return;
+
+			RunFunctionPasses(module, targetMachine, level);
+			CreateModulePipeline(targetMachine, level)->run(module);
+		}
+	};
+
+	/*
+	Target machine with the module pipelines built for it, reused for every module.
+	Neither is thread safe, so they go together to one compilation at a time, see MSResourcePool.
+	*/
+	class MSTarget
+		: mystd::NonCopyable
+	{
+		std::unique_ptr<llvm::TargetMachine> m_pTargetMachine;
+		//	By optimization level, built on first use
+		std::array<std::unique_ptr<llvm::legacy::PassManager>, MSOptimizationLevel::MS_OPTIMIZATION_OS + 1> m_pipelines;
+	public:
+		MSTarget(std::unique_ptr<llvm::TargetMachine> pTargetMachine)
+			: m_pTargetMachine(std::move(pTargetMachine))
+		{
+
+		}
+
+		llvm::TargetMachine& GetTargetMachine()
+		{
+			return *m_pTargetMachine;
+		}
+		//	Optimize for the level stored in the module
+		void Optimize(llvm::Module& module)
+		{
+			MSOptimizationLevel level = MSOptimizer::GetOptimizationLevel(module);
+			if (level == MSOptimizationLevel::MS_OPTIMIZATION_O0)
+				return;
+
+			MSOptimizer::RunFunctionPasses(module, *m_pTargetMachine, level);
+
+			std::unique_ptr<llvm::legacy::PassManager>& pPipeline = m_pipelines[level];
+			if (!pPipeline)
+				pPipeline = MSOptimizer::CreateModulePipeline(*m_pTargetMachine, level);
+
+			pPipeline->run(module);
+		}
+	};
+}
@@ -0,0 +1,71 @@
+#pragma once
+#include "stdafx.h"
+
+/*
+Pool of objects that cannot be used by several threads at once, like LLVM contexts and target machines.
+A thread takes one for the time it needs it, then gives it back so other compilations reuse it.
+Objects that grow with use, like LLVM contexts keeping every constant and type, are replaced after a number of uses.
+*/
+namespace MyScript
+{
+	template <typename T>
+	class MSResourcePool
+		: mystd::NonCopyable
+	{
+	public:
+		typedef std::function<std::unique_ptr<T>()> FactoryT;
+	private:
+		FactoryT						m_factory;
+		//	0 to reuse objects forever
+		unsigned						m_maxUses;
+		std::mutex						m_mutex;
+		std::vector<std::unique_ptr<T>>	m_free;
+		//	Times each object was given back
+		std::map<T*, unsigned>			m_uses;
+	public:
+		MSResourcePool(FactoryT factory, unsigned maxUses = 0)
+			: m_factory(factory),
+			m_maxUses(maxUses)
+		{
+
+		}
+
+		//	Objects not given back are just destroyed
+		std::unique_ptr<T> Acquire()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_free.empty())
+				{
+					std::unique_ptr<T> p = std::move(m_free.back());
+					m_free.pop_back();
+					return p;
+				}
+			}
+			//	Outside the lock, creation may be slow
+			std::unique_ptr<T> p = m_factory();
+
+			//	May have the address of an object that was not given back
+			if (m_maxUses != 0)
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_uses[p.get()] = 0;
+			}
+			return p;
+		}
+		void Release(std::unique_ptr<T> p)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (m_maxUses == 0 || ++m_uses[p.get()] < m_maxUses)
+				{
+					m_free.push_back(std::move(p));
+					return;
+				}
+				m_uses.erase(p.get());
+			}
+			//	Worn out, the next Acquire creates a new one. Destroyed outside the lock.
+			p.reset();
+		}
+	};
+}
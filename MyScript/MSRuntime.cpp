@@ -31,6 +31,13 @@ void ms_rt_hdldec(MSHandleInternal* hdl)
 			hdl->refcount -= 1;
 	}
 }
+
+//	Free handle once refcount reached 0. Compiled code does the refcounting inline.
+void ms_rt_hdlfree(MSHandleInternal* hdl)
+{
+	free(hdl);
+}
+
 int ms_rt_strlen(MSHandleInternal* hdl)
 {
 	if (hdl != nullptr)
@@ -38,28 +45,92 @@ int ms_rt_strlen(MSHandleInternal* hdl)
 
 	return 0;
 }
+//	Allocate a handle for a string of len characters, data is left uninitialized.
+//	Uses scratch memory if provided and big enough, heap otherwise.
+static MSHandleInternal* ms_rt_strnew(int len, void* scratch, int scratchSize)
+{
+	int size = sizeof(MSHandleInternal) + sizeof(int) + (len + 1) * sizeof(wchar_t);
+
+	void* buffer = nullptr;
+	MSHandleInternal* hdl = nullptr;
+	if (scratch != nullptr && size <= scratchSize)
+	{
+		//	Scratch memory belongs to the caller stack frame. Use refcount = 2 so it is never freed.
+		buffer = scratch;
+		hdl = reinterpret_cast<MSHandleInternal*>(buffer);
+		hdl->refcount = 2;
+	}
+	else
+	{
+		buffer = malloc(size);
+		hdl = reinterpret_cast<MSHandleInternal*>(buffer);
+		hdl->refcount = 1;
+	}
+
+	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(static_cast<char*>(buffer) + sizeof(MSHandleInternal));
+	new_s->size = len;
+
+	hdl->ptr = new_s;
+	return hdl;
+}
+
 MSHandleInternal* ms_rt_strcat(MSHandleInternal* s1, MSHandleInternal* s2)
 {
+	return ms_rt_strcat_scratch(s1, s2, nullptr, 0);
+}
+MSHandleInternal* ms_rt_strcat_scratch(MSHandleInternal* s1, MSHandleInternal* s2, void* scratch, int scratchSize)
+{
+	//	Result is always a new reference, even when returning one of the arguments
 	if (s1 == nullptr)
+	{
+		ms_rt_hdlinc(s2);
 		return s2;
+	}
 	if (s2 == nullptr)
+	{
+		ms_rt_hdlinc(s1);
 		return s1;
+	}
 
-	int s1_len = ms_rt_strlen(s1);
-	int s2_len = ms_rt_strlen(s2);
-
-	void* buffer = malloc(sizeof(MSHandleInternal) + sizeof(int) + (s1_len + s2_len + 1) * sizeof(wchar_t));
+	MSHandleInternal* parts[2] = { s1, s2 };
+	return ms_rt_strconcat_n_scratch(parts, 2, scratch, scratchSize);
+}
 
-	MSHandleInternal* hdl = reinterpret_cast<MSHandleInternal*>(buffer);
-	hdl->refcount = 1;
+MSHandleInternal* ms_rt_strconcat_n(MSHandleInternal** parts, int count)
+{
+	return ms_rt_strconcat_n_scratch(parts, count, nullptr, 0);
+}
+MSHandleInternal* ms_rt_strconcat_n_scratch(MSHandleInternal** parts, int count, void* scratch, int scratchSize)
+{
+	//	Compute total length once, null strings are skipped
+	int len = 0;
+	bool allNull = true;
+	for (int i = 0; i < count; ++i)
+	{
+		if (parts[i] != nullptr)
+		{
+			len += ms_rt_strlen(parts[i]);
+			allNull = false;
+		}
+	}
 
-	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(static_cast<char*>(buffer) + sizeof(MSHandleInternal));
-	new_s->size = s1_len + s2_len;
+	if (allNull)
+		return nullptr;
 
-	wcscpy(&new_s->data[0], &reinterpret_cast<MSStringInternal*>(s1->ptr)->data[0]);
-	wcscat(&new_s->data[0], &reinterpret_cast<MSStringInternal*>(s2->ptr)->data[0]);
+	//	Always a new string, parts may be temporaries that are destroyed right after
+	MSHandleInternal* hdl = ms_rt_strnew(len, scratch, scratchSize);
+	wchar_t* it = &reinterpret_cast<MSStringInternal*>(hdl->ptr)->data[0];
 
-	hdl->ptr = new_s;
+	for (int i = 0; i < count; ++i)
+	{
+		if (parts[i] != nullptr)
+		{
+			MSStringInternal* s = reinterpret_cast<MSStringInternal*>(parts[i]->ptr);
+			memcpy(it, &s->data[0], s->size * sizeof(wchar_t));
+			it += s->size;
+		}
+	}
+	*it = 0;
 
 	return hdl;
 }
@@ -84,9 +155,16 @@ int ms_rt_strcmp(MSHandleInternal* s1, MSHandleInternal* s2)
 	return wcscmp(it1, it2);
 }
 MSHandleInternal* ms_rt_substr(MSHandleInternal* s, int start, int len)
+{
+	return ms_rt_substr_scratch(s, start, len, nullptr, 0);
+}
+MSHandleInternal* ms_rt_substr_scratch(MSHandleInternal* s, int start, int len, void* scratch, int scratchSize)
 {
 	if (s == nullptr || ms_rt_strlen(s) == 0)
+	{
+		ms_rt_hdlinc(s);
 		return s;
+	}
 
 	if (start + len > ms_rt_strlen(s))
 		len = ms_rt_strlen(s) - start;
@@ -94,33 +172,22 @@ MSHandleInternal* ms_rt_substr(MSHandleInternal* s, int start, int len)
 	if (len <= 0)
 		return nullptr;
 
-	void* buffer = malloc(sizeof(MSHandleInternal) + sizeof(int) + (len + 1) * sizeof(wchar_t));
-	MSHandleInternal* hdl = reinterpret_cast<MSHandleInternal*>(buffer);
-	hdl->refcount = 1;
-
-	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(static_cast<char*>(buffer) + sizeof(MSHandleInternal));
-
-	new_s->size = len;
+	MSHandleInternal* hdl = ms_rt_strnew(len, scratch, scratchSize);
+	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(hdl->ptr);
 
 	wcsncpy(&new_s->data[0], &reinterpret_cast<MSStringInternal*>(s->ptr)->data[0], len);
 	new_s->data[len] = 0;
 
-	hdl->ptr = new_s;
 	return hdl;
 }
 
 MSHandleInternal* ms_rt_stralloc(const wchar_t* s, int len)
 {
-	void* buffer = malloc(sizeof(MSHandleInternal) + sizeof(int) + (len + 1) * sizeof(wchar_t));
-	MSHandleInternal* hdl = reinterpret_cast<MSHandleInternal*>(buffer);
-	hdl->refcount = 1;
-
-	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(static_cast<char*>(buffer) + sizeof(MSHandleInternal));
-	new_s->size = len;
+	MSHandleInternal* hdl = ms_rt_strnew(len, nullptr, 0);
+	MSStringInternal* new_s = reinterpret_cast<MSStringInternal*>(hdl->ptr);
 
 	wcscpy(&new_s->data[0], s);
 
-	hdl->ptr = new_s;
 	return hdl;
 }
 
@@ -15,12 +15,25 @@ struct MSStringInternal
 	wchar_t data[0];
 };
 
-void ms_rt_hdlinc(MSHandleInternal* hdl);
-void ms_rt_hdldec(MSHandleInternal* hdl);
+//	C names, so scripts compiled ahead of time by msc can link against them
+extern "C"
+{
+	MSEXPORT void ms_rt_hdlinc(MSHandleInternal* hdl);
+	MSEXPORT void ms_rt_hdldec(MSHandleInternal* hdl);
+	MSEXPORT void ms_rt_hdlfree(MSHandleInternal* hdl);
+
+	MSEXPORT int ms_rt_strlen(MSHandleInternal* hdl);
+	MSEXPORT MSHandleInternal* ms_rt_strcat(MSHandleInternal* s1, MSHandleInternal* s2);
+	MSEXPORT int ms_rt_strcmp(MSHandleInternal* s1, MSHandleInternal* s2);
+	MSEXPORT MSHandleInternal* ms_rt_substr(MSHandleInternal* s, int start, int len);
+
+	//	Same as above, but result is allocated in scratch memory when it fits. Used for temporaries that never escape.
+	MSEXPORT MSHandleInternal* ms_rt_strcat_scratch(MSHandleInternal* s1, MSHandleInternal* s2, void* scratch, int scratchSize);
+	MSEXPORT MSHandleInternal* ms_rt_substr_scratch(MSHandleInternal* s, int start, int len, void* scratch, int scratchSize);
 
-int ms_rt_strlen(MSHandleInternal* hdl);
-MSHandleInternal* ms_rt_strcat(MSHandleInternal* s1, MSHandleInternal* s2);
-int ms_rt_strcmp(MSHandleInternal* s1, MSHandleInternal* s2);
-MSHandleInternal* ms_rt_substr(MSHandleInternal* s, int start, int len);
-MSHandleInternal* ms_rt_stralloc(const wchar_t* s, int len);
-const wchar_t* ms_rt_strgetptr(MSHandleInternal* s);
\ No newline at end of file
+	//	Concatenate count strings at once. Used for nested strcat calls.
+	MSEXPORT MSHandleInternal* ms_rt_strconcat_n(MSHandleInternal** parts, int count);
+	MSEXPORT MSHandleInternal* ms_rt_strconcat_n_scratch(MSHandleInternal** parts, int count, void* scratch, int scratchSize);
+	MSEXPORT MSHandleInternal* ms_rt_stralloc(const wchar_t* s, int len);
+	MSEXPORT const wchar_t* ms_rt_strgetptr(MSHandleInternal* s);
+}
\ No newline at end of file
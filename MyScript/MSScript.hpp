@@ -4,6 +4,10 @@
 #include "MemoryPool.hpp"
 #include "Parser.hpp"
 #include "MSIRCompiler.hpp"
+#include "MSBytecode.hpp"
+#include "MSCachingCompiler.hpp"
+
+#include "ASTUtility.hpp"
 
 #include "IMSBase.h"
 
@@ -26,12 +30,28 @@ namespace MyScript
 
 		std::vector<std::unique_ptr<std::string>>	m_exportedNames;
 		//	Not sure if i can free this after compiling by the context.
+
+		//	Set when the script is interpreted instead of compiled with LLVM
+		std::unique_ptr<MSBytecodeProgram>		m_pProgram;
+
+		//	Set by the context that compiled it, removes its code from the JIT
+		std::function<void()>					m_unload;
 	public:
 		MSScript(std::string name)
 			: m_name(name)
 		{
 
 		}
+		~MSScript()
+		{
+			if (m_unload)
+				m_unload();
+		}
+
+		void SetUnload(std::function<void()> unload)
+		{
+			m_unload = unload;
+		}
 
 		std::vector<MSSymbol>& GetImportedSymbols()
 		{
@@ -48,13 +68,28 @@ namespace MyScript
 			return m_name;
 		}
 
+		MSBytecodeProgram* GetProgram()
+		{
+			return m_pProgram.get();
+		}
+		void SetProgram(std::unique_ptr<MSBytecodeProgram> pProgram)
+		{
+			m_pProgram = std::move(pProgram);
+		}
+
 		void RegisterExportedFunctions(const pool_vector<IASTNode*>& tree)
 		{
+			bool usesExport = UsesExport(ASTNodeList(tree));
 			for (auto node : tree)
 			{
 				if (is_type<ASTFunctionNode>(node))
 				{
 					ASTFunctionNode* functionNode = dynamic_cast<ASTFunctionNode*>(node);
+
+					//	Other functions are internal to the module, and may not even exist anymore
+					if (!IsFunctionExported(functionNode, usesExport))
+						continue;
+
 					MSSymbol s;
 					s.type = MSSymbolType::MS_SYMBOL_FUNCTION;
 
@@ -73,5 +108,39 @@ namespace MyScript
 				}
 			}
 		}
+		//	Precompiled script, there is no AST
+		void RegisterExportedFunctions(const std::vector<MSCachedSymbol>& symbols)
+		{
+			for (auto& cachedSymbol : symbols)
+			{
+				MSSymbol s;
+				s.type = MSSymbolType::MS_SYMBOL_FUNCTION;
+
+				m_exportedNames.push_back(std::make_unique<std::string>(cachedSymbol.name));
+				s.name = m_exportedNames.back()->c_str();
+
+				s.address = NULL;
+				s.functionData.callingConvention = MSCallingConvention::MS_CC_CDECL;
+				s.functionData.resultType = cachedSymbol.resultType;
+				s.functionData.count = cachedSymbol.parameterTypes.size();
+				for (int i = 0; i < s.functionData.count; ++i)
+					s.functionData.parameterTypes[i] = cachedSymbol.parameterTypes[i];
+
+				m_exportedSymbols.push_back(s);
+			}
+		}
+		std::vector<MSCachedSymbol> GetCachedSymbols()
+		{
+			std::vector<MSCachedSymbol> symbols;
+			for (auto& s : m_exportedSymbols)
+			{
+				MSCachedSymbol cachedSymbol;
+				cachedSymbol.name = s.name;
+				cachedSymbol.resultType = s.functionData.resultType;
+				cachedSymbol.parameterTypes.assign(s.functionData.parameterTypes, s.functionData.parameterTypes + s.functionData.count);
+				symbols.push_back(std::move(cachedSymbol));
+			}
+			return symbols;
+		}
 	};
 }
\ No newline at end of file
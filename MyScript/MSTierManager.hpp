@@ -0,0 +1,165 @@
+#pragma once
+#include "stdafx.h"
+
+//	MSCompileException
+#include "MSIRCompiler.hpp"
+
+/*
+Tiered compilation.
+Scripts are first compiled without optimization, and each exported function is called through a stub that counts calls.
+Once a function gets hot, it is recompiled with optimizations on a background thread, then its stub is repointed to the new code.
+*/
+namespace MyScript
+{
+	class MSTierManager
+		: mystd::NonCopyable
+	{
+	public:
+		//	Unoptimized IR of a script, kept to recompile its hot functions
+		struct Script
+		{
+			std::string					name;
+			llvm::SmallVector<char, 0>	bitcode;
+		};
+		//	Function called through a counting stub
+		struct Function
+		{
+			MSTierManager*	pManager;
+			Script*			pScript;
+			std::string		name;
+			//	Pointer the stub calls through
+			void**			ppTarget = nullptr;
+		};
+
+		//	Recompile a hot function with optimizations and link it. Returns the address of the new code, nullptr on failure.
+		typedef std::function<void*(Function&)> RecompileFunctionT;
+	private:
+		RecompileFunctionT m_recompile;
+
+		std::list<std::unique_ptr<Script>>		m_scripts;
+		std::list<std::unique_ptr<Function>>	m_functions;
+
+		std::deque<Function*>	m_queue;
+		std::mutex				m_mutex;
+		std::condition_variable	m_condition;
+		bool					m_stop = false;
+		//	Being recompiled, RemoveScript waits for it on m_idle
+		Function*				m_pRunning = nullptr;
+		std::condition_variable	m_idle;
+
+		//	Must be last, thread starts in the constructor
+		std::thread				m_thread;
+
+		void Enqueue(Function* pFunction)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_queue.push_back(pFunction);
+			}
+			m_condition.notify_one();
+		}
+
+		//	IR contexts and target machines come from the pools of the recompile function
+		void Run()
+		{
+			while (true)
+			{
+				Function* pFunction = nullptr;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+					if (m_stop)
+						return;
+
+					pFunction = m_queue.front();
+					m_queue.pop_front();
+					m_pRunning = pFunction;
+				}
+
+				//	An exception leaving the thread would terminate the host
+				try
+				{
+					void* address = m_recompile(*pFunction);
+
+					//	Stubs may be running on other threads
+					if (address != nullptr)
+						InterlockedExchangePointer(reinterpret_cast<PVOID volatile*>(pFunction->ppTarget), address);
+				}
+				catch (...)
+				{
+					//	Function just keeps running baseline code
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_pRunning = nullptr;
+				}
+				m_idle.notify_all();
+			}
+		}
+	public:
+		MSTierManager(RecompileFunctionT recompile)
+			: m_recompile(recompile),
+			m_thread(&MSTierManager::Run, this)
+		{
+
+		}
+		~MSTierManager()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_condition.notify_one();
+			m_thread.join();
+		}
+
+		//	Keep a copy of the module, must be called before stubs are inserted
+		Script* AddScript(const std::string& name, const llvm::Module& module)
+		{
+			std::unique_ptr<Script> pScript = std::make_unique<Script>();
+			pScript->name = name;
+
+			llvm::raw_svector_ostream os(pScript->bitcode);
+			llvm::WriteBitcodeToFile(&module, os);
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_scripts.push_back(std::move(pScript));
+			return m_scripts.back().get();
+		}
+		/*
+		Forget a script the host closed. Its pending tier-ups are dropped, and a recompilation of one of its functions
+		in flight completes first, so no stub is repointed once its code is removed. Must be called without the JIT lock,
+		recompilations take it to link.
+		*/
+		void RemoveScript(Script* pScript)
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+
+			m_queue.erase(std::remove_if(m_queue.begin(), m_queue.end(), [pScript](Function* pFunction) { return pFunction->pScript == pScript; }), m_queue.end());
+			m_idle.wait(lock, [this, pScript]() { return m_pRunning == nullptr || m_pRunning->pScript != pScript; });
+
+			m_functions.remove_if([pScript](const std::unique_ptr<Function>& pFunction) { return pFunction->pScript == pScript; });
+			m_scripts.remove_if([pScript](const std::unique_ptr<Script>& pOther) { return pOther.get() == pScript; });
+		}
+		Function* AddFunction(Script* pScript, const std::string& name)
+		{
+			std::unique_ptr<Function> pFunction = std::make_unique<Function>();
+			pFunction->pManager = this;
+			pFunction->pScript = pScript;
+			pFunction->name = name;
+
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_functions.push_back(std::move(pFunction));
+			return m_functions.back().get();
+		}
+
+		//	Called by stubs when their function gets hot
+		static void TierUp(void* pFunction)
+		{
+			Function* pTierFunction = reinterpret_cast<Function*>(pFunction);
+			pTierFunction->pManager->Enqueue(pTierFunction);
+		}
+	};
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "stdafx.h"
+
+/*
+Bounded pool of threads for work that is split across cores, like code generation of partitions.
+A caller of Run also runs jobs of its own batch while it waits, so a job may call Run again without
+waiting on threads that are all busy waiting themselves.
+*/
+namespace MyScript
+{
+	class MSWorkerPool
+		: mystd::NonCopyable
+	{
+		//	Jobs of one Run, each taken by a single thread
+		struct Batch
+		{
+			//	Only valid until Run returns, entries left in the queue then only read count
+			std::vector<std::function<void()>>*	pJobs;
+			size_t								count;
+			std::atomic<size_t>					next{ 0 };
+			std::mutex							mutex;
+			std::condition_variable				condition;
+			size_t								done = 0;
+
+			//	Returns false when every job was taken
+			bool RunNext()
+			{
+				size_t i = next++;
+				if (i >= count)
+					return false;
+
+				//	Jobs report their own errors, an exception leaving a pool thread would terminate the host
+				try
+				{
+					(*pJobs)[i]();
+				}
+				catch (...)
+				{
+				}
+
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					++done;
+				}
+				condition.notify_all();
+				return true;
+			}
+		};
+
+		//	One entry per job, a thread that takes it runs the next job of the batch
+		std::queue<std::shared_ptr<Batch>>	m_queue;
+		std::mutex							m_mutex;
+		std::condition_variable				m_condition;
+		bool								m_stop = false;
+
+		//	Must be last, threads start in the constructor
+		std::vector<std::thread>			m_threads;
+
+		void Work()
+		{
+			while (true)
+			{
+				std::shared_ptr<Batch> pBatch;
+				{
+					std::unique_lock<std::mutex> lock(m_mutex);
+					m_condition.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+					if (m_stop)
+						return;
+
+					pBatch = m_queue.front();
+					m_queue.pop();
+				}
+
+				pBatch->RunNext();
+			}
+		}
+	public:
+		//	Callers run jobs too, so one thread less than cores
+		MSWorkerPool(unsigned threadCount = std::max(1u, std::thread::hardware_concurrency()) - 1)
+		{
+			for (unsigned i = 0; i < threadCount; ++i)
+				m_threads.emplace_back(&MSWorkerPool::Work, this);
+		}
+		//	Every Run must have returned
+		~MSWorkerPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_mutex);
+				m_stop = true;
+			}
+			m_condition.notify_all();
+
+			for (auto& thread : m_threads)
+				thread.join();
+		}
+
+		//	Returns when every job has run
+		void Run(std::vector<std::function<void()>>& jobs)
+		{
+			std::shared_ptr<Batch> pBatch = std::make_shared<Batch>();
+			pBatch->pJobs = &jobs;
+			pBatch->count = jobs.size();
+
+			if (!m_threads.empty())
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					for (size_t i = 1; i < jobs.size(); ++i)
+						m_queue.push(pBatch);
+				}
+				m_condition.notify_all();
+			}
+
+			while (pBatch->RunNext())
+			{
+			}
+
+			//	Jobs taken by pool threads
+			std::unique_lock<std::mutex> lock(pBatch->mutex);
+			pBatch->condition.wait(lock, [&]() { return pBatch->done == pBatch->count; });
+		}
+	};
+}
@@ -71,9 +71,11 @@ namespace MyScript
 			int totalSize = size * sizeof(T);
 			if (m_blocks.empty() || (m_blocks.back().size - m_blocks.back().usedSize < totalSize))
 			{
+				//	Large allocations (long string literals, folded strings) get their own oversized block
+				int blockSize = std::max(m_blockSize, totalSize);
 				m_blocks.push_back(MemoryBlock());
-				m_blocks.back().ptr = new unsigned char[m_blockSize];
-				m_blocks.back().size = m_blockSize;
+				m_blocks.back().ptr = new unsigned char[blockSize];
+				m_blocks.back().size = blockSize;
 				m_blocks.back().usedSize = totalSize;
 				ptr = reinterpret_cast<T*>(m_blocks.back().ptr);
 			}
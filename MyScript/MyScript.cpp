@@ -6,13 +6,55 @@
 #include "MSContext.hpp"
 
 #include "Parser.hpp"
+#include "ASTEvaluator.hpp"
 #include "MSIRCompiler.hpp"
+#include "MSBytecode.hpp"
 #include "Utility.hpp"
 
 #include "MSRuntime.h"
 
 using namespace MyScript;
 
+//	Create a script from precompiled objects
+static MSScript* LinkCacheEntry(MSContext* pContext, MSCacheEntry& entry, MSSymbol* pSymbols, DWORD nSymbols)
+{
+	std::unique_ptr<MSScript> pScript = std::make_unique<MSScript>(entry.id);
+
+	pScript->RegisterExportedFunctions(entry.exportedSymbols);
+
+	//	Objects only reference the host symbols they use, but which ones is unknown here
+	for (DWORD i = 0; i < nSymbols; ++i)
+		pScript->GetImportedSymbols().push_back(pSymbols[i]);
+
+	pContext->Link(pScript.get(), entry);
+	return pScript.release();
+}
+
+//	Create a script run by the interpreter
+static MSScript* CompileInterpreted(LPCSTR id, pool_vector<IASTNode*>& tree, MSSymbol* pSymbols, DWORD nSymbols)
+{
+	MSBytecodeCompiler compiler(id);
+
+	for (int i = 0; i < nSymbols; ++i)
+	{
+		compiler.RegisterImport(&pSymbols[i]);
+	}
+
+	compiler.CompileAll(tree);
+
+	MSScript* pScript = new MSScript(id);
+
+	pScript->RegisterExportedFunctions(tree);
+
+	for (auto pSymbol : compiler.GetUsedImports())
+		pScript->GetImportedSymbols().push_back(*pSymbol);
+
+	pScript->SetProgram(compiler.TakeProgram());
+	return pScript;
+}
+
+static const MSCompileOptions defaultOptions = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_AUTO, NULL, FALSE };
+
 MSEXPORT HANDLE MSAPI MSCompile(
 	HANDLE hContext,
 	LPCSTR id,
@@ -20,13 +62,31 @@ MSEXPORT HANDLE MSAPI MSCompile(
 	DWORD sourceLength,
 	MSSymbol* pSymbols,
 	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
 	//MSCacheCallback cacheCallback,
 	MSSyntaxErrorCallback errorCallback)
 {
+	if (pOptions == NULL)
+		pOptions = &defaultOptions;
+
 	try
 	{
 		MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
 
+		//	Cache hits skip everything up to linking
+		bool useCache = pOptions->cacheDirectory != NULL && !pOptions->tiered && !pOptions->lazy && !pOptions->reloadable &&
+			pOptions->executionMode != MSExecutionMode::MS_EXECUTION_INTERPRETER;
+
+		std::string cacheKey;
+		if (useCache)
+		{
+			cacheKey = MSObjectCache::GetKey(id, source, sourceLength, pSymbols, nSymbols, *pOptions);
+
+			MSCacheEntry entry;
+			if (MSObjectCache::Load(pOptions->cacheDirectory, cacheKey, entry))
+				return LinkCacheEntry(pContext, entry, pSymbols, nSymbols);
+		}
+
 		//	Parse code with parser + scanner
 		std::unique_ptr<MemoryPool> memoryPool = std::make_unique<MemoryPool>();
 
@@ -45,12 +105,36 @@ MSEXPORT HANDLE MSAPI MSCompile(
 		if (result != ParseResult::Success)
 			return NULL;
 
-		//	Compile the AST into LLVM IR
-		MSIRCompiler compiler(pContext->GetContext(), id);
+		//	Evaluate what can be evaluated at compile time
+		ASTEvaluator evaluator(memoryPool.get());
+		evaluator.FoldAll(*pTree);
+
+		//	Running small scripts once is faster than compiling them with LLVM
+		if (pOptions->executionMode == MSExecutionMode::MS_EXECUTION_INTERPRETER)
+			return CompileInterpreted(id, *pTree, pSymbols, nSymbols);
+
+		if (pOptions->executionMode == MSExecutionMode::MS_EXECUTION_AUTO && !pOptions->reloadable && MSBytecodeCompiler::IsInterpreterCandidate(ASTNodeList(*pTree)))
+		{
+			try
+			{
+				return CompileInterpreted(id, *pTree, pSymbols, nSymbols);
+			}
+			catch (MSCompileException)
+			{
+				//	Beyond what the interpreter supports (non constant globals, large functions), the JIT takes it
+			}
+		}
+
+		//	Compile the AST into LLVM IR. Each compilation has its own IR context, so scripts can be compiled from several threads.
+		std::unique_ptr<llvm::LLVMContext> pLLVMContext = pContext->AcquireContext();
+		MSIRCompiler compiler(pLLVMContext.get(), id);
+#ifdef MS_BENCHMARK_HOOKS
+		compiler.SetRefcountCalls(pContext->GetRefcountCalls());
+#endif
 
 		for (int i = 0; i < nSymbols; ++i)
 		{
-			compiler.CreateImportDeclaration(&pSymbols[i]);
+			compiler.RegisterImport(&pSymbols[i]);
 		}
 
 		compiler.CompileAll(*pTree);
@@ -63,10 +147,25 @@ MSEXPORT HANDLE MSAPI MSCompile(
 		compiler.GetModule()->dump();
 #endif
 
-		for (int i = 0; i < nSymbols; ++i)
-			pScript->GetImportedSymbols().push_back(pSymbols[i]);
+		//	Only referenced imports need to be resolved when linking
+		for (auto pSymbol : compiler.GetUsedImports())
+			pScript->GetImportedSymbols().push_back(*pSymbol);
 
-		pContext->Compile(pScript, std::move(compiler.GetModule()));
+		if (!useCache)
+		{
+			pContext->Compile(pScript, std::move(compiler.GetModule()), *pOptions);
+			pContext->ReleaseContext(pScript, std::move(pLLVMContext), *pOptions);
+			return pScript;
+		}
+
+		MSCacheEntry entry;
+		pContext->Compile(pScript, std::move(compiler.GetModule()), *pOptions, &entry.objects);
+		pContext->ReleaseContext(pScript, std::move(pLLVMContext), *pOptions);
+
+		entry.id = id;
+		entry.symbolsKey = MSObjectCache::GetSymbolsKey(pSymbols, nSymbols);
+		entry.exportedSymbols = pScript->GetCachedSymbols();
+		MSObjectCache::Store(pOptions->cacheDirectory, cacheKey, entry);
 		return pScript;
 	}
 	catch (MSCompileException e)
@@ -76,6 +175,210 @@ MSEXPORT HANDLE MSAPI MSCompile(
 	}
 }
 
+MSEXPORT DWORD MSAPI MSCompileBatch(
+	HANDLE hContext,
+	const MSBatchSource* pSources,
+	DWORD nSources,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	HANDLE* phScripts,
+	MSSyntaxErrorCallback errorCallback)
+{
+	MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+
+	//	A job per script on the worker pool of the context, threads that get small scripts take more of them. Each job runs
+	//	all the stages of its script, only linking is serialized by the context. Partitions of large scripts are queued
+	//	on the same pool, so they do not add threads while the batch runs.
+	std::atomic<DWORD> compiledCount(0);
+
+	std::vector<std::function<void()>> jobs;
+	for (DWORD i = 0; i < nSources; ++i)
+	{
+		jobs.push_back([&, i]()
+		{
+			//	Any failure is reported for its script only
+			try
+			{
+				phScripts[i] = MSCompile(hContext, pSources[i].id, pSources[i].source, pSources[i].sourceLength, pSymbols, nSymbols, pOptions, errorCallback);
+			}
+			catch (std::exception& e)
+			{
+				phScripts[i] = NULL;
+				errorCallback(pSources[i].id, 0, 0, e.what());
+			}
+			catch (...)
+			{
+				phScripts[i] = NULL;
+				errorCallback(pSources[i].id, 0, 0, "unknown error");
+			}
+
+			if (phScripts[i] != NULL)
+				++compiledCount;
+		});
+	}
+	pContext->GetWorkerPool()->Run(jobs);
+
+	return compiledCount;
+}
+
+MSEXPORT BOOL MSAPI MSReload(
+	HANDLE hContext,
+	HANDLE hScript,
+	LPCSTR source,
+	DWORD sourceLength,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	MSSyntaxErrorCallback errorCallback)
+{
+	MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+	MSScript* pScript = reinterpret_cast<MSScript*>(hScript);
+
+	try
+	{
+		MSCompileOptions options = pOptions != NULL ? *pOptions : defaultOptions;
+		options.reloadable = TRUE;
+
+		//	New version is compiled as a script of its own, then gives its code to the reloaded one
+		std::string name = pContext->GetReloadName(pScript);
+		std::unique_ptr<MSScript> pNew(reinterpret_cast<MSScript*>(MSCompile(hContext, name.c_str(), source, sourceLength, pSymbols, nSymbols, &options, errorCallback)));
+		if (!pNew)
+			return FALSE;
+
+		pContext->Reload(pScript, pNew.get());
+		return TRUE;
+	}
+	catch (MSCompileException e)
+	{
+		errorCallback(pScript->GetName().c_str(), 0, 0, e.what());
+		return FALSE;
+	}
+}
+
+//	Arguments of an asynchronous compilation, the host may free its own once MSCompileAsync returns
+struct MSCompileArguments
+{
+	std::string				id;
+	std::string				source;
+	std::vector<MSSymbol>	symbols;
+	MSCompileOptions		options;
+	bool					hasOptions;
+	MSSyntaxErrorCallback	errorCallback;
+	//	Symbol names and option strings
+	std::list<std::string>	strings;
+
+	LPCSTR CopyString(LPCSTR s)
+	{
+		if (s == NULL)
+			return NULL;
+
+		strings.emplace_back(s);
+		return strings.back().c_str();
+	}
+};
+
+MSEXPORT HANDLE MSAPI MSCompileAsync(
+	HANDLE hContext,
+	LPCSTR id,
+	LPCSTR source,
+	DWORD sourceLength,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	MSCompilePriority priority,
+	MSCompileCallback callback,
+	LPVOID userData,
+	MSSyntaxErrorCallback errorCallback)
+{
+	MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+
+	std::shared_ptr<MSCompileArguments> pArguments = std::make_shared<MSCompileArguments>();
+	pArguments->id = id;
+	pArguments->source.assign(source, sourceLength);
+	pArguments->errorCallback = errorCallback;
+
+	for (DWORD i = 0; i < nSymbols; ++i)
+	{
+		MSSymbol symbol = pSymbols[i];
+		symbol.name = pArguments->CopyString(symbol.name);
+		pArguments->symbols.push_back(symbol);
+	}
+
+	pArguments->hasOptions = pOptions != NULL;
+	if (pOptions != NULL)
+	{
+		pArguments->options = *pOptions;
+		pArguments->options.targetCPU = pArguments->CopyString(pOptions->targetCPU);
+		pArguments->options.targetFeatures = pArguments->CopyString(pOptions->targetFeatures);
+		pArguments->options.cacheDirectory = pArguments->CopyString(pOptions->cacheDirectory);
+	}
+
+	std::shared_ptr<MSCompileTask> pTask = std::make_shared<MSCompileTask>(
+		[hContext, pArguments]()
+	{
+		//	Like MSCompileBatch, failures other than compile errors are reported for this script only
+		try
+		{
+			return static_cast<IMSBase*>(MSCompile(hContext, pArguments->id.c_str(), pArguments->source.data(), pArguments->source.size(),
+				pArguments->symbols.data(), pArguments->symbols.size(), pArguments->hasOptions ? &pArguments->options : NULL, pArguments->errorCallback));
+		}
+		catch (std::exception& e)
+		{
+			pArguments->errorCallback(pArguments->id.c_str(), 0, 0, e.what());
+			return static_cast<IMSBase*>(nullptr);
+		}
+	},
+		priority, callback, userData);
+
+	pContext->GetCompileQueue()->Enqueue(pTask);
+	return new MSCompileHandle(pTask);
+}
+
+MSEXPORT MSCompileStatus MSAPI MSWaitCompile(HANDLE hCompile, DWORD timeout)
+{
+	return reinterpret_cast<MSCompileHandle*>(hCompile)->GetTask()->Wait(timeout);
+}
+MSEXPORT BOOL MSAPI MSCancelCompile(HANDLE hCompile)
+{
+	return reinterpret_cast<MSCompileHandle*>(hCompile)->GetTask()->Cancel() ? TRUE : FALSE;
+}
+MSEXPORT HANDLE MSAPI MSGetCompileResult(HANDLE hCompile)
+{
+	return reinterpret_cast<MSCompileHandle*>(hCompile)->GetTask()->TakeScript();
+}
+
+MSEXPORT HANDLE MSAPI MSLink(
+	HANDLE hContext,
+	LPCSTR id,
+	const BYTE* buffer,
+	DWORD bufferLength,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	MSSyntaxErrorCallback errorCallback)
+{
+	try
+	{
+		MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+
+		MSCacheEntry entry;
+		MSObjectCache::Deserialize(llvm::StringRef(reinterpret_cast<const char*>(buffer), bufferLength), entry);
+
+		//	Symbol names in the objects are prefixed with the id
+		if (entry.id != id)
+			throw MSCompileException("precompiled script has another id");
+		if (entry.symbolsKey != MSObjectCache::GetSymbolsKey(pSymbols, nSymbols))
+			throw MSCompileException("precompiled script was compiled with other host symbols");
+
+		return LinkCacheEntry(pContext, entry, pSymbols, nSymbols);
+	}
+	catch (MSCompileException e)
+	{
+		errorCallback(id, 0, 0, e.what());
+		return NULL;
+	}
+}
+
 struct MSSymbolFindData
 	: IMSBase
 {
@@ -130,6 +433,12 @@ MSEXPORT VOID MSAPI MSExecute(HANDLE hContext, HANDLE hScript)
 	MSScript* pScript = reinterpret_cast<MSScript*>(hScript);
 	pContext->Execute(pScript);
 }
+MSEXPORT BOOL MSAPI MSGetMemoryInfo(HANDLE hContext, HANDLE hScript, MSMemoryInfo* pInfo)
+{
+	MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+	MSScript* pScript = reinterpret_cast<MSScript*>(hScript);
+	return pContext->GetMemoryInfo(pScript, *pInfo) ? TRUE : FALSE;
+}
 
 MSEXPORT VOID MSAPI MSCloseHandle(HANDLE handle)
 {
@@ -137,6 +446,14 @@ MSEXPORT VOID MSAPI MSCloseHandle(HANDLE handle)
 	delete ptr;
 }
 
+#ifdef MS_BENCHMARK_HOOKS
+MSEXPORT VOID MSAPI MSSetRefcountCalls(HANDLE hContext, BOOL enable)
+{
+	MSContext* pContext = reinterpret_cast<MSContext*>(hContext);
+	pContext->SetRefcountCalls(enable != FALSE);
+}
+#endif
+
 MSEXPORT BOOL MSAPI MSAllocString(LPCWSTR str, MSString* pString)
 {
 	*pString = reinterpret_cast<MSString>(ms_rt_stralloc(str, wcslen(str)));
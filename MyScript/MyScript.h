@@ -89,8 +89,80 @@ struct MSSymbol
 	};
 };
 
+//	Optimization pipelines
+enum MSOptimizationLevel
+{
+	MS_OPTIMIZATION_O0,		//	No optimization, fastest to compile
+	MS_OPTIMIZATION_O1,
+	MS_OPTIMIZATION_O2,		//	Default
+	MS_OPTIMIZATION_O3,
+	MS_OPTIMIZATION_OS,		//	Favor code size
+};
+//	How scripts are run
+enum MSExecutionMode
+{
+	MS_EXECUTION_AUTO,			//	Interpreter for small scripts that do not export functions, JIT otherwise
+	MS_EXECUTION_JIT,
+	MS_EXECUTION_INTERPRETER,	//	No LLVM compilation. Exported functions cannot be called, their address is NULL.
+};
+struct MSCompileOptions
+{
+	MSOptimizationLevel	optimizationLevel;
+	LPCSTR				targetCPU;		//	eg. "haswell", NULL for default
+	LPCSTR				targetFeatures;	//	eg. "+avx2,-sse4.2", NULL for default
+	//	Tiered compilation: functions are first compiled without optimization, and recompiled in background
+	//	with optimizationLevel once called tierUpThreshold times (0 for default).
+	BOOL				tiered;
+	DWORD				tierUpThreshold;
+	//	Lazy compilation: each function is compiled on its first call, exported symbols point to stubs.
+	//	Functions are optimized one by one, so no inlining across functions. Ignored when tiered.
+	BOOL				lazy;
+	MSExecutionMode		executionMode;
+	//	Directory of the persistent object cache, NULL to disable it. Scripts compiled again with the same source,
+	//	options and host symbols are loaded from there. Not used for tiered, lazy and interpreted scripts.
+	LPCSTR				cacheDirectory;
+	//	Exported functions are called through stubs, so MSReload can replace the script code while the host keeps its
+	//	function pointers. Calls are counted, which costs two atomic operations each. Ignored when tiered or lazy.
+	BOOL				reloadable;
+};
+
+//	A script of MSCompileBatch
+struct MSBatchSource
+{
+	LPCSTR	id;
+	LPCSTR	source;
+	DWORD	sourceLength;
+};
+
+//	JIT memory in use, in bytes
+struct MSMemoryInfo
+{
+	DWORD	codeSize;
+	DWORD	readOnlySize;
+	DWORD	readWriteSize;
+	DWORD	reservedSize;	//	Slabs the context allocated, shared by its scripts. 0 for a script.
+};
+
+//	Order in which queued asynchronous compilations start
+enum MSCompilePriority
+{
+	MS_PRIORITY_LOW,
+	MS_PRIORITY_NORMAL,
+	MS_PRIORITY_HIGH,
+};
+enum MSCompileStatus
+{
+	MS_COMPILE_PENDING,		//	Queued
+	MS_COMPILE_RUNNING,
+	MS_COMPILE_SUCCEEDED,	//	Script is available with MSGetCompileResult
+	MS_COMPILE_FAILED,		//	Errors were reported to the error callback
+	MS_COMPILE_CANCELED,
+};
+
 typedef VOID(MSAPI* MSSyntaxErrorCallback)(LPCSTR id, DWORD line, DWORD col, LPCSTR msg);
 typedef VOID(MSAPI* MSCacheCallback)(LPCSTR id, BYTE buffer, DWORD length);
+//	Called on a compile thread when an asynchronous compilation completes, or on the thread that canceled it
+typedef VOID(MSAPI* MSCompileCallback)(LPVOID userData, MSCompileStatus status);
 
 
 MSEXPORT HANDLE MSAPI MSGetFirstSymbol(HANDLE hScript, MSSymbol* pSymbol);
@@ -99,7 +171,7 @@ MSEXPORT BOOL MSAPI MSGetNextSymbol(HANDLE hFind, MSSymbol* pSymbol);
 //BOOL MSAPI MSAddSymbol(HANDLE hScript, MSSymbol* pSymbol);
 
 MSEXPORT HANDLE MSAPI MSCreateContext();
-//	Compile a script from source
+//	Compile a script from source. pOptions may be NULL to use default options.
 MSEXPORT HANDLE MSAPI MSCompile(
 	HANDLE hContext,
 	LPCSTR id,
@@ -107,17 +179,67 @@ MSEXPORT HANDLE MSAPI MSCompile(
 	DWORD sourceLength,
 	MSSymbol* pSymbols,
 	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
 	//MSCacheCallback cacheCallback,
 	MSSyntaxErrorCallback errorCallback);
-//	Load a script from precompiled source
-/*MSEXPORT HANDLE MSAPI MSLink(
+//	Compile several scripts on all cores, they share host symbols and options. They run on the calling thread and the
+//	worker threads of the context, reused by every batch. phScripts receives a handle per source, NULL for the scripts that failed. The error callback is called from several threads, with the id of the script.
+//	Returns the number of scripts compiled.
+MSEXPORT DWORD MSAPI MSCompileBatch(
+	HANDLE hContext,
+	const MSBatchSource* pSources,
+	DWORD nSources,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	HANDLE* phScripts,
+	MSSyntaxErrorCallback errorCallback);
+//	Queue a compilation on the compile threads of the context, and return a compile handle at once. Arguments are
+//	copied. The error callback is called from a compile thread. Close the handle with MSCloseHandle, the compilation
+//	goes on if it is running. callback may be NULL.
+MSEXPORT HANDLE MSAPI MSCompileAsync(
 	HANDLE hContext,
 	LPCSTR id,
-	BYTE buffer,
+	LPCSTR source,
+	DWORD sourceLength,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	MSCompilePriority priority,
+	MSCompileCallback callback,
+	LPVOID userData,
+	MSSyntaxErrorCallback errorCallback);
+//	Wait at most timeout milliseconds for a compilation to complete, 0 to poll, INFINITE to wait. Returns its status.
+MSEXPORT MSCompileStatus MSAPI MSWaitCompile(HANDLE hCompile, DWORD timeout);
+//	A pending compilation will not run. A running one completes, but its script is destroyed.
+//	Returns FALSE if the compilation already completed.
+MSEXPORT BOOL MSAPI MSCancelCompile(HANDLE hCompile);
+//	Script of a succeeded compilation, NULL otherwise. The caller owns it, later calls return NULL.
+MSEXPORT HANDLE MSAPI MSGetCompileResult(HANDLE hCompile);
+//	Recompile a reloadable script from a new source, in place. It must export the same functions with the same
+//	signatures. Exported symbol addresses stay valid and switch to the new code, calls in flight finish in the old one.
+//	Script variables start over, call MSExecute to initialize them. Returns FALSE on errors, the script is unchanged.
+//	Code of a previous version is freed once no call runs it, which is only checked on the next MSReload, when the
+//	context compiles or loads another script, and with the script handle. Until then it stays in JIT memory.
+MSEXPORT BOOL MSAPI MSReload(
+	HANDLE hContext,
+	HANDLE hScript,
+	LPCSTR source,
+	DWORD sourceLength,
+	MSSymbol* pSymbols,
+	DWORD nSymbols,
+	const MSCompileOptions* pOptions,
+	MSSyntaxErrorCallback errorCallback);
+//	Load a precompiled script, a file of the persistent object cache. id and host symbol signatures must be
+//	the ones it was compiled with.
+MSEXPORT HANDLE MSAPI MSLink(
+	HANDLE hContext,
+	LPCSTR id,
+	const BYTE* buffer,
 	DWORD bufferLength,
 	MSSymbol* pSymbols,
 	DWORD nSymbols,
-	MSSyntaxErrorCallback errorCallback);*/
+	MSSyntaxErrorCallback errorCallback);
 
 MSEXPORT BOOL MSAPI MSAllocString(
 	LPCWSTR str,
@@ -127,4 +249,13 @@ MSEXPORT VOID MSAPI MSFreeString(MSString s);
 MSEXPORT LPCWSTR MSAPI MSGetString(MSString s);
 
 MSEXPORT VOID MSAPI MSExecute(HANDLE hContext, HANDLE hScript);
+//	JIT memory of a script, or of the whole context when hScript is NULL. Returns FALSE for interpreted scripts.
+//	For tiered scripts, only the unoptimized code is counted.
+MSEXPORT BOOL MSAPI MSGetMemoryInfo(HANDLE hContext, HANDLE hScript, MSMemoryInfo* pInfo);
 MSEXPORT VOID MSAPI MSCloseHandle(HANDLE handle);
+
+#ifdef MS_BENCHMARK_HOOKS
+//	Benchmark only, not defined in shipping builds: scripts compiled afterwards in this context update string refcounts
+//	through runtime calls, instead of inline code
+MSEXPORT VOID MSAPI MSSetRefcountCalls(HANDLE hContext, BOOL enable);
+#endif
@@ -326,12 +326,23 @@ namespace MyScript
 		}
 		ParseResult ParseFunction(ASTFunctionNode** ppNode)
 		{
+			//	Parse optional 'export'
+			bool isExported = ParseTokenByText("export") == ParseResult::Success;
+
 			//	Parse 'function'
 			if (ParseTokenByText("function") != ParseResult::Success)
+			{
+				if (isExported)
+				{
+					Error("'function' expected");
+					return ParseResult::Error;
+				}
 				return ParseResult::ErrorAtStart;
+			}
 
 			ASTFunctionNode* pNode = m_pMemoryPool->Alloc<ASTFunctionNode>()(m_pMemoryPool);
 			*ppNode = pNode;
+			pNode->m_isExported = isExported;
 
 			//	Parse name
 			if (ParseTokenByType(TokenType::Identifier, &pNode->m_name) != ParseResult::Success)
@@ -0,0 +1,425 @@
+// msc.cpp : ahead-of-time compiler for MyScript.
+//
+// Compiles scripts to a native object file or static library, with a C header of their functions,
+// so a host can link them without any JIT compilation at runtime.
+
+#include "../MyScript/stdafx.h"
+
+#include "llvm/Object/ArchiveWriter.h"
+#include "llvm/Support/CommandLine.h"
+
+#include "../MyScript/Parser.hpp"
+#include "../MyScript/ASTEvaluator.hpp"
+#include "../MyScript/MSIRCompiler.hpp"
+#include "../MyScript/MSOptimizer.hpp"
+#include "../MyScript/MSScript.hpp"
+
+#include <iostream>
+
+using namespace MyScript;
+
+static llvm::cl::list<std::string> InputFiles(llvm::cl::Positional, llvm::cl::OneOrMore, llvm::cl::desc("<script files>"));
+static llvm::cl::opt<std::string> OutputFile("o", llvm::cl::desc("Output object file, or static library if it ends with .lib or .a"), llvm::cl::value_desc("filename"));
+static llvm::cl::opt<std::string> HeaderFile("header", llvm::cl::desc("Generated C header, output file with a .h extension by default"), llvm::cl::value_desc("filename"));
+static llvm::cl::opt<char> OptimizationLevel("O", llvm::cl::desc("Optimization level: 0, 1, 2, 3 or s (default 2)"), llvm::cl::Prefix, llvm::cl::ZeroOrMore, llvm::cl::init('2'));
+static llvm::cl::opt<std::string> TargetTriple("mtriple", llvm::cl::desc("Target triple, host by default"));
+static llvm::cl::opt<std::string> TargetCPU("mcpu", llvm::cl::desc("Target CPU, eg. haswell"));
+static llvm::cl::opt<std::string> TargetFeatures("mattr", llvm::cl::desc("Target features, eg. +avx2,-sse4.2"));
+static llvm::cl::list<std::string> Imports("import", llvm::cl::desc("Host function callable by the scripts, as name:result(type,...), with @stdcall suffix for stdcall"), llvm::cl::value_desc("signature"), llvm::cl::ZeroOrMore);
+
+//	A script compiled to an object file
+struct CompiledScript
+{
+	std::string					id;
+	//	Prefix of C names of script functions
+	std::string					prefix;
+	std::vector<MSCachedSymbol>	exportedSymbols;
+	llvm::SmallVector<char, 0>	object;
+};
+
+//	Runtime functions the compiled code references
+static const char* runtimeFunctions[] =
+{
+	"hdlinc", "hdldec", "hdlfree", "strlen", "strcat", "strcmp", "substr", "strcat_scratch", "substr_scratch",
+	"strconcat_n", "strconcat_n_scratch", "strgetptr",
+};
+
+void MSAPI ErrorCallback(LPCSTR id, DWORD line, DWORD col, LPCSTR msg)
+{
+	std::cerr << id << " : (line " << line << ", col " << col << ") : " << msg << std::endl;
+}
+
+MSType ParseType(llvm::StringRef s)
+{
+	s = s.trim();
+	if (s == "int")
+		return MSType::MS_TYPE_INTEGER;
+	if (s == "float")
+		return MSType::MS_TYPE_FLOAT;
+	if (s == "bool")
+		return MSType::MS_TYPE_BOOLEAN;
+	if (s == "string")
+		return MSType::MS_TYPE_STRING;
+	if (s == "void")
+		return MSType::MS_TYPE_VOID;
+	throw MSCompileException(("unknown type " + s.str()).c_str());
+}
+//	name:result(type,...)[@stdcall]. Name is stored in names, symbols only point to it.
+MSSymbol ParseImport(llvm::StringRef signature, std::list<std::string>& names)
+{
+	MSSymbol s = {};
+	s.type = MSSymbolType::MS_SYMBOL_FUNCTION;
+	s.functionData.callingConvention = MSCallingConvention::MS_CC_CDECL;
+
+	if (signature.endswith("@stdcall"))
+	{
+		s.functionData.callingConvention = MSCallingConvention::MS_CC_STDCALL;
+		signature = signature.drop_back(strlen("@stdcall"));
+	}
+
+	size_t colon = signature.find(':');
+	size_t open = signature.find('(');
+	if (colon == llvm::StringRef::npos || open == llvm::StringRef::npos || open < colon || !signature.endswith(")"))
+		throw MSCompileException(("invalid import " + signature.str()).c_str());
+
+	names.push_back(signature.substr(0, colon).trim().str());
+	s.name = names.back().c_str();
+	s.functionData.resultType = ParseType(signature.slice(colon + 1, open));
+
+	llvm::StringRef parameters = signature.slice(open + 1, signature.size() - 1).trim();
+	if (!parameters.empty())
+	{
+		llvm::SmallVector<llvm::StringRef, 10> types;
+		parameters.split(types, ',');
+		if (types.size() > 10)
+			throw MSCompileException(("too many parameters " + signature.str()).c_str());
+
+		for (auto type : types)
+			s.functionData.parameterTypes[s.functionData.count++] = ParseType(type);
+	}
+	return s;
+}
+
+//	Script file name, without directory
+std::string GetScriptId(llvm::StringRef path)
+{
+	return llvm::sys::path::filename(path).str();
+}
+//	Script file name without extension, made a valid C identifier
+std::string GetSymbolPrefix(llvm::StringRef path)
+{
+	std::string prefix = llvm::sys::path::stem(path).str();
+	for (auto& c : prefix)
+	{
+		if (!isalnum(static_cast<unsigned char>(c)))
+			c = '_';
+	}
+	if (prefix.empty() || isdigit(static_cast<unsigned char>(prefix[0])))
+		prefix = "_" + prefix;
+	return prefix;
+}
+
+/*
+Give symbols C names, the JIT resolves them by script id instead:
+- script functions: <prefix>_<name>, <prefix>__execute for the script body
+- host functions: their own name
+- runtime functions: ms_rt_<name>
+*/
+void RenameSymbols(llvm::Module& module, const std::string& id, const std::string& prefix)
+{
+	std::string scriptPrefix = id + "::";
+	for (auto& function : module)
+	{
+		if (function.hasLocalLinkage() || function.isIntrinsic())
+			continue;
+
+		llvm::StringRef name = function.getName();
+		std::string newName;
+		if (name.startswith(scriptPrefix))
+		{
+			llvm::StringRef symbolName = name.substr(scriptPrefix.size());
+			if (function.isDeclaration())
+				newName = symbolName.str();
+			else if (symbolName == "$")
+				newName = prefix + "__execute";
+			else
+				newName = prefix + "_" + symbolName.str();
+		}
+		else if (std::find(std::begin(runtimeFunctions), std::end(runtimeFunctions), name) != std::end(runtimeFunctions))
+			newName = "ms_rt_" + name.str();
+		else
+			continue;
+
+		//	LLVM renames the function if the name is taken
+		function.setName(newName);
+		if (function.getName() != newName)
+			throw MSCompileException(("symbol name collision " + newName).c_str());
+	}
+}
+
+CompiledScript CompileScript(llvm::LLVMContext& context, llvm::TargetMachine& targetMachine, const std::string& path, std::vector<MSSymbol>& imports, std::map<std::string, MSSymbol>& usedImports, const MSCompileOptions& options)
+{
+	CompiledScript script;
+	script.id = GetScriptId(path);
+	script.prefix = GetSymbolPrefix(path);
+
+	llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> source = llvm::MemoryBuffer::getFile(path);
+	if (!source)
+		throw MSCompileException(("cannot read " + path).c_str());
+
+	std::unique_ptr<MemoryPool> memoryPool = std::make_unique<MemoryPool>();
+
+	Scanner scanner;
+	scanner.SetSource((*source)->getBufferStart(), (*source)->getBufferSize());
+	scanner.SetIndex(0);
+
+	Parser parser;
+	parser.SetScanner(&scanner);
+	parser.SetMemoryPool(memoryPool.get());
+	parser.SetErrorCallback(ErrorCallback);
+
+	pool_vector<IASTNode*> tree(memoryPool->GetAllocator<IASTNode>());
+	if (parser.ParseAll(tree) != ParseResult::Success)
+		throw MSCompileException("syntax error");
+
+	ASTEvaluator evaluator(memoryPool.get());
+	evaluator.FoldAll(tree);
+
+	MSIRCompiler compiler(&context, script.id.c_str());
+	for (auto& s : imports)
+		compiler.RegisterImport(&s);
+
+	compiler.CompileAll(tree);
+
+	for (auto pSymbol : compiler.GetUsedImports())
+		usedImports[pSymbol->name] = *pSymbol;
+
+	MSScript msScript(script.id);
+	msScript.RegisterExportedFunctions(tree);
+	script.exportedSymbols = msScript.GetCachedSymbols();
+
+	llvm::Module& module = *compiler.GetModule();
+	module.setTargetTriple(targetMachine.getTargetTriple().str());
+	module.setDataLayout(targetMachine.createDataLayout());
+
+	RenameSymbols(module, script.id, script.prefix);
+
+	MSOptimizer::ApplyCompileOptions(module, options);
+	MSOptimizer::RunOptimizationPipeline(module, targetMachine, options.optimizationLevel);
+
+	llvm::raw_svector_ostream os(script.object);
+	llvm::legacy::PassManager PM;
+	if (targetMachine.addPassesToEmitFile(PM, os, llvm::TargetMachine::CGFT_ObjectFile))
+		throw MSCompileException("target cannot emit object files");
+	PM.run(module);
+
+	return script;
+}
+
+//	C type of a value passed between the host and scripts
+const char* GetCType(MSType type, bool isHostParameter)
+{
+	switch (type)
+	{
+	case MSType::MS_TYPE_INTEGER:
+		return "int";
+	case MSType::MS_TYPE_FLOAT:
+		return "float";
+	case MSType::MS_TYPE_BOOLEAN:
+		return "bool";
+	case MSType::MS_TYPE_STRING:
+		//	Scripts pass C-strings to host functions
+		return isHostParameter ? "const wchar_t*" : "MSString";
+	case MSType::MS_TYPE_VOID:
+		return "void";
+	default:
+		throw MSCompileException("type not supported");
+	}
+}
+std::string GetCParameters(const MSType* pTypes, size_t count, bool isHost)
+{
+	if (count == 0)
+		return "void";
+
+	std::string s;
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (i != 0)
+			s += ", ";
+		s += GetCType(pTypes[i], isHost);
+		s += " p" + std::to_string(i);
+	}
+	return s;
+}
+std::string GenerateHeader(const std::vector<CompiledScript>& scripts, const std::map<std::string, MSSymbol>& usedImports)
+{
+	std::string s;
+	s += "//\tGenerated by msc, do not edit.\n";
+	s += "//\tLink with the scripts object file and MyScript.lib (string runtime).\n";
+	s += "#pragma once\n\n";
+	s += "#include \"MyScript.h\"\n\n";
+	s += "#ifdef __cplusplus\nextern \"C\" {\n#else\n#include <stdbool.h>\n#endif\n\n";
+
+	if (!usedImports.empty())
+	{
+		s += "//\tHost functions called by the scripts, to be defined by the host\n";
+		for (auto& it : usedImports)
+		{
+			const MSSymbol& import = it.second;
+			s += GetCType(import.functionData.resultType, false);
+			if (import.functionData.callingConvention == MSCallingConvention::MS_CC_STDCALL)
+				s += " __stdcall";
+			s += " " + it.first + "(" + GetCParameters(import.functionData.parameterTypes, import.functionData.count, true) + ");\n";
+		}
+		s += "\n";
+	}
+
+	for (auto& script : scripts)
+	{
+		s += "//\t" + script.id + "\n";
+		s += "//\tScript body, initializes script variables. Call it once before other functions of the script.\n";
+		s += "void " + script.prefix + "__execute(void);\n";
+		s += "//\tString arguments are borrowed, returned strings must be freed with MSFreeString\n";
+		for (auto& symbol : script.exportedSymbols)
+		{
+			s += GetCType(symbol.resultType, false);
+			s += " " + script.prefix + "_" + symbol.name + "(" + GetCParameters(symbol.parameterTypes.data(), symbol.parameterTypes.size(), false) + ");\n";
+		}
+		s += "\n";
+	}
+
+	s += "#ifdef __cplusplus\n}\n#endif\n";
+	return s;
+}
+
+void WriteFile(const std::string& path, llvm::StringRef data)
+{
+	std::error_code error;
+	llvm::raw_fd_ostream os(path, error, llvm::sys::fs::F_None);
+	if (error)
+		throw MSCompileException(("cannot write " + path + " : " + error.message()).c_str());
+	os << data;
+}
+void WriteLibrary(const std::string& path, const std::vector<CompiledScript>& scripts, const llvm::Triple& triple)
+{
+	//	Member names must be unique for linkers to extract them
+	std::vector<std::string> memberNames;
+	for (auto& script : scripts)
+		memberNames.push_back(script.prefix + (triple.isOSWindows() ? ".obj" : ".o"));
+
+	std::vector<llvm::NewArchiveMember> members;
+	for (size_t i = 0; i < scripts.size(); ++i)
+	{
+		llvm::StringRef object(scripts[i].object.data(), scripts[i].object.size());
+		members.push_back(llvm::NewArchiveMember(llvm::MemoryBufferRef(object, memberNames[i])));
+	}
+
+	llvm::object::Archive::Kind kind = triple.isOSDarwin() ? llvm::object::Archive::K_BSD : llvm::object::Archive::K_GNU;
+	std::pair<llvm::StringRef, std::error_code> result = llvm::writeArchive(path, members, true, kind, true, false);
+	if (result.second)
+		throw MSCompileException(("cannot write " + result.first.str() + " : " + result.second.message()).c_str());
+}
+
+int main(int argc, char** argv)
+{
+	llvm::cl::ParseCommandLineOptions(argc, argv, "MyScript ahead-of-time compiler\n");
+
+	llvm::InitializeNativeTarget();
+	llvm::InitializeNativeTargetAsmPrinter();
+	llvm::InitializeNativeTargetAsmParser();
+
+	try
+	{
+		MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_JIT, NULL, FALSE };
+		switch (OptimizationLevel)
+		{
+		case '0': options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_O0; break;
+		case '1': options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_O1; break;
+		case '2': options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_O2; break;
+		case '3': options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_O3; break;
+		case 's': options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_OS; break;
+		default:
+			throw MSCompileException("invalid optimization level");
+		}
+		if (!TargetCPU.empty())
+			options.targetCPU = TargetCPU.c_str();
+		if (!TargetFeatures.empty())
+			options.targetFeatures = TargetFeatures.c_str();
+
+		llvm::Triple triple(TargetTriple.empty() ? llvm::sys::getProcessTriple() : TargetTriple);
+
+		std::string error;
+		const llvm::Target* pTarget = llvm::TargetRegistry::lookupTarget(triple.str(), error);
+		if (pTarget == nullptr)
+			throw MSCompileException(error.c_str());
+
+		llvm::CodeGenOpt::Level codeGenLevel = options.optimizationLevel == MSOptimizationLevel::MS_OPTIMIZATION_O0 ? llvm::CodeGenOpt::None : llvm::CodeGenOpt::Default;
+		std::unique_ptr<llvm::TargetMachine> pTargetMachine(pTarget->createTargetMachine(triple.str(), TargetCPU, TargetFeatures,
+			llvm::TargetOptions(), llvm::None, llvm::CodeModel::Default, codeGenLevel));
+
+		std::list<std::string> importNames;
+		std::vector<MSSymbol> imports;
+		for (auto& signature : Imports)
+			imports.push_back(ParseImport(signature, importNames));
+
+		std::string outputFile = OutputFile;
+		if (outputFile.empty())
+		{
+			if (InputFiles.size() > 1)
+				throw MSCompileException("several scripts need a library output, -o <name>.lib");
+
+			llvm::SmallString<128> path(InputFiles[0]);
+			llvm::sys::path::replace_extension(path, triple.isOSWindows() ? ".obj" : ".o");
+			outputFile = path.str().str();
+		}
+		llvm::StringRef extension = llvm::sys::path::extension(outputFile);
+		bool isLibrary = extension == ".lib" || extension == ".a";
+		if (!isLibrary && InputFiles.size() > 1)
+			throw MSCompileException("several scripts need a library output, -o <name>.lib");
+
+		std::string headerFile = HeaderFile;
+		if (headerFile.empty())
+		{
+			llvm::SmallString<128> path(outputFile);
+			llvm::sys::path::replace_extension(path, ".h");
+			headerFile = path.str().str();
+		}
+
+		llvm::LLVMContext context;
+		std::vector<CompiledScript> scripts;
+		std::map<std::string, MSSymbol> usedImports;
+		for (auto& path : InputFiles)
+		{
+			try
+			{
+				scripts.push_back(CompileScript(context, *pTargetMachine, path, imports, usedImports, options));
+			}
+			catch (MSCompileException e)
+			{
+				ErrorCallback(GetScriptId(path).c_str(), 0, 0, e.what());
+				return 1;
+			}
+		}
+
+		//	Several scripts with the same file name would define the same symbols
+		std::set<std::string> prefixes;
+		for (auto& script : scripts)
+		{
+			if (!prefixes.insert(script.prefix).second)
+				throw MSCompileException(("several scripts named " + script.prefix).c_str());
+		}
+
+		if (isLibrary)
+			WriteLibrary(outputFile, scripts, triple);
+		else
+			WriteFile(outputFile, llvm::StringRef(scripts[0].object.data(), scripts[0].object.size()));
+
+		WriteFile(headerFile, GenerateHeader(scripts, usedImports));
+	}
+	catch (MSCompileException e)
+	{
+		std::cerr << "msc : " << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
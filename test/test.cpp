@@ -4,15 +4,23 @@
 #include "stdafx.h"
 
 #include <windows.h>
+#include <psapi.h>
 #include <vector>
 #include <iostream>
 #include <fstream>
 #include <map>
 #include <array>
 #include <memory>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <thread>
+#include <atomic>
 
 #include "../MyScript/MyScript.hpp"
 
+#pragma comment(lib, "psapi.lib")
+
 class Timer
 {
 	LARGE_INTEGER m_frequency;
@@ -70,6 +78,638 @@ std::vector<char> LoadFile(const std::string& filename)
 
 	return std::move(buffer);
 }
+//	Find an exported script symbol by name
+bool FindSymbol(HANDLE hScript, const char* name, MSSymbol* pSymbol)
+{
+	MSSymbolEnumerator enumerator(hScript);
+	while (enumerator.Next())
+	{
+		if (strcmp(enumerator.Current().name, name) == 0)
+		{
+			*pSymbol = enumerator.Current();
+			return true;
+		}
+	}
+	return false;
+}
+
+//	String heavy function, mostly measures refcounting and string allocation
+const char benchmarkStringsSource[] =
+	"function bench() : int\n"
+	"	string a = \"hello \";\n"
+	"	string b = \"world\";\n"
+	"	string s = strcat(a, b);\n"
+	"	string t = s;\n"
+	"	t = substr(s, 0, strlen(a));\n"
+	"	s = strcat(t, b);\n"
+	"	s = strcat(strcat(s, a), strcat(t, b));\n"
+	"	return strlen(s) + strcmp(s, t);\n"
+	"end\n";
+
+//	Time of count calls to the bench function of the strings benchmark, in ms
+double TimeBenchmarkStrings(HANDLE hScript, int count, int& result)
+{
+	MSSymbol symbol;
+	if (!FindSymbol(hScript, "bench", &symbol))
+		return -1;
+
+	int(*bench)() = reinterpret_cast<int(*)()>(symbol.address);
+
+	Timer timer;
+	timer.Start();
+
+	result = 0;
+	for (int i = 0; i < count; ++i)
+		result += bench();
+
+	timer.Stop();
+	return timer.GetElapsedMs();
+}
+
+void BenchmarkStrings(HANDLE hContext, int count, const MSCompileOptions& options, const char* label)
+{
+	Timer timer;
+
+	timer.Start();
+	//	Script names must be unique in a context
+	std::string id = std::string("bench_strings_") + label + ".ms";
+	HANDLE hScript = MSCompile(hContext, id.c_str(), benchmarkStringsSource, sizeof(benchmarkStringsSource) - 1, nullptr, 0, &options, error_callback);
+	timer.Stop();
+	if (!hScript)
+		return;
+
+	std::wcout << "strings benchmark (" << label << ") : compiled in " << timer.GetElapsedMs() << " ms" << std::endl;
+
+	int result = 0;
+	double inlineMs = TimeBenchmarkStrings(hScript, count, result);
+	std::wcout << "strings benchmark : " << count << " calls in " << inlineMs << " ms (" << result << ")" << std::endl;
+
+	MSCloseHandle(hScript);
+
+#ifdef MS_BENCHMARK_HOOKS
+	//	Baseline, same script with refcounting through runtime calls. Only in builds defining MS_BENCHMARK_HOOKS for both projects.
+	MSSetRefcountCalls(hContext, TRUE);
+	id = std::string("bench_strings_calls_") + label + ".ms";
+	hScript = MSCompile(hContext, id.c_str(), benchmarkStringsSource, sizeof(benchmarkStringsSource) - 1, nullptr, 0, &options, error_callback);
+	MSSetRefcountCalls(hContext, FALSE);
+	if (!hScript)
+		return;
+
+	double callsMs = TimeBenchmarkStrings(hScript, count, result);
+	std::wcout << "strings benchmark : " << count << " calls in " << callsMs << " ms with refcount calls (" << result << "), inline is "
+		<< callsMs / inlineMs << "x faster" << std::endl;
+
+	MSCloseHandle(hScript);
+#endif
+}
+
+//	Configuration like script, only run once
+const char runOnceSource[] =
+	"string name = \"config\";\n"
+	"int total = 0;\n"
+	"int i = 0;\n"
+	"while(i < 100) do\n"
+	"	total = total + i * 2;\n"
+	"	i = i + 1;\n"
+	"end\n"
+	"if(strcmp(name, \"config\") == 0) then\n"
+	"	setting(strcat(name, \".total\"), total);\n"
+	"end\n";
+
+int settingTotal = 0;
+void setting(const wchar_t* name, int value)
+{
+	settingTotal = value;
+}
+
+void BenchmarkRunOnce(HANDLE hContext, MSExecutionMode executionMode, const char* label)
+{
+	std::vector<MSSymbol> symbols =
+	{
+		MSSymbolFromCFunction(setting, "setting"),
+	};
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, executionMode, NULL, FALSE };
+
+	Timer timer;
+
+	timer.Start();
+	std::string id = std::string("run_once_") + label + ".ms";
+	HANDLE hScript = MSCompile(hContext, id.c_str(), runOnceSource, sizeof(runOnceSource) - 1, symbols.data(), symbols.size(), &options, error_callback);
+	if (!hScript)
+		return;
+
+	MSExecute(hContext, hScript);
+	timer.Stop();
+
+	std::wcout << "run once (" << label << ") : compiled and executed in " << timer.GetElapsedMs() * 1000.0 << " us (" << settingTotal << ")" << std::endl;
+
+	MSCloseHandle(hScript);
+}
+
+//	String temporary passed to a script function, whose locals reuse the registers above its arguments
+const char stringArgumentSource[] =
+	"function count(string s) : int\n"
+	"	int n = strlen(s);\n"
+	"	int m = n * 2;\n"
+	"	string t = strcat(s, \"!\");\n"
+	"	return m + strlen(t);\n"
+	"end\n"
+	"int total = 0;\n"
+	"int i = 0;\n"
+	"while(i < 1000) do\n"
+	"	total = total + count(strcat(\"ab\", \"cd\"));\n"
+	"	i = i + 1;\n"
+	"end\n"
+	"setting(\"total\", total);\n";
+
+//	Interpreter and JIT must agree, temporaries are released by the caller once the call returns
+void TestStringArguments(HANDLE hContext, MSExecutionMode executionMode, const char* label)
+{
+	std::vector<MSSymbol> symbols =
+	{
+		MSSymbolFromCFunction(setting, "setting"),
+	};
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O0, NULL, NULL, FALSE, 0, FALSE, executionMode, NULL, FALSE };
+
+	std::string id = std::string("string_arguments_") + label + ".ms";
+	HANDLE hScript = MSCompile(hContext, id.c_str(), stringArgumentSource, sizeof(stringArgumentSource) - 1, symbols.data(), symbols.size(), &options, error_callback);
+	if (!hScript)
+	{
+		std::wcout << "string arguments (" << label << ") : FAILED to compile" << std::endl;
+		return;
+	}
+
+	settingTotal = 0;
+	MSExecute(hContext, hScript);
+
+	//	count("abcd") is 4 * 2 + strlen("abcd!")
+	std::wcout << "string arguments (" << label << ") : " << (settingTotal == 13000 ? "ok" : "FAILED") << " (" << settingTotal << ")" << std::endl;
+
+	MSCloseHandle(hScript);
+}
+
+//	Function fi calls a lower one, most likely in another partition, when crossCalls is true
+int GetCalleeIndex(int i)
+{
+	return (i * 7919 + 13) % i;
+}
+std::string GenerateSource(int functionCount, bool crossCalls = false)
+{
+	std::string source;
+	for (int i = 0; i < functionCount; ++i)
+	{
+		std::string name = "f" + std::to_string(i);
+		source += "function " + name + "(int a, string s) : int\n";
+		source += "	int n = 0;\n";
+		source += "	while(n < a) do\n";
+		source += "		s = strcat(s, \"" + name + "\");\n";
+		source += "		n = n + strlen(s);\n";
+		source += "	end\n";
+		if (crossCalls && i > 0)
+			source += "	return n + f" + std::to_string(GetCalleeIndex(i)) + "(1, \"\");\n";
+		else
+			source += "	return n;\n";
+		source += "end\n";
+	}
+	return source;
+}
+//	What fi(a, "") of GenerateSource(functionCount, true) returns
+int GetGeneratedResult(int i, int a)
+{
+	int nameLength = 1 + static_cast<int>(std::to_string(i).size());
+	int length = 0;
+	int n = 0;
+	while (n < a)
+	{
+		length += nameLength;
+		n += length;
+	}
+	return i > 0 ? n + GetGeneratedResult(GetCalleeIndex(i), 1) : n;
+}
+
+//	Large generated script, code generation is split across cores. Calls between functions check partitions are linked together.
+void BenchmarkCompile(HANDLE hContext, int functionCount)
+{
+	std::string source = GenerateSource(functionCount, true);
+
+	Timer timer;
+
+	timer.Start();
+	HANDLE hScript = MSCompile(hContext, "bench_compile.ms", source.data(), source.size(), nullptr, 0, nullptr, error_callback);
+	timer.Stop();
+	if (!hScript)
+		return;
+
+	std::wcout << "compile benchmark : " << functionCount << " functions compiled in " << timer.GetElapsedMs() << " ms" << std::endl;
+
+	int failures = 0;
+	for (int i : { 0, 1, functionCount / 3, functionCount / 2, functionCount - 1 })
+	{
+		MSSymbol symbol;
+		std::string name = "f" + std::to_string(i);
+		if (!FindSymbol(hScript, name.c_str(), &symbol) || MSSymbolFunctor<int>(symbol)(100, L"") != GetGeneratedResult(i, 100))
+			++failures;
+	}
+	std::wcout << "compile benchmark : calls across partitions " << (failures == 0 ? "ok" : "FAILED") << std::endl;
+
+	MSCloseHandle(hScript);
+}
+
+//	Each run uses a new context, like a process restart. Only the first run compiles when the cache directory is empty.
+void BenchmarkCache(int functionCount, int runCount)
+{
+	std::string source = GenerateSource(functionCount);
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_JIT, "mscache", FALSE };
+
+	for (int i = 0; i < runCount; ++i)
+	{
+		HANDLE hContext = MSCreateContext();
+
+		Timer timer;
+
+		timer.Start();
+		HANDLE hScript = MSCompile(hContext, "bench_cache.ms", source.data(), source.size(), nullptr, 0, &options, error_callback);
+		timer.Stop();
+
+		if (hScript)
+		{
+			std::wcout << "cache benchmark : run " << i << ", " << functionCount << " functions compiled in " << timer.GetElapsedMs() << " ms" << std::endl;
+			MSCloseHandle(hScript);
+		}
+
+		MSCloseHandle(hContext);
+	}
+}
+
+//	Contexts reuse the target machines and IR contexts of previous ones, so creating one and compiling a small script
+//	should only take microseconds once the first context warmed the process
+void BenchmarkStartup(int iterations)
+{
+	const char source[] = "function f(int a) : int\n	return a + 1;\nend\n";
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O0, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_JIT, NULL, FALSE };
+
+	Timer timer;
+
+	timer.Start();
+	for (int i = 0; i < iterations; ++i)
+		MSCloseHandle(MSCreateContext());
+	timer.Stop();
+
+	std::wcout << "startup benchmark : context created and closed in " << timer.GetElapsedMs() * 1000.0 / iterations << " us" << std::endl;
+
+	//	O2 runs the optimization pipelines cached by the target machines of the pool
+	for (MSOptimizationLevel level : { MSOptimizationLevel::MS_OPTIMIZATION_O0, MSOptimizationLevel::MS_OPTIMIZATION_O2 })
+	{
+		options.optimizationLevel = level;
+
+		double compileMs = 0;
+		for (int i = 0; i < iterations; ++i)
+		{
+			HANDLE hContext = MSCreateContext();
+
+			timer.Start();
+			HANDLE hScript = MSCompile(hContext, "startup.ms", source, sizeof(source) - 1, nullptr, 0, &options, error_callback);
+			timer.Stop();
+			compileMs += timer.GetElapsedMs();
+
+			if (hScript)
+				MSCloseHandle(hScript);
+			MSCloseHandle(hContext);
+		}
+
+		std::wcout << "startup benchmark : small script compiled at O" << (level == MSOptimizationLevel::MS_OPTIMIZATION_O0 ? 0 : 2)
+			<< " in a new context in " << compileMs * 1000.0 / iterations << " us" << std::endl;
+	}
+}
+
+//	Many threads compile small scripts on one context, each script checks it got its own code
+void StressConcurrentCompile(HANDLE hContext, int threadCount, int scriptsPerThread)
+{
+	std::atomic<int> failures(0);
+
+	Timer timer;
+
+	timer.Start();
+	std::vector<std::thread> threads;
+	for (int t = 0; t < threadCount; ++t)
+	{
+		threads.emplace_back([=, &failures]()
+		{
+			for (int i = 0; i < scriptsPerThread; ++i)
+			{
+				int expected = t * scriptsPerThread + i;
+				std::string source =
+					"function value(string s) : int\n"
+					"	return strlen(s) + " + std::to_string(expected) + ";\n"
+					"end\n";
+
+				//	Mix eager and lazy compilation
+				MSCompileOptions options = { i % 2 == 0 ? MSOptimizationLevel::MS_OPTIMIZATION_O2 : MSOptimizationLevel::MS_OPTIMIZATION_O0,
+					NULL, NULL, FALSE, 0, i % 3 == 0, MSExecutionMode::MS_EXECUTION_JIT, NULL, FALSE };
+
+				std::string id = "stress_" + std::to_string(t) + "_" + std::to_string(i) + ".ms";
+				HANDLE hScript = MSCompile(hContext, id.c_str(), source.data(), source.size(), nullptr, 0, &options, error_callback);
+				if (!hScript)
+				{
+					++failures;
+					continue;
+				}
+
+				MSSymbol symbol;
+				if (!FindSymbol(hScript, "value", &symbol) || MSSymbolFunctor<int>(symbol)(static_cast<const wchar_t*>(L"abc")) != expected + 3)
+					++failures;
+
+				MSCloseHandle(hScript);
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+	timer.Stop();
+
+	std::wcout << "concurrent compile : " << threadCount * scriptsPerThread << " scripts on " << threadCount << " threads in " << timer.GetElapsedMs() << " ms, " << failures << " failures" << std::endl;
+}
+
+//	Startup with many scripts, compiled in a loop then as a batch
+void BenchmarkBatch(HANDLE hContext, int scriptCount)
+{
+	std::vector<std::string> ids;
+	std::vector<std::string> sources;
+	for (int i = 0; i < scriptCount; ++i)
+	{
+		sources.push_back(GenerateSource(10));
+		ids.push_back("batch_" + std::to_string(i) + ".ms");
+	}
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_JIT, NULL, FALSE };
+
+	Timer timer;
+
+	//	Script names must be unique in a context, so the loop uses other ids
+	timer.Start();
+	for (int i = 0; i < scriptCount; ++i)
+	{
+		std::string id = "loop_" + ids[i];
+		HANDLE hScript = MSCompile(hContext, id.c_str(), sources[i].data(), sources[i].size(), nullptr, 0, &options, error_callback);
+		if (hScript)
+			MSCloseHandle(hScript);
+	}
+	timer.Stop();
+	std::wcout << "batch benchmark : " << scriptCount << " scripts compiled in a loop in " << timer.GetElapsedMs() << " ms" << std::endl;
+
+	std::vector<MSBatchSource> batch;
+	for (int i = 0; i < scriptCount; ++i)
+		batch.push_back({ ids[i].c_str(), sources[i].data(), static_cast<DWORD>(sources[i].size()) });
+
+	std::vector<HANDLE> scripts(scriptCount);
+
+	timer.Start();
+	DWORD compiledCount = MSCompileBatch(hContext, batch.data(), batch.size(), nullptr, 0, &options, scripts.data(), error_callback);
+	timer.Stop();
+	std::wcout << "batch benchmark : " << compiledCount << " scripts compiled as a batch in " << timer.GetElapsedMs() << " ms" << std::endl;
+
+	//	Small scripts share slab pages
+	MSMemoryInfo info;
+	if (scripts[0] && MSGetMemoryInfo(hContext, scripts[0], &info))
+		std::wcout << "batch benchmark : " << info.codeSize << " bytes of code, " << info.readOnlySize + info.readWriteSize << " bytes of data per script" << std::endl;
+	if (MSGetMemoryInfo(hContext, NULL, &info))
+		std::wcout << "batch benchmark : " << info.codeSize / 1024 << " KB of code in " << info.reservedSize / 1024 << " KB of slabs" << std::endl;
+
+	for (HANDLE hScript : scripts)
+	{
+		if (hScript)
+			MSCloseHandle(hScript);
+	}
+}
+
+size_t GetWorkingSetSize()
+{
+	PROCESS_MEMORY_COUNTERS counters;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return 0;
+	return counters.WorkingSetSize;
+}
+
+//	Closed scripts are removed from the JIT, so memory should stay flat. Literals change every cycle, so pooled IR
+//	contexts get new constants each time like with real scripts.
+//	Tiered scripts are called past their threshold, so they are closed while their tier-up may still be running
+void SoakCompileClose(HANDLE hContext, int cycles, BOOL tiered)
+{
+	//	Warm-up fills the pools and the JIT slabs before the baseline is taken
+	const int warmupCycles = std::min(cycles / 10, 1000);
+	const size_t maxGrowth = 16 * 1024 * 1024;
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, tiered, 2, FALSE, MSExecutionMode::MS_EXECUTION_JIT, NULL, FALSE };
+	const char* label = tiered ? "soak (tiered)" : "soak";
+
+	size_t baseline = 0;
+	int failures = 0;
+	for (int i = 0; i < cycles; ++i)
+	{
+		std::string source =
+			"function f(int a) : int\n"
+			"	string s = \"soak" + std::to_string(i) + "\";\n"
+			"	return a * " + std::to_string(i % 1000 + 2) + " + strlen(s);\n"
+			"end\n";
+
+		//	Same id every time, it is free again once closed
+		HANDLE hScript = MSCompile(hContext, "soak.ms", source.data(), source.size(), nullptr, 0, &options, error_callback);
+		if (!hScript)
+			return;
+
+		MSSymbol symbol;
+		bool found = FindSymbol(hScript, "f", &symbol);
+		for (int j = 0; j < 3; ++j)
+		{
+			if (!found || MSSymbolFunctor<int>(symbol)(1) != i % 1000 + 2 + 4 + static_cast<int>(std::to_string(i).size()))
+				++failures;
+		}
+
+		MSCloseHandle(hScript);
+
+		if (i + 1 == warmupCycles)
+			baseline = GetWorkingSetSize();
+
+		if (i % 10000 == 0 || i == cycles - 1)
+		{
+			MSMemoryInfo info;
+			MSGetMemoryInfo(hContext, NULL, &info);
+			std::wcout << label << " : " << i + 1 << " cycles, working set " << GetWorkingSetSize() / 1024 << " KB, JIT slabs " << info.reservedSize / 1024 << " KB" << std::endl;
+		}
+	}
+
+	size_t current = GetWorkingSetSize();
+	size_t growth = current > baseline ? current - baseline : 0;
+	std::wcout << label << " : working set grew by " << growth / 1024 << " KB after warm-up, " << failures << " wrong results : "
+		<< (growth <= maxGrowth && failures == 0 ? "ok" : "FAILED") << std::endl;
+}
+
+//	Hot reload: the new version compiles in background while the old one keeps serving
+//	Recompiles a script in background with the same id, while the old version keeps serving
+void TestCompileAsync(HANDLE hContext)
+{
+	const char v1[] = "function version() : int\n	return 1;\nend\n";
+	const char v2[] = "function version() : int\n	return 2;\nend\n";
+
+	HANDLE hScript = MSCompile(hContext, "async.ms", v1, sizeof(v1) - 1, nullptr, 0, nullptr, error_callback);
+	if (!hScript)
+		return;
+
+	MSSymbol symbol;
+	FindSymbol(hScript, "version", &symbol);
+
+	//	Queued behind the reload, then canceled before it runs
+	HANDLE hLowPriority = MSCompileAsync(hContext, "reload_low.ms", v2, sizeof(v2) - 1, nullptr, 0, nullptr, MSCompilePriority::MS_PRIORITY_LOW, nullptr, nullptr, error_callback);
+	HANDLE hCompile = MSCompileAsync(hContext, "async.ms", v2, sizeof(v2) - 1, nullptr, 0, nullptr, MSCompilePriority::MS_PRIORITY_HIGH, nullptr, nullptr, error_callback);
+	MSCancelCompile(hLowPriority);
+
+	int calls = 0;
+	while (MSWaitCompile(hCompile, 0) == MSCompileStatus::MS_COMPILE_PENDING || MSWaitCompile(hCompile, 0) == MSCompileStatus::MS_COMPILE_RUNNING)
+	{
+		MSSymbolFunctor<int>(symbol)();
+		++calls;
+	}
+
+	//	Old version is unloaded, the new one must not use any of its code
+	HANDLE hNewScript = MSGetCompileResult(hCompile);
+	MSCloseHandle(hScript);
+	hScript = hNewScript;
+
+	int version = 0;
+	if (hScript && FindSymbol(hScript, "version", &symbol))
+		version = MSSymbolFunctor<int>(symbol)();
+
+	std::wcout << "async compile : " << calls << " calls to the old version while compiling, now version " << version
+		<< ", low priority status " << MSWaitCompile(hLowPriority, INFINITE) << std::endl;
+	bool ok = version == 2 && MSWaitCompile(hLowPriority, INFINITE) == MSCompileStatus::MS_COMPILE_CANCELED;
+	std::wcout << "async compile : same id recompiled, low priority canceled " << (ok ? "ok" : "FAILED") << std::endl;
+
+	MSCloseHandle(hLowPriority);
+	MSCloseHandle(hCompile);
+	MSCloseHandle(hScript);
+}
+
+//	Host keeps calling the same address on another thread while the script is reloaded
+void TestReload(HANDLE hContext)
+{
+	const char v1[] = "function version() : int\n	return 1;\nend\n";
+	const char v2[] = "function version() : int\n	return 2;\nend\n";
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O2, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_JIT, NULL, TRUE };
+
+	HANDLE hScript = MSCompile(hContext, "reload.ms", v1, sizeof(v1) - 1, nullptr, 0, &options, error_callback);
+	if (!hScript)
+		return;
+
+	MSSymbol symbol;
+	if (!FindSymbol(hScript, "version", &symbol))
+	{
+		MSCloseHandle(hScript);
+		return;
+	}
+	int(*version)() = reinterpret_cast<int(*)()>(symbol.address);
+
+	std::atomic<bool> stop(false);
+	std::atomic<int> oldCalls(0);
+	std::atomic<int> newCalls(0);
+	std::thread caller([&]()
+	{
+		while (!stop)
+		{
+			if (version() == 1)
+				++oldCalls;
+			else
+				++newCalls;
+		}
+	});
+
+	int reloads = 0;
+	for (; reloads < 10; ++reloads)
+	{
+		const char* source = reloads % 2 == 0 ? v2 : v1;
+		if (!MSReload(hContext, hScript, source, sizeof(v1) - 1, nullptr, 0, &options, error_callback))
+			break;
+
+		//	Caller runs each version at least once
+		std::atomic<int>& calls = reloads % 2 == 0 ? newCalls : oldCalls;
+		int previousCalls = calls;
+		while (calls == previousCalls)
+			std::this_thread::yield();
+	}
+	stop = true;
+	caller.join();
+
+	//	Last reload is back to version 1
+	bool ok = reloads == 10 && version() == 1 && oldCalls > 0 && newCalls > 0;
+	std::wcout << "reload : " << oldCalls << " calls to version 1, " << newCalls << " to version 2 : " << (ok ? "ok" : "FAILED") << std::endl;
+
+	MSCloseHandle(hScript);
+}
+
+//	Functions of test.ms folded at compile time, compared with the same operations done at runtime
+void TestConstantFolding(const std::map<std::string, MSSymbol>& symbols)
+{
+	bool ok = true;
+	try
+	{
+		auto call = [&](const char* name) { return MSSymbolFunctor<int>(symbols.at(name))(); };
+		auto callString = [&](const char* name) { return MSSmartString(MSSymbolFunctor<MSString>(symbols.at(name))()); };
+		auto equals = [](const MSSmartString& s, const wchar_t* expected)
+		{
+			const wchar_t* str = s;
+			return str == nullptr ? expected == nullptr : expected != nullptr && wcscmp(str, expected) == 0;
+		};
+
+		MSSymbolFunctor<int> add(symbols.at("runtime_add"));
+		MSSymbolFunctor<int> multiply(symbols.at("runtime_multiply"));
+		MSSymbolFunctor<int> divide(symbols.at("runtime_divide"));
+		MSSymbolFunctor<int> modulo(symbols.at("runtime_modulo"));
+		MSSymbolFunctor<int> compare(symbols.at("runtime_strcmp"));
+		MSSymbolFunctor<MSString> concat(symbols.at("runtime_strcat"));
+		MSSymbolFunctor<MSString> substring(symbols.at("runtime_substr"));
+
+		//	Integer arithmetic wraps around
+		ok &= call("fold_add_wrap") == INT_MIN && call("fold_add_wrap") == add(INT_MAX, 1);
+		ok &= call("fold_multiply_wrap") == 65536 && call("fold_multiply_wrap") == multiply(65536, 65537);
+		ok &= call("fold_divide_negative") == -3 && call("fold_divide_negative") == divide(-7, 2);
+		ok &= call("fold_modulo_negative") == -1 && call("fold_modulo_negative") == modulo(-7, 3);
+
+		//	Division by 0 and INT_MIN / -1 must be left for runtime, the script must still compile
+		symbols.at("fold_divide_zero");
+		symbols.at("fold_modulo_zero");
+		symbols.at("fold_divide_overflow");
+
+		//	Builtins on literals
+		const wchar_t* abc = L"abc";
+		const wchar_t* abd = L"abd";
+		const wchar_t* ab = L"ab";
+		ok &= call("fold_strlen") == 50;
+		ok &= call("fold_strcmp_less") == compare(abc, abd) && call("fold_strcmp_less") < 0;
+		ok &= call("fold_strcmp_greater") == compare(abd, abc) && call("fold_strcmp_greater") > 0;
+		ok &= call("fold_strcmp_length") == compare(ab, abc) && call("fold_strcmp_length") != 0;
+
+		const wchar_t* hello = L"hello";
+		const wchar_t* world = L" world";
+		const wchar_t* helloWorld = L"hello world";
+		ok &= equals(callString("fold_strcat"), L"hello world") && equals(MSSmartString(concat(hello, world)), L"hello world");
+		ok &= equals(callString("fold_substr"), L"world") && equals(MSSmartString(substring(helloWorld, 6, 100)), L"world");
+		ok &= equals(callString("fold_substr_empty"), nullptr) && equals(MSSmartString(substring(hello, 5, 1)), nullptr);
+
+		//	Over the string budget of the evaluator, computed at runtime instead
+		ok &= call("fold_string_budget") == 131072;
+	}
+	catch (std::out_of_range)
+	{
+		ok = false;
+	}
+
+	std::wcout << "constant folding : " << (ok ? "ok" : "FAILED") << std::endl;
+}
+
 int main()
 {
 	std::vector<char> buffer = LoadFile("test.ms");
@@ -86,7 +726,7 @@ int main()
 
 	timer.Start();
 
-	HANDLE hScript = MSCompile(hContext, "test.ms", buffer.data(), buffer.size(), symbols.data(), symbols.size(), error_callback);
+	HANDLE hScript = MSCompile(hContext, "test.ms", buffer.data(), buffer.size(), symbols.data(), symbols.size(), nullptr, error_callback);
 
 	timer.Stop();
 	std::wcout << "compile time : " << timer.GetElapsedMs() << std::endl;
@@ -117,8 +757,43 @@ int main()
 		std::wcout << L"GetAuthorName function not found" << std::endl;
 	}
 
+	TestConstantFolding(exportedSymbols);
+
 	MSCloseHandle(hScript);
+
+	MSCompileOptions options = { MSOptimizationLevel::MS_OPTIMIZATION_O0, NULL, NULL, FALSE, 0, FALSE, MSExecutionMode::MS_EXECUTION_AUTO, NULL, FALSE };
+	BenchmarkStrings(hContext, 1000000, options, "O0");
+
+	options.optimizationLevel = MSOptimizationLevel::MS_OPTIMIZATION_O3;
+	BenchmarkStrings(hContext, 1000000, options, "O3");
+
+	//	Starts at O0, bench is recompiled at O3 in background once hot
+	options.tiered = TRUE;
+	BenchmarkStrings(hContext, 1000000, options, "tiered");
+
+	//	Compile time only includes parsing and IR generation, bench is compiled on first call
+	options.tiered = FALSE;
+	options.lazy = TRUE;
+	BenchmarkStrings(hContext, 1000000, options, "lazy");
+
+	BenchmarkCompile(hContext, 5000);
+
+	BenchmarkRunOnce(hContext, MSExecutionMode::MS_EXECUTION_INTERPRETER, "interpreter");
+	BenchmarkRunOnce(hContext, MSExecutionMode::MS_EXECUTION_JIT, "jit");
+	TestStringArguments(hContext, MSExecutionMode::MS_EXECUTION_INTERPRETER, "interpreter");
+	TestStringArguments(hContext, MSExecutionMode::MS_EXECUTION_JIT, "jit");
+
+	StressConcurrentCompile(hContext, 8, 50);
+	TestCompileAsync(hContext);
+	BenchmarkBatch(hContext, 1000);
+	TestReload(hContext);
+	SoakCompileClose(hContext, 100000, FALSE);
+	SoakCompileClose(hContext, 20000, TRUE);
+
 	MSCloseHandle(hContext);
+
+	BenchmarkCache(5000, 3);
+	BenchmarkStartup(1000);
 	return 0;
 }
 